@@ -0,0 +1,404 @@
+/**
+ * Benchmarks for the frame build and parse paths and for whole cycles.
+ *
+ *   g++ -x c++ -O2 -o ec_bench src/bench.c src/ethercat*.c -lpthread
+ *
+ *   ec_bench [-f csv|json] [-t transport] [-d device] [-n cycles] [build|parse|cycle ...]
+ *   ec_bench respond <device> [slaves]
+ *
+ * Results are written to stdout, one row (csv) or object (json lines)
+ * per measurement. The cycle benchmark defaults to the simulated bus,
+ * to measure a real link run "ec_bench respond vtest1" on one end of a
+ * veth pair and "ec_bench -t socket -d vtest0 cycle" on the other.
+ */
+
+#include "ethercat.h"
+#include "ethercat_internal.h"
+#include "ethercat_sim.h"
+#include "ethercat_socket.h"
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t *ec_add_operation(uint8_t *ptr, const ethercat_operations_t *operations, int index, bool more);
+uint8_t *ec_read_header(uint8_t *buffer, ethercat_header_t *header);
+uint8_t *ec_read_datagram(uint8_t *buffer, datagram_t *datagram);
+
+static const int datagram_counts[] = { 1, 2, 5, 10, 20, 50, 100, 200 };
+static const int payload_sizes[] = { 2, 8, 32, 128, 512, 1486 };
+
+static const int BENCH_COUNTS = sizeof(datagram_counts) / sizeof(datagram_counts[0]);
+static const int BENCH_SIZES = sizeof(payload_sizes) / sizeof(payload_sizes[0]);
+
+// Frame bytes and iterations per build/parse measurement
+static const int64_t BENCH_BYTES = 400000000;
+static const int64_t BENCH_MAX_ITERATIONS = 2000000;
+
+static bool json = false;
+
+// Keeps the compiler from discarding benchmarked work
+static volatile uint64_t sink;
+
+
+static void report(const char *mode, const char *transport, int datagrams, int payload,
+	int64_t iterations, int64_t elapsed_ns, const ec_counters_t *counters)
+{
+	double per_iteration = (double) elapsed_ns / iterations;
+	double per_datagram = per_iteration / datagrams;
+	double per_second = 1e9 / per_iteration;
+
+	uint64_t frames = counters?counters->frames_sent:0;
+	uint64_t lost = counters?counters->frames_lost:0;
+
+	if(json) {
+		printf("{\"mode\":\"%s\",\"transport\":\"%s\",\"datagrams\":%d,\"payload\":%d,"
+			"\"iterations\":%lld,\"ns_per_iteration\":%.1f,\"ns_per_datagram\":%.2f,"
+			"\"iterations_per_second\":%.0f,\"frames\":%llu,\"frames_lost\":%llu}\n",
+			mode, transport, datagrams, payload, (long long) iterations, per_iteration, per_datagram,
+			per_second, (unsigned long long) frames, (unsigned long long) lost);
+	} else {
+		printf("%s,%s,%d,%d,%lld,%.1f,%.2f,%.0f,%llu,%llu\n",
+			mode, transport, datagrams, payload, (long long) iterations, per_iteration, per_datagram,
+			per_second, (unsigned long long) frames, (unsigned long long) lost);
+	}
+
+	fflush(stdout);
+}
+
+
+/*****************************
+ * Frame build and parse paths
+ */
+
+static int alloc_operations(ethercat_operations_t *operations, int count, int payload)
+{
+	operations->capacity = count;
+	operations->limit = count;
+	operations->free = -1;
+
+	operations->command = (uint8_t *) calloc(count, sizeof(uint8_t));
+	operations->address = (address_t *) calloc(count, sizeof(address_t));
+	operations->length = (uint16_t *) calloc(count, sizeof(uint16_t));
+	operations->flags = (int *) calloc(count, sizeof(int));
+	operations->info = (ethercat_operation_t *) calloc(count, sizeof(ethercat_operation_t));
+
+	if(!operations->command || !operations->address || !operations->length ||
+	   !operations->flags || !operations->info) {
+		perror("calloc()");
+		return -1;
+	}
+
+	for(int i = 0; i < count; i++) {
+		operations->command[i] = (i & 1)?cmd_cadr_w:cmd_cadr_r;
+		operations->address[i].physical.ado = 0x1001 + i;
+		operations->address[i].physical.adp = 0x1000;
+		operations->length[i] = payload;
+		operations->flags[i] = EC_CALL_PERIODIC;
+	}
+
+	return 0;
+}
+
+
+static void free_operations(ethercat_operations_t *operations)
+{
+	free(operations->command);
+	free(operations->address);
+	free(operations->length);
+	free(operations->flags);
+	free(operations->info);
+}
+
+
+// Builds all datagrams back-to-back behind an Ethernet and EtherCAT header
+static int build_frame(uint8_t *buffer, const ethercat_operations_t *operations)
+{
+	const uint8_t ethernet_hdr[] = {0x00, 0xd0, 0xb7, 0xbd, 0x22, 0x56, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x88, 0xa4};
+	memcpy(buffer, ethernet_hdr, 14);
+
+	uint8_t *ptr = buffer + 14 + 2;
+	for(int i = 0; i < operations->limit; i++)
+		ptr = ec_add_operation(ptr, operations, i, i + 1 < operations->limit);
+
+	int length = ptr - buffer - 14 - 2;
+	buffer[14] = length & 0xFF;
+	buffer[15] = ((length >> 8) & 0x07) | (pt_datagram << 4);
+
+	return ptr - buffer;
+}
+
+
+static int bench_frames(bool parse)
+{
+	for(int c = 0; c < BENCH_COUNTS; c++) {
+		for(int s = 0; s < BENCH_SIZES; s++) {
+			int count = datagram_counts[c];
+			int payload = payload_sizes[s];
+
+			ethercat_operations_t operations;
+			uint8_t *buffer = (uint8_t *) malloc(14 + 2 + count * (12 + payload));
+
+			if(buffer == NULL || alloc_operations(&operations, count, payload) == -1) {
+				perror("malloc()");
+				return -1;
+			}
+
+			int length = build_frame(buffer, &operations);
+			int64_t iterations = BENCH_BYTES / length;
+			if(iterations > BENCH_MAX_ITERATIONS)
+				iterations = BENCH_MAX_ITERATIONS;
+
+			int64_t start = ec_monotonic_ns();
+
+			for(int64_t i = 0; i < iterations; i++) {
+				if(parse) {
+					ethercat_header_t header;
+					datagram_t datagram;
+
+					uint8_t *ptr = ec_read_header(buffer, &header);
+					uint8_t *end = buffer + length;
+					uint64_t wkc = 0;
+
+					while(ptr < end) {
+						ptr = ec_read_datagram(ptr, &datagram);
+						wkc += *datagram.wkc + datagram.payload[0];
+					}
+
+					sink += wkc;
+				} else {
+					sink += build_frame(buffer, &operations);
+				}
+			}
+
+			report(parse?"parse":"build", "none", count, payload,
+				iterations, ec_monotonic_ns() - start, NULL);
+
+			free_operations(&operations);
+			free(buffer);
+		}
+	}
+
+	return 0;
+}
+
+
+/*****************************
+ * Complete cycles
+ */
+
+static void read_payload(const address_t address, void *payload, uint16_t length, const void *data)
+{
+	sink += ((const uint8_t *) data)[0];
+}
+
+
+static void write_payload(const address_t address, void *payload, uint16_t length, void *data)
+{
+	memcpy(data, payload, length);
+}
+
+
+static int bench_cycles(const ec_options_t *options, const char *transport, const char *device, int cycles)
+{
+	static uint8_t output[ETHERCAT_MAX_PAYLOAD];
+
+	for(int c = 0; c < BENCH_COUNTS; c++) {
+		for(int s = 0; s < BENCH_SIZES; s++) {
+			int count = datagram_counts[c];
+			int payload = payload_sizes[s];
+
+			// Beyond this nobody runs a cyclic bus
+			if((int64_t) count * (12 + payload) > 16 * ETHERCAT_MAX_FRAME)
+				continue;
+
+			ethercat_t *ethercat = ec_create_ex(device, options);
+			if(ethercat == NULL)
+				return -1;
+
+			for(int i = 0; i < count; i++) {
+				address_t address;
+				address.physical.ado = 0x0000;
+				address.physical.adp = 0x1000;
+
+				if(i & 1)
+					ec_request_write(ethercat, address, payload, write_payload, output, EC_CALL_PERIODIC);
+				else
+					ec_request_read(ethercat, address, payload, read_payload, NULL, EC_CALL_PERIODIC);
+			}
+
+			// Warm up, also compiles the frames
+			for(int i = 0; i < 100; i++)
+				ec_do_cycle(ethercat);
+
+			ec_counters_t before, after;
+			ec_get_counters(ethercat, &before);
+			int64_t start = ec_monotonic_ns();
+
+			for(int i = 0; i < cycles; i++)
+				ec_do_cycle(ethercat);
+
+			int64_t elapsed = ec_monotonic_ns() - start;
+			ec_get_counters(ethercat, &after);
+
+			after.frames_sent = (after.frames_sent - before.frames_sent) / cycles;
+			after.frames_lost -= before.frames_lost;
+
+			report("cycle", transport, count, payload, cycles, elapsed, &after);
+			ec_destroy(&ethercat);
+		}
+	}
+
+	return 0;
+}
+
+
+/*****************************
+ * Responder
+ */
+
+/**
+ * Answers every EtherCAT frame on a device like a bus of simulated
+ * slaves would, for end-to-end runs over a veth pair.
+ */
+static int respond(const char *device, int slaves)
+{
+	int sock = open_socket(device);
+	if(sock == -1)
+		return -1;
+
+	ethercat_sim_t *sim = ec_sim_create(slaves);
+	if(sim == NULL) {
+		close(sock);
+		return -1;
+	}
+
+	fprintf(stderr, "Responding on %s with %d simulated slaves.\n", device, slaves);
+
+	uint8_t buffer[ETHERCAT_MAX_FRAME];
+
+	while(true) {
+		int nbytes = recv(sock, buffer, sizeof(buffer), 0);
+
+		if(nbytes == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				struct pollfd pfd;
+				pfd.fd = sock;
+				pfd.events = POLLIN;
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			perror("recv()");
+			break;
+		}
+
+		ec_sim_process(sim, buffer, nbytes);
+
+		if(send(sock, buffer, nbytes, MSG_DONTROUTE) == -1)
+			perror("send()");
+	}
+
+	ec_sim_destroy(&sim);
+	close(sock);
+	return -1;
+}
+
+
+static int parse_transport(const char *name)
+{
+	const char *names[] = { "socket", "mmap", "xdp", "loopback", "sim" };
+	const int transports[] = { EC_TRANSPORT_SOCKET, EC_TRANSPORT_MMAP, EC_TRANSPORT_XDP,
+		EC_TRANSPORT_LOOPBACK, EC_TRANSPORT_SIM };
+
+	for(int i = 0; i < 5; i++) {
+		if(strcmp(name, names[i]) == 0)
+			return transports[i];
+	}
+
+	return -1;
+}
+
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-f csv|json] [-t socket|mmap|xdp|loopback|sim] [-d device] "
+		"[-n cycles] [build|parse|cycle ...]\n", program);
+	fprintf(stderr, "       %s respond <device> [slaves]\n", program);
+}
+
+
+int main(int argc, char **argv)
+{
+	if(argc >= 3 && strcmp(argv[1], "respond") == 0)
+		return respond(argv[2], (argc >= 4)?atoi(argv[3]):1)?1:0;
+
+	const char *transport = "sim";
+	const char *device = "sim";
+	int cycles = 10000;
+
+	int opt;
+	while((opt = getopt(argc, argv, "f:t:d:n:")) != -1) {
+		switch(opt) {
+			case 'f': json = (strcmp(optarg, "json") == 0); break;
+			case 't': transport = optarg; break;
+			case 'd': device = optarg; break;
+			case 'n': cycles = atoi(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	ec_options_t options;
+	ec_default_options(&options);
+	options.transport = parse_transport(transport);
+	options.max_operations = 256;
+	options.timeout_us = 20000;
+
+	if(options.transport == -1 || cycles <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(options.transport == EC_TRANSPORT_SIM) {
+		options.simulator = ec_sim_create(1);
+		if(options.simulator == NULL)
+			return 1;
+	}
+
+	bool all = (optind == argc);
+	bool run_build = all, run_parse = all, run_cycle = all;
+
+	for(int i = optind; i < argc; i++) {
+		if(strcmp(argv[i], "build") == 0)
+			run_build = true;
+		else if(strcmp(argv[i], "parse") == 0)
+			run_parse = true;
+		else if(strcmp(argv[i], "cycle") == 0)
+			run_cycle = true;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(!json)
+		printf("mode,transport,datagrams,payload,iterations,ns_per_iteration,ns_per_datagram,"
+			"iterations_per_second,frames,frames_lost\n");
+
+	int result = 0;
+
+	if(run_build && bench_frames(false) == -1)
+		result = 1;
+	if(run_parse && bench_frames(true) == -1)
+		result = 1;
+	if(run_cycle && bench_cycles(&options, transport, device, cycles) == -1)
+		result = 1;
+
+	ec_sim_destroy(&options.simulator);
+	return result;
+}
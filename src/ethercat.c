@@ -1,12 +1,12 @@
 #include "ethercat.h"
 #include "ethercat_internal.h"
-#include "ethercat_socket.h"
+#include "ethercat_transport.h"
 
-#include <sys/socket.h>
+#include <time.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
 
 void decode(uint8_t *buffer);
@@ -16,8 +16,186 @@ void decode(uint8_t *buffer);
  * Constructor and destructor
  */
 
+static void *ec_alloc_aligned(size_t length)
+{
+	void *buffer = NULL;
+
+	if(posix_memalign(&buffer, ETHERCAT_ALIGNMENT, length) != 0) {
+		perror("posix_memalign()");
+		return NULL;
+	}
+
+	memset(buffer, 0, length);
+	return buffer;
+}
+
+
+static void ec_free_frames(ethercat_t *ethercat)
+{
+	for(int i = 0; i < ethercat->frame_capacity; i++) {
+		if(!ethercat->frames[i].shared)
+			free(ethercat->frames[i].tx);
+		free(ethercat->frames[i].rx_buffer);
+	}
+
+	free(ethercat->frames);
+	ethercat->frames = NULL;
+	ethercat->frame_capacity = 0;
+
+	free(ethercat->spare_rx);
+	ethercat->spare_rx = NULL;
+}
+
+
+/**
+ * Makes sure buffers for at least count frames are available. Templates
+ * are kept in buffers of the transport where it offers them.
+ */
+static int ec_reserve_frames(ethercat_t *ethercat, int count)
+{
+	const ethercat_transport_ops_t *ops = ethercat->transport.ops;
+
+	if(count <= ethercat->frame_capacity)
+		return 0;
+
+	if(count > ETHERCAT_MAX_FRAMES) {
+		fprintf(stderr, "Operations need more than %d frames per cycle.\n", ETHERCAT_MAX_FRAMES);
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	ethercat_frame_t *frames = (ethercat_frame_t *) 
+		realloc(ethercat->frames, count * sizeof(ethercat_frame_t));
+
+	if(frames == NULL) {
+		perror("realloc()");
+		return -1;
+	}
+
+	ethercat->frames = frames;
+
+	for(int i = ethercat->frame_capacity; i < count; i++) {
+		ethercat_frame_t *frame = &frames[i];
+		frame->length = 0;
+		frame->received = 0;
+		frame->index = 0;
+		frame->dirty = false;
+		frame->tx = ops->frame?ops->frame(ethercat->transport.state, i):NULL;
+		frame->shared = (frame->tx != NULL);
+		if(!frame->shared)
+			frame->tx = (uint8_t *) ec_alloc_aligned(ETHERCAT_MAX_FRAME);
+		frame->rx_buffer = (uint8_t *) ec_alloc_aligned(ETHERCAT_MAX_FRAME);
+		frame->rx = frame->rx_buffer;
+
+		if(frame->tx == NULL || frame->rx_buffer == NULL) {
+			if(!frame->shared)
+				free(frame->tx);
+			free(frame->rx_buffer);
+			return -1;
+		}
+
+		ethercat->frame_capacity = i + 1;
+	}
+
+	return 0;
+}
+
+
+static void ec_free_operations(ethercat_operations_t *operations)
+{
+	free(operations->command);
+	free(operations->address);
+	free(operations->length);
+	free(operations->flags);
+	free(operations->info);
+	free(operations->order);
+	free(operations->rated);
+}
+
+
+static int ec_alloc_operations(ethercat_operations_t *operations, int capacity)
+{
+	operations->capacity = capacity;
+	operations->limit = 0;
+	operations->free = 0;
+
+	operations->command = (uint8_t *) ec_alloc_aligned(capacity * sizeof(uint8_t));
+	operations->address = (address_t *) ec_alloc_aligned(capacity * sizeof(address_t));
+	operations->length = (uint16_t *) ec_alloc_aligned(capacity * sizeof(uint16_t));
+	operations->flags = (int *) ec_alloc_aligned(capacity * sizeof(int));
+	operations->info = (ethercat_operation_t *) ec_alloc_aligned(capacity * sizeof(ethercat_operation_t));
+	operations->order = (int *) malloc(capacity * sizeof(int));
+	operations->rated = (int *) malloc(capacity * sizeof(int));
+	operations->rated_count = 0;
+
+	if(!operations->command || !operations->address || !operations->length || 
+	   !operations->flags || !operations->info || !operations->order || !operations->rated) {
+		ec_free_operations(operations);
+		return -1;
+	}
+
+	// Chain all slots on the free-list
+	for(int i = 0; i < capacity; i++) {
+		operations->command[i] = cmd_noop;
+		operations->info[i].next_free = (i + 1 < capacity)?(i + 1):-1;
+	}
+
+	return 0;
+}
+
+
+void ec_default_options(ec_options_t *options)
+{
+	options->transport = EC_TRANSPORT_SOCKET;
+	options->simulator = NULL;
+	options->max_operations = ETHERCAT_DEFAULT_OPERATIONS;
+	options->timeout_us = ETHERCAT_DEFAULT_TIMEOUT_US;
+	options->retries = ETHERCAT_DEFAULT_RETRIES;
+	options->merge_gap = ETHERCAT_DEFAULT_MERGE_GAP;
+	options->cycle_budget = 0;
+	options->cpu = -1;
+	options->priority = 0;
+	options->spin_us = 0;
+}
+
+
 ethercat_t *ec_create(const char *device)
+{
+	return ec_create_ex(device, NULL);
+}
+
+
+ethercat_t *ec_create_ex(const char *device, const ec_options_t *options)
 {	
+	ec_options_t defaults;
+
+	if(options == NULL) {
+		ec_default_options(&defaults);
+		options = &defaults;
+	}
+
+	if(options->max_operations <= 0) {
+		fprintf(stderr, "Invalid number of operations (%d).\n", options->max_operations);
+		return NULL;
+	}
+
+	if(options->timeout_us <= 0 || options->retries < 0) {
+		fprintf(stderr, "Invalid timeout (%d us) or number of retries (%d).\n", 
+			options->timeout_us, options->retries);
+		return NULL;
+	}
+
+	if(options->cycle_budget < 0) {
+		fprintf(stderr, "Invalid cycle budget (%d bytes).\n", options->cycle_budget);
+		return NULL;
+	}
+
+	if(options->priority < 0 || options->spin_us < 0) {
+		fprintf(stderr, "Invalid priority (%d) or spin time (%d us).\n",
+			options->priority, options->spin_us);
+		return NULL;
+	}
+
 	struct ethercat_t *ethercat = 
 		(struct ethercat_t *) malloc(sizeof(struct ethercat_t));
 
@@ -26,10 +204,65 @@ ethercat_t *ec_create(const char *device)
 		return NULL;
 	}
 
-	ethercat->socket = open_socket(device);
-	ethercat->operations = NULL;
+	if(ec_alloc_operations(&ethercat->operations, options->max_operations) == -1) {
+		free(ethercat);
+		return NULL;
+	}
+
+	ethercat->layout_dirty = true;
+	ethercat->frames_dirty = false;
+	ethercat->frame_count = 0;
+	ethercat->frame_capacity = 0;
+	ethercat->frames = NULL;
+	ethercat->spare_rx = (uint8_t *) ec_alloc_aligned(ETHERCAT_MAX_FRAME);
+	ethercat->next_index = 0;
+
+	ethercat->timeout_us = options->timeout_us;
+	ethercat->retries = options->retries;
+	ethercat->merge_gap = options->merge_gap;
+	ethercat->cycle_budget = options->cycle_budget;
+	ethercat->deferred = 0;
+	ethercat->next_sequence = 0;
+	ethercat->changes = -1;
+	memset(&ethercat->counters, 0, sizeof(ec_counters_t));
+
+#ifdef EC_ENABLE_STATS
+	static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+	pthread_once(&calibrated, ec_calibrate_stats_clock);
+
+	memset(&ethercat->stats, 0, sizeof(ec_stats_t));
+	ethercat->stats_reset = false;
+#endif
+
+	ethercat->image = NULL;
+	ethercat->mailbox = NULL;
+	ethercat->dc = NULL;
+
+	ethercat->submissions = NULL;
+	ethercat->backlog = NULL;
+	ethercat->backlog_tail = NULL;
+	ethercat->maps = NULL;
+	ethercat->exports = NULL;
+	ethercat->capture = NULL;
+	ethercat->recorder = NULL;
+
+	ethercat->cyclic.running = false;
+	ethercat->cyclic.cpu = options->cpu;
+	ethercat->cyclic.priority = options->priority;
+	ethercat->cyclic.spin_us = options->spin_us;
+
+	// Frames may be kept in buffers of the transport, it comes first
+	if(open_transport(device, options, &ethercat->transport) == -1) {
+		ec_free_frames(ethercat);
+		ec_free_operations(&ethercat->operations);
+		free(ethercat);
+		return NULL;
+	}
 
-	if(ethercat->socket == -1) {
+	if(ethercat->spare_rx == NULL || ec_reserve_frames(ethercat, 1) == -1) {
+		close_transport(&ethercat->transport);
+		ec_free_frames(ethercat);
+		ec_free_operations(&ethercat->operations);
 		free(ethercat);
 		return NULL;
 	}
@@ -43,7 +276,18 @@ void ec_destroy(ethercat_t **ethercatv)
 	struct ethercat_t *ethercat = *ethercatv;
 
 	if(ethercat) {
-		close(ethercat->socket);
+		ec_stop_cyclic(ethercat);
+		ec_capture_stop(ethercat);
+		ec_record_stop(ethercat);
+		close_transport(&ethercat->transport);
+
+		ec_free_export(ethercat);
+		ec_free_image(ethercat);
+		ec_free_mailbox(ethercat);
+		ec_free_dc(ethercat);
+		ec_free_submissions(ethercat);
+		ec_free_operations(&ethercat->operations);
+		ec_free_frames(ethercat);
 		free(ethercat);
 	}
 	*ethercatv = NULL;
@@ -83,129 +327,516 @@ static command_type_t write_command_from_flags(int flags)
 }
 
 
-static ethercat_operation_t* ec_create_operation(ethercat_t *ethercat)
+/**
+ * Takes a slot from the free-list, returns -1 if the table is full.
+ */
+static int ec_create_operation(ethercat_t *ethercat, command_type_t command)
 {
-	ethercat_operation_t *operation = (ethercat_operation_t *) malloc(sizeof(ethercat_operation_t));
+	ethercat_operations_t *operations = &ethercat->operations;
+	int index = operations->free;
 
-	if(operation == NULL) {
-		perror("malloc()");
+	if(index == -1) {
+		fprintf(stderr, "Operation table is full (%d operations).\n", operations->capacity);
+		return -1;
+	}
+
+	ethercat_operation_t *info = &operations->info[index];
+	operations->free = info->next_free;
+
+	operations->command[index] = command;
+	operations->length[index] = 0;
+	operations->flags[index] = 0;
+
+	info->read_callback = NULL;
+	info->write_callback = NULL;
+	info->payload = NULL;
+	info->read_data = NULL;
+	info->read_wkc = NULL;
+	info->write_data = NULL;
+	info->map = NULL;
+	info->frame = 0;
+	info->offset = 0;
+	info->scheduled = false;
+	info->idle = false;
+	info->deferred = false;
+	info->sequence = ethercat->next_sequence++;
+	info->paused = false;
+	info->changes = 0;
+	info->next_free = -1;
+
+	if(index >= operations->limit)
+		operations->limit = index + 1;
+
+	ethercat->layout_dirty = true;
+
+	return index;
+}
+
+
+static void ec_mark_frame(ethercat_t *ethercat, int frame)
+{
+	ethercat->frames[frame].dirty = true;
+	ethercat->frames_dirty = true;
+}
+
+
+/**
+ * Returns a slot to the free-list, only the frame it was sent in
+ * needs to be rebuilt.
+ */
+static void ec_remove_operation(ethercat_t *ethercat, int index)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+	ethercat_operation_t *info = &operations->info[index];
+
+	if(info->scheduled && !ethercat->layout_dirty)
+		ec_mark_frame(ethercat, info->frame);
+
+	if(info->map)
+		ec_unbind_map(ethercat, index);
+
+	operations->command[index] = cmd_noop;
+	info->scheduled = false;
+	info->changes = 0;
+	info->generation++;
+	info->next_free = operations->free;
+	operations->free = index;
+
+	while(operations->limit > 0 && operations->command[operations->limit - 1] == cmd_noop)
+		operations->limit--;
+}
+
+
+static ec_handle_t ec_make_handle(const ethercat_operations_t *operations, int index)
+{
+	return ((int64_t) (operations->info[index].generation & 0x7FFFFFFF) << 32) | index;
+}
+
+
+/**
+ * Finds the operation a handle refers to, -1 if it has finished,
+ * has been cancelled or the handle is invalid.
+ */
+int ec_find_operation(const ethercat_t *ethercat, ec_handle_t handle)
+{
+	const ethercat_operations_t *operations = &ethercat->operations;
+
+	if(handle < 0)
+		return -1;
+
+	int index = handle & 0xFFFFFFFF;
+
+	if(index >= operations->limit || operations->command[index] == cmd_noop)
+		return -1;
+
+	const ethercat_operation_t *info = &operations->info[index];
+	if((info->generation & 0x7FFFFFFF) != (handle >> 32) || (info->changes & change_cancel))
+		return -1;
+
+	return index;
+}
+
+
+/**
+ * Records a change to apply at the start of the next cycle, so
+ * changes made during a cycle never mix with its frames.
+ */
+static ethercat_operation_t *ec_change_operation(ethercat_t *ethercat, ec_handle_t handle, int change)
+{
+	int index = ec_find_operation(ethercat, handle);
+
+	if(index == -1)
 		return NULL;
+
+	ethercat_operation_t *info = &ethercat->operations.info[index];
+
+	if(!info->queued) {
+		info->queued = true;
+		info->next_change = ethercat->changes;
+		ethercat->changes = index;
+	}
+
+	// Pausing and resuming cancel each other out
+	if(change & (change_pause | change_resume))
+		info->changes &= ~(change_pause | change_resume);
+
+	info->changes |= change;
+	return info;
+}
+
+
+int ec_cancel(ethercat_t *ethercat, ec_handle_t handle)
+{
+	return ec_change_operation(ethercat, handle, change_cancel)?0:-1;
+}
+
+
+int ec_pause(ethercat_t *ethercat, ec_handle_t handle)
+{
+	return ec_change_operation(ethercat, handle, change_pause)?0:-1;
+}
+
+
+int ec_resume(ethercat_t *ethercat, ec_handle_t handle)
+{
+	return ec_change_operation(ethercat, handle, change_resume)?0:-1;
+}
+
+
+int ec_modify(ethercat_t *ethercat, ec_handle_t handle, const address_t address, uint16_t length)
+{
+	if(length > ETHERCAT_MAX_PAYLOAD) {
+		fprintf(stderr, "Request of %d bytes does not fit in a frame.\n", length);
+		return -1;
+	}
+
+	ethercat_operation_t *info = ec_change_operation(ethercat, handle, change_layout);
+
+	if(info == NULL)
+		return -1;
+
+	info->new_address = address;
+	info->new_length = length;
+	return 0;
+}
+
+
+int ec_modify_callbacks(ethercat_t *ethercat, ec_handle_t handle, ec_write_callback_t *write_callback,
+	ec_read_callback_t *read_callback, void *payload)
+{
+	ethercat_operation_t *info = ec_change_operation(ethercat, handle, change_callbacks);
+
+	if(info == NULL)
+		return -1;
+
+	info->new_write_callback = write_callback;
+	info->new_read_callback = read_callback;
+	info->new_payload = payload;
+	return 0;
+}
+
+
+static bool is_low_priority(int flags)
+{
+	return (flags & (EC_CALL_ONESHOT | EC_CALL_LOW_PRIORITY)) == (EC_CALL_ONESHOT | EC_CALL_LOW_PRIORITY);
+}
+
+
+/**
+ * Applies the changes made through handles since the last cycle. Frames
+ * holding changed operations are marked for rebuilding, a resumed
+ * operation joins the last frame.
+ */
+static void ec_apply_changes(ethercat_t *ethercat)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+
+	while(ethercat->changes != -1) {
+		int i = ethercat->changes;
+		ethercat_operation_t *info = &operations->info[i];
+		int changes = info->changes;
+
+		ethercat->changes = info->next_change;
+		info->queued = false;
+		info->changes = 0;
+
+		if(changes == 0 || operations->command[i] == cmd_noop)
+			continue;
+
+		if(changes & change_cancel) {
+			ec_remove_operation(ethercat, i);
+			continue;
+		}
+
+		if(changes & change_callbacks) {
+			info->write_callback = info->new_write_callback;
+			info->read_callback = info->new_read_callback;
+			info->payload = info->new_payload;
+			info->read_data = NULL;
+			info->read_wkc = NULL;
+			info->write_data = NULL;
+
+			if(info->map)
+				ec_unbind_map(ethercat, i);
+		}
+
+		bool placed = info->scheduled;
+
+		if(changes & change_layout) {
+			operations->address[i] = info->new_address;
+			operations->length[i] = info->new_length;
+		}
+
+		if(changes & change_pause) {
+			info->paused = true;
+			info->scheduled = false;
+		}
+
+		bool resumed = (changes & change_resume) && info->paused;
+		if(resumed)
+			info->paused = false;
+
+		if(ethercat->layout_dirty)
+			continue;
+
+		if(placed && (changes & (change_layout | change_pause))) {
+			ec_mark_frame(ethercat, info->frame);
+		} else if(resumed) {
+			int flags = operations->flags[i];
+
+			// Operations with a divisor have to join the ones toggled every cycle
+			if(ethercat->frame_count == 0 || is_low_priority(flags) || ec_call_rate(flags)) {
+				ethercat->layout_dirty = true;
+			} else {
+				info->frame = ethercat->frame_count - 1;
+				info->scheduled = true;
+				info->idle = false;
+				ec_mark_frame(ethercat, info->frame);
+			}
+		}
 	}
+}
 
-	operation->command = cmd_noop;
-	operation->length = 0;
-	operation->flags = 0;
 
-	operation->read_callback = NULL;
-	operation->write_callback = NULL;
-	operation->payload = NULL;
 
-	operation->prev = NULL;
-	operation->next = ethercat->operations;
-	ethercat->operations = operation;
 
-	return operation;
+static bool ec_check_request(uint16_t length, int flags)
+{
+	if(length > ETHERCAT_MAX_PAYLOAD) {
+		fprintf(stderr, "Request of %d bytes does not fit in a frame.\n", length);
+		return false;
+	}
+
+	int divisor = ec_call_divisor(flags);
+	int phase = ec_call_phase(flags);
+
+	if(divisor > 1 && phase != EC_PHASE_AUTO && phase >= divisor) {
+		fprintf(stderr, "Phase %d is not below the divisor %d.\n", phase, divisor);
+		return false;
+	}
+
+	return true;
 }
 
 
-static ethercat_operation_t *ec_remove_operation(ethercat_t *ethercat, ethercat_operation_t *operation)
+/**
+ * Finds the least loaded phase for an operation running every divisor-th
+ * cycle. Operations with another divisor count with the share of this
+ * phase's cycles they run in.
+ */
+static int ec_auto_phase(const ethercat_t *ethercat, int divisor)
 {
-	ethercat_operation_t *prev = operation->prev;
-	ethercat_operation_t *next = operation->next;
+	const ethercat_operations_t *operations = &ethercat->operations;
+	int64_t load[256] = { 0 };
+
+	for(int i = 0; i < operations->limit; i++) {
+		int flags = operations->flags[i];
+		int other = ec_call_divisor(flags);
+
+		if(operations->command[i] == cmd_noop || !(flags & EC_CALL_PERIODIC) || other < 2)
+			continue;
+
+		// Both run in the same cycle when their phases agree modulo
+		// the greatest common divisor, which happens every other/gcd
+		// cycles of this phase
+		int a = divisor, b = other;
+		while(b) {
+			int t = a % b;
+			a = b;
+			b = t;
+		}
+
+		int phase = ec_call_phase(flags) % a;
+		for(int p = phase; p < divisor; p += a)
+			load[p] += (int64_t) (12 + operations->length[i]) * a * 256 / other;
+	}
+
+	int best = 0;
+	for(int p = 1; p < divisor; p++) {
+		if(load[p] < load[best])
+			best = p;
+	}
+
+	return best;
+}
 
-	if(prev) prev->next = next;
-	if(next) next->prev = prev;
 
-	if(ethercat->operations == operation)
-		ethercat->operations = next;
+/**
+ * Stores the flags of a new operation once its length is known.
+ */
+static void ec_set_flags(ethercat_t *ethercat, int index, int flags)
+{
+	int divisor = ec_call_divisor(flags);
 
-	free(operation);
+	if((flags & EC_CALL_PERIODIC) && divisor > 1) {
+		if(ec_call_phase(flags) == EC_PHASE_AUTO) {
+			int phase = ec_auto_phase(ethercat, divisor);
+			flags = (flags & ~EC_CALL_EVERY(0, 0xFF)) | EC_CALL_EVERY(0, phase);
+		}
+	}
 
-	return next;
+	ethercat->operations.flags[index] = flags;
 }
 
 
-void ec_request_read(ethercat_t *ethercat, 
+ec_handle_t ec_request_read(ethercat_t *ethercat, 
 			const address_t address, 
 			uint16_t length, 
 			ec_read_callback_t *callback, 
 			void *payload, 
 			int flags)
 {
-	ethercat_operation_t *operation = ec_create_operation(ethercat);
+	if(!ec_check_request(length, flags))
+		return -1;
 
-	if(operation == NULL) {
-		perror("ec_create_operation()");
-		return;
-	}
+	int index = ec_create_operation(ethercat, read_command_from_flags(flags));
+
+	if(index == -1)
+		return -1;
+
+	ethercat_operations_t *operations = &ethercat->operations;
+	operations->address[index] = address;
+	operations->length[index] = length;
+	ec_set_flags(ethercat, index, flags);
+	operations->info[index].read_callback = callback;
+	operations->info[index].payload = payload;
 
-	operation->flags = flags;
-	operation->command = read_command_from_flags(flags);
-	operation->address = address;
-	operation->length = length;
-	operation->read_callback = callback;
-	operation->payload = payload;
+	return ec_make_handle(operations, index);
 }
 
 
-void ec_request_write(ethercat_t *ethercat, 
+ec_handle_t ec_request_write(ethercat_t *ethercat, 
 			const address_t address, 
 			uint16_t length, 
 			ec_write_callback_t *callback, 
 			void *payload, 
 			int flags)
 {
-	ethercat_operation_t *operation = ec_create_operation(ethercat);
+	if(!ec_check_request(length, flags))
+		return -1;
 
-	if(operation == NULL) {
-		perror("ec_create_operation()");
-		return;
-	}
+	int index = ec_create_operation(ethercat, write_command_from_flags(flags));
+
+	if(index == -1)
+		return -1;
+
+	ethercat_operations_t *operations = &ethercat->operations;
+	operations->address[index] = address;
+	operations->length[index] = length;
+	ec_set_flags(ethercat, index, flags);
+	operations->info[index].write_callback = callback;
+	operations->info[index].payload = payload;
 
-	operation->flags = flags;
-	operation->command = write_command_from_flags(flags);
-	operation->address = address;
-	operation->length = length;
-	operation->write_callback = callback;
-	operation->payload = payload;
+	return ec_make_handle(operations, index);
 }
 
 
-static int ec_get_packet_length(ethercat_t *ethercat)
+/**
+ * Reads into data without a callback, the cycle copies the payload
+ * and the working counter straight into the application's storage.
+ */
+ec_handle_t ec_request_read_to(ethercat_t *ethercat,
+			const address_t address,
+			uint16_t length,
+			void *data,
+			uint16_t *wkc,
+			int flags)
 {
-	int length = 14 + 2;	// Ethernet + Ethercat
+	if(!ec_check_request(length, flags))
+		return -1;
 
-	ethercat_operation_t *operation = ethercat->operations;
-	while(operation) {
-		// Datagram header + Payload
-		length += 12 + operation->length;
-		operation = operation->next;
-	}
+	int index = ec_create_operation(ethercat, read_command_from_flags(flags));
 
-	return length;
+	if(index == -1)
+		return -1;
+
+	ethercat_operations_t *operations = &ethercat->operations;
+	operations->address[index] = address;
+	operations->length[index] = length;
+	ec_set_flags(ethercat, index, flags);
+	operations->info[index].read_data = data;
+	operations->info[index].read_wkc = wkc;
+
+	return ec_make_handle(operations, index);
 }
 
 
-static bool is_read_command(command_type_t command)
+/**
+ * Writes the current contents of data without a callback.
+ */
+ec_handle_t ec_request_write_from(ethercat_t *ethercat,
+			const address_t address,
+			uint16_t length,
+			const void *data,
+			int flags)
 {
-	switch(command) {
-		case cmd_ainc_r:
-		case cmd_ainc_rw:
-		case cmd_cadr_r:
-		case cmd_cadr_rw:
-		case cmd_bcst_r:
-		case cmd_bcst_rw:
-		case cmd_lgcl_r:
-		case cmd_lgcl_rw:
-		case cmd_cadr_rmwr:
-			return true;
-		default:
-			return false;
-	}
+	if(!ec_check_request(length, flags))
+		return -1;
+
+	int index = ec_create_operation(ethercat, write_command_from_flags(flags));
+
+	if(index == -1)
+		return -1;
+
+	ethercat_operations_t *operations = &ethercat->operations;
+	operations->address[index] = address;
+	operations->length[index] = length;
+	ec_set_flags(ethercat, index, flags);
+	operations->info[index].write_data = data;
+
+	return ec_make_handle(operations, index);
+}
+
+
+static command_type_t read_write_command_from_flags(int flags)
+{
+	if((flags & EC_ADDR_RMW) == EC_ADDR_RMW)
+		return ((flags & EC_ADDR_AI) == EC_ADDR_AI)?cmd_ainc_rmw:cmd_cadr_rmw;
+	if((flags & EC_ADDR_AI) == EC_ADDR_AI)
+		return cmd_ainc_rw;
+	if((flags & EC_ADDR_CA) == EC_ADDR_CA)
+		return cmd_cadr_rw;
+	if((flags & EC_ADDR_BR) == EC_ADDR_BR)
+		return cmd_bcst_rw;
+	if((flags & EC_ADDR_LG) == EC_ADDR_LG)
+		return cmd_lgcl_rw;
+	return cmd_cadr_rw;
+}
+
+
+/**
+ * Exchanges data in a single datagram, the write callback fills the
+ * payload before sending and the read callback receives the response.
+ */
+ec_handle_t ec_request_read_write(ethercat_t *ethercat,
+			const address_t address,
+			uint16_t length,
+			ec_write_callback_t *write_callback,
+			ec_read_callback_t *read_callback,
+			void *payload,
+			int flags)
+{
+	if(!ec_check_request(length, flags))
+		return -1;
+
+	int index = ec_create_operation(ethercat, read_write_command_from_flags(flags));
+
+	if(index == -1)
+		return -1;
+
+	ethercat_operations_t *operations = &ethercat->operations;
+	operations->address[index] = address;
+	operations->length[index] = length;
+	ec_set_flags(ethercat, index, flags);
+	operations->info[index].read_callback = read_callback;
+	operations->info[index].write_callback = write_callback;
+	operations->info[index].payload = payload;
+
+	return ec_make_handle(operations, index);
 }
 
 
-static bool is_write_command(command_type_t command)
+static bool is_write_command(uint8_t command)
 {
 	switch(command) {
 		case cmd_ainc_w:
@@ -216,7 +847,8 @@ static bool is_write_command(command_type_t command)
 		case cmd_bcst_rw:
 		case cmd_lgcl_w:
 		case cmd_lgcl_rw:
-		case cmd_cadr_rmwr:
+		case cmd_ainc_rmw:
+		case cmd_cadr_rmw:
 			return true;
 		default:
 			return false;
@@ -224,111 +856,912 @@ static bool is_write_command(command_type_t command)
 }
 
 
-uint8_t *ec_add_operation(uint8_t *ptr, ethercat_operation_t *operation)
+/**
+ * Writes datagram header, empty payload and working counter
+ * and returns pointer to the next datagram.
+ */
+static uint8_t *ec_add_datagram(uint8_t *ptr, uint8_t command, const address_t address, uint16_t length, bool more)
 {
 	datagram_header_t *header = (datagram_header_t *) ptr;
-	header->command = operation->command;
+	header->command = command;
 	header->index = 0x87;
-	header->address.logical = operation->address.logical;
-	header->length = (operation->length & 0x7FF);
-	header->flags = (operation->next?0x10:00);
+	header->address.logical = address.logical;
+	header->length = (length & 0x7FF);
+	header->flags = (more?0x10:00);
+	header->interrupt = 0x0000;
 	ptr += sizeof(datagram_header_t);
 
-	// Request loading of datagram payload
-	memset(ptr, 0, operation->length);
-	if(is_write_command(operation->command) && operation->write_callback)
-		operation->write_callback(operation->address, operation->payload, operation->length, (void *) ptr);
-	ptr += operation->length;
+	// Payload is filled in by write callback during cycle
+	memset(ptr, 0, length);
+	ptr += length;
 
 	// Working counter
 	uint16_t *wkc = (uint16_t *) ptr;
-	*wkc = 0x0001;
+	*wkc = 0x0000;
 	ptr += 2;
 
 	return ptr;
 }
 
 
-void ec_do_cycle(ethercat_t *ethercat)
+/**
+ * Writes datagram header, empty payload and working counter
+ * for an operation and returns pointer to the next datagram.
+ */
+uint8_t *ec_add_operation(uint8_t *ptr, const ethercat_operations_t *operations, int index, bool more)
+{
+	return ec_add_datagram(ptr, operations->command[index], operations->address[index],
+		operations->length[index], more);
+}
+
+
+/**
+ * Writes Ethernet and EtherCAT header of a frame
+ * and returns pointer to the first datagram.
+ */
+static uint8_t *ec_open_frame(ethercat_frame_t *frame)
 {
 	const uint8_t ethernet_hdr[] = {0x00, 0xd0, 0xb7, 0xbd, 0x22, 0x56, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x88, 0xa4};
 
-	int packet_length = ec_get_packet_length(ethercat);
+	memcpy(frame->tx, ethernet_hdr, 14);
+	frame->length = 14 + 2;
 
-	uint8_t *packet = (uint8_t *) malloc(packet_length);
+	return frame->tx + frame->length;
+}
 
-	if(packet == NULL) {
-		perror("malloc()");
-		return;
-	}
 
-	// Build packet
-	uint8_t *ptr = packet;
-	memcpy(ptr, ethernet_hdr, 14); ptr += 14;
+/**
+ * Fills in the EtherCAT header length and clears the "more
+ * datagrams follow" flag on the last datagram of a frame.
+ */
+static void ec_close_frame(ethercat_frame_t *frame, datagram_header_t *last)
+{
+	uint8_t *ptr = frame->tx + 14;
 
-	int payload_length = packet_length - 14 - 2 - 4;
+	int payload_length = frame->length - 14 - 2;
 	*(ptr++) = payload_length & 0xFF;
-	*(ptr++) = (payload_length >> 8) & 0x7F | (1 << 4);
+	*(ptr++) = ((payload_length >> 8) & 0x07) | (pt_datagram << 4);
 
-	ethercat_operation_t *operation = ethercat->operations;
-	while(operation) {
-		ptr = ec_add_operation(ptr, operation);
-		operation = operation->next;
+	if(last)
+		last->flags = 0x00;
+}
+
+
+static bool is_mergeable_command(uint8_t command)
+{
+	switch(command) {
+		case cmd_ainc_r:
+		case cmd_ainc_w:
+		case cmd_cadr_r:
+		case cmd_cadr_w:
+		case cmd_bcst_r:
+		case cmd_bcst_w:
+			return true;
+		default:
+			return false;
 	}
+}
 
-	// Send packet and await response
-	send(ethercat->socket, packet, packet_length, MSG_DONTROUTE | MSG_DONTWAIT);
 
-	int nbytes = -1;
-	while(nbytes == -1) {
-		nbytes = read(ethercat->socket, (void *) packet, packet_length);
+// Orders operations by command, slave, rate and register
+static int ec_compare_operations(const void *a, const void *b, void *arg)
+{
+	const ethercat_operations_t *operations = (const ethercat_operations_t *) arg;
+	int i = *((const int *) a);
+	int j = *((const int *) b);
+
+	if(operations->command[i] != operations->command[j])
+		return operations->command[i] - operations->command[j];
+	if(operations->address[i].physical.ado != operations->address[j].physical.ado)
+		return operations->address[i].physical.ado - operations->address[j].physical.ado;
+	if(ec_call_rate(operations->flags[i]) != ec_call_rate(operations->flags[j]))
+		return ec_call_rate(operations->flags[i]) - ec_call_rate(operations->flags[j]);
+	if(operations->address[i].physical.adp != operations->address[j].physical.adp)
+		return operations->address[i].physical.adp - operations->address[j].physical.adp;
+	return i - j;
+}
+
+
+/**
+ * Groups operations on neighbouring registers of the same slave. Reads
+ * may overlap or leave a gap of up to merge_gap bytes, which are read
+ * along; writes must be exactly adjacent so no other bytes are written.
+ * Operations with a divisor are only grouped with ones of the same divisor
+ * and phase, which idle in the same cycles. Only operations already placed
+ * in frame are grouped, unless it is -1.
+ */
+static void ec_merge_operations(ethercat_t *ethercat, int frame)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+	int count = 0;
+
+	for(int i = 0; i < operations->limit; i++) {
+		ethercat_operation_t *info = &operations->info[i];
+
+		if(frame != -1 && info->frame != frame)
+			continue;
+
+		info->leader = i;
+		info->next_merged = -1;
+		info->merged_length = 0;
+
+		if(ethercat->merge_gap < 0 || !info->scheduled || !is_mergeable_command(operations->command[i]))
+			continue;
+
+		uint32_t end = (uint32_t) operations->address[i].physical.adp + operations->length[i];
+		if(operations->length[i] > 0 && end <= (uint32_t) ETHERCAT_MERGE_LIMIT)
+			operations->order[count++] = i;
 	}
 
-	// Decode packet
-	ptr = packet;
-	ptr += 14 + 2;	// Skip headers
+	qsort_r(operations->order, count, sizeof(int), ec_compare_operations, operations);
+
+	for(int g = 0; g < count; ) {
+		int first = operations->order[g];
+		uint8_t command = operations->command[first];
+		uint16_t ado = operations->address[first].physical.ado;
+		int rate = ec_call_rate(operations->flags[first]);
+		uint32_t start = operations->address[first].physical.adp;
+		uint32_t end = start + operations->length[first];
+		int leader = first;
+		int h = g + 1;
+
+		for(; h < count; h++) {
+			int i = operations->order[h];
+			uint32_t adp = operations->address[i].physical.adp;
+			uint32_t last = adp + operations->length[i];
+
+			if(operations->command[i] != command || operations->address[i].physical.ado != ado ||
+			   ec_call_rate(operations->flags[i]) != rate)
+				break;
+
+			if(is_write_command(command)?(adp != end):(adp > end + ethercat->merge_gap))
+				break;
+
+			if(last > end) {
+				if(last - start > (uint32_t) ETHERCAT_MAX_PAYLOAD)
+					break;
+				end = last;
+			}
+
+			if(i < leader)
+				leader = i;
+		}
 
-	operation = ethercat->operations;
-	bool error = false;
+		if(h - g > 1) {
+			// Leader chains all members in register order
+			int *next = &operations->info[leader].next_merged;
 
-	while(operation) {
-		datagram_header_t *header = (datagram_header_t *) ptr;
-		ptr += sizeof(datagram_header_t);
-
-		if((header->command != operation->command) || 
-		   (header->address.physical.adp != operation->address.physical.adp) ||
-		   (header->length != operation->length)) {
-			printf("Datagrams do not match: \n");
-			printf(" Length: %d vs %d\n", header->length, operation->length);
-			printf(" Command: %d vs %d\n", header->command, operation->command);
-			printf(" Address: %04x vs %04x\n", header->address.physical.adp, operation->address.physical.adp);
-			error = true;
+			for(int k = g; k < h; k++) {
+				int i = operations->order[k];
+				operations->info[i].leader = leader;
+
+				if(i != leader) {
+					*next = i;
+					next = &operations->info[i].next_merged;
+				}
+			}
+
+			operations->info[leader].merged_adp = start;
+			operations->info[leader].merged_length = end - start;
+		}
+
+		g = h;
+	}
+}
+
+
+// Orders operations by the time they were requested
+static int ec_compare_sequence(const void *a, const void *b, void *arg)
+{
+	const ethercat_operations_t *operations = (const ethercat_operations_t *) arg;
+	uint64_t i = operations->info[*((const int *) a)].sequence;
+	uint64_t j = operations->info[*((const int *) b)].sequence;
+
+	return (i > j) - (i < j);
+}
+
+
+/**
+ * Selects the operations for the frames of this cycle. Periodic ones
+ * with a divisor are always placed and idle outside their phase. Low
+ * priority one-shots are added oldest first while the datagrams fit in
+ * the cycle budget, the others wait, so a late request never overtakes
+ * an earlier one. The oldest is added even when it alone exceeds the
+ * budget, otherwise it would wait forever.
+ */
+static void ec_schedule_operations(ethercat_t *ethercat, uint64_t cycle)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+	int bytes = 0;
+	int count = 0;
+
+	operations->rated_count = 0;
+
+	for(int i = 0; i < operations->limit; i++) {
+		ethercat_operation_t *info = &operations->info[i];
+		int flags = operations->flags[i];
+
+		info->scheduled = false;
+
+		if(operations->command[i] == cmd_noop || info->paused)
+			continue;
+
+		if(ethercat->cycle_budget && is_low_priority(flags)) {
+			operations->order[count++] = i;
+			continue;
+		}
+
+		if(ec_call_rate(flags))
+			operations->rated[operations->rated_count++] = i;
+
+		info->scheduled = true;
+		info->idle = !ec_call_due(flags, cycle);
+		bytes += 12 + operations->length[i];
+	}
+
+	qsort_r(operations->order, count, sizeof(int), ec_compare_sequence, operations);
+
+	int k = 0;
+	for(; k < count; k++) {
+		int i = operations->order[k];
+
+		if(k > 0 && bytes + 12 + operations->length[i] > ethercat->cycle_budget)
 			break;
+
+		operations->info[i].scheduled = true;
+		operations->info[i].idle = false;
+		bytes += 12 + operations->length[i];
+	}
+
+	ethercat->deferred = count - k;
+
+	for(; k < count; k++) {
+		ethercat_operation_t *info = &operations->info[operations->order[k]];
+
+		if(!info->deferred) {
+			info->deferred = true;
+			ethercat->counters.operations_deferred++;
+		}
+	}
+}
+
+
+/**
+ * Switches the datagrams of operations with a divisor between their
+ * command and NOP, which slaves pass on untouched, as their phase
+ * starts and ends. The frames keep their layout.
+ */
+static void ec_toggle_operations(ethercat_t *ethercat, uint64_t cycle)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+
+	for(int k = 0; k < operations->rated_count; k++) {
+		int i = operations->rated[k];
+		ethercat_operation_t *info = &operations->info[i];
+
+		if(operations->command[i] == cmd_noop || !info->scheduled)
+			continue;
+
+		bool idle = !ec_call_due(operations->flags[i], cycle);
+		if(idle == info->idle)
+			continue;
+
+		// Merged operations share the rate and set the same command
+		datagram_header_t *header = (datagram_header_t *) (ethercat->frames[info->frame].tx + info->datagram);
+		header->command = idle?(uint8_t) cmd_noop:operations->command[i];
+		info->idle = idle;
+	}
+}
+
+
+// Bytes of the datagram an operation's group occupies
+static int ec_datagram_length(const ethercat_operations_t *operations, int index)
+{
+	const ethercat_operation_t *info = &operations->info[index];
+	return 12 + (info->merged_length?info->merged_length:operations->length[index]);
+}
+
+
+/**
+ * Writes the datagrams of the operations placed in a frame into its
+ * template, in table order. Merged operations go into the datagram at
+ * the place of the first one and find their payload at the offset of
+ * their register. Returns -1 if the frame would be empty or too long.
+ */
+static int ec_fill_frame(ethercat_t *ethercat, int f)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+	ethercat_frame_t *frame = &ethercat->frames[f];
+	int length = 14 + 2;
+	int count = 0;
+
+	for(int i = 0; i < operations->limit; i++) {
+		const ethercat_operation_t *info = &operations->info[i];
+
+		if(info->scheduled && info->leader == i && info->frame == f) {
+			length += ec_datagram_length(operations, i);
+			count++;
 		}
+	}
+
+	if(count == 0 || length > ETHERCAT_MAX_FRAME)
+		return -1;
+
+	datagram_header_t *last = NULL;
+	uint8_t *ptr = ec_open_frame(frame);
 
-		if(is_read_command(operation->command) && operation->read_callback)
-			operation->read_callback(header->address, operation->payload, operation->length, (const void *) ptr);
-		ptr += operation->length;
+	for(int i = 0; i < operations->limit; i++) {
+		ethercat_operation_t *info = &operations->info[i];
 
-		// Skip WKC
-		ptr += 2;
+		if(!info->scheduled || info->leader != i || info->frame != f)
+			continue;
 
-		if((operation->flags & EC_CALL_ONESHOT) == EC_CALL_ONESHOT) {
-			operation = ec_remove_operation(ethercat, operation);
-		} else {
-			operation = operation->next;
+		address_t address = operations->address[i];
+		uint16_t payload = operations->length[i];
+
+		if(info->merged_length) {
+			address.physical.adp = info->merged_adp;
+			payload = info->merged_length;
 		}
+
+		last = (datagram_header_t *) ptr;
+
+		for(int m = i; m != -1; m = operations->info[m].next_merged) {
+			ethercat_operation_t *member = &operations->info[m];
+			member->datagram = frame->length;
+			member->offset = frame->length + sizeof(datagram_header_t) +
+				(operations->address[m].physical.adp - address.physical.adp);
+		}
+
+		ptr = ec_add_datagram(ptr, info->idle?(uint8_t) cmd_noop:operations->command[i], address, payload, true);
+		frame->length += 12 + payload;
 	}
 
-	free(packet);
+	ec_close_frame(frame, last);
+	frame->dirty = false;
+
+	return 0;
+}
+
+
+/**
+ * Builds the frame templates from the operation table. This is
+ * only required when operations have been added or one-shots have
+ * been deferred, all other cycles re-use the templates and only
+ * update write payloads and the commands of operations with a divisor.
+ *
+ * Operations are packed in table order, a new frame is started
+ * whenever the next datagram would exceed the maximum frame size.
+ */
+static int ec_compile_frames(ethercat_t *ethercat, uint64_t cycle)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+
+	int count = 0;
+	int length = ETHERCAT_MAX_FRAME;
+
+	ec_schedule_operations(ethercat, cycle);
+	ec_merge_operations(ethercat, -1);
+
+	for(int i = 0; i < operations->limit; i++) {
+		ethercat_operation_t *info = &operations->info[i];
+
+		if(!info->scheduled || info->leader != i)
+			continue;
+
+		int datagram = ec_datagram_length(operations, i);
+
+		if(length + datagram > ETHERCAT_MAX_FRAME) {
+			if(ec_reserve_frames(ethercat, count + 1) == -1)
+				return -1;
+
+			count++;
+			length = 14 + 2;
+		}
+
+		length += datagram;
 
-	if(error) {
-		printf("Invalid EtherCAT packet received.\n");
-		exit(1);
+		for(int m = i; m != -1; m = operations->info[m].next_merged)
+			operations->info[m].frame = count - 1;
+	}
+
+	for(int f = 0; f < count; f++)
+		ec_fill_frame(ethercat, f);
+
+	ethercat->frame_count = count;
+	ethercat->layout_dirty = false;
+	ethercat->frames_dirty = false;
+
+	return 0;
+}
+
+
+/**
+ * Rebuilds only the frames whose operations have been removed, changed
+ * or paused, keeping every operation in its frame. Falls back to
+ * compiling all frames when one becomes empty or no longer fits.
+ */
+static int ec_compile_dirty_frames(ethercat_t *ethercat, uint64_t cycle)
+{
+	for(int f = 0; f < ethercat->frame_count; f++) {
+		if(!ethercat->frames[f].dirty)
+			continue;
+
+		ec_merge_operations(ethercat, f);
+
+		if(ec_fill_frame(ethercat, f) == -1)
+			return ec_compile_frames(ethercat, cycle);
+	}
+
+	ethercat->frames_dirty = false;
+	return 0;
+}
+
+
+/**
+ * Sets the index of every datagram in a frame about to be sent.
+ */
+static void ec_tag_frame(uint8_t *buffer, int length, uint8_t index)
+{
+	uint8_t *ptr = buffer + 14 + 2;
+	uint8_t *end = buffer + length;
+
+	while(ptr < end) {
+		datagram_header_t *header = (datagram_header_t *) ptr;
+		header->index = index;
+		ptr += sizeof(datagram_header_t) + header->length + 2;
+	}
+}
+
+
+static bool is_positional_command(uint8_t command)
+{
+	switch(command) {
+		case cmd_ainc_r:
+		case cmd_ainc_w:
+		case cmd_ainc_rw:
+		case cmd_ainc_rmw:
+		case cmd_bcst_r:
+		case cmd_bcst_w:
+		case cmd_bcst_rw:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/**
+ * Verifies that a response carries the same datagrams as the frame
+ * template, slaves should only have modified payloads and counters.
+ */
+static bool ec_check_frame(const ethercat_frame_t *frame)
+{
+	if(frame->received < frame->length)
+		return false;
+
+	const uint8_t *tx = frame->tx + 14 + 2;
+	const uint8_t *rx = frame->rx + 14 + 2;
+	const uint8_t *end = frame->tx + frame->length;
+
+	while(tx < end) {
+		const datagram_header_t *expected = (const datagram_header_t *) tx;
+		const datagram_header_t *header = (const datagram_header_t *) rx;
+
+		if((header->command != expected->command) || 
+		   (header->index != frame->index) ||
+		   (header->length != expected->length))
+			return false;
+
+		// Slaves increment the position of auto-increment and broadcast datagrams
+		if(is_positional_command(expected->command)) {
+			if(header->address.physical.adp != expected->address.physical.adp)
+				return false;
+		} else if(header->address.logical != expected->address.logical) {
+			return false;
+		}
+
+		tx += sizeof(datagram_header_t) + expected->length + 2;
+		rx += sizeof(datagram_header_t) + expected->length + 2;
+	}
+
+	return true;
+}
+
+
+/**
+ * Finds the outstanding frame a received buffer belongs to.
+ */
+static ethercat_frame_t *ec_match_frame(ethercat_t *ethercat, const uint8_t *buffer, int length)
+{
+	if(length < 14 + 2 + (int) sizeof(datagram_header_t))
+		return NULL;
+
+	if(buffer[12] != (ETHERCAT_TYPE >> 8) || buffer[13] != (ETHERCAT_TYPE & 0xFF))
+		return NULL;
+
+	uint8_t index = ((const datagram_header_t *) (buffer + 14 + 2))->index;
+
+	for(int f = 0; f < ethercat->frame_count; f++) {
+		ethercat_frame_t *frame = &ethercat->frames[f];
+		if(frame->received == 0 && frame->index == index)
+			return frame;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Queues a frame for transmission with the next datagram index. Templates
+ * kept in a buffer of the transport and templates of transports without
+ * buffers are sent as they are, others are copied into a buffer of the
+ * transport. Retries are always sent as a copy where the transport has
+ * buffers, the template of the first attempt may still be queued.
+ */
+static void ec_send_frame(ethercat_t *ethercat, ethercat_frame_t *frame, bool retry)
+{
+	const ethercat_transport_ops_t *ops = ethercat->transport.ops;
+	uint8_t *buffer = frame->tx;
+
+	if(ops->acquire && (retry || !frame->shared)) {
+		buffer = ops->acquire(ethercat->transport.state);
+
+		if(buffer == NULL) {
+			fprintf(stderr, "No transmit buffer available.\n");
+			return;
+		}
+
+		memcpy(buffer, frame->tx, frame->length);
+	}
+
+	frame->index = ethercat->next_index++;
+	ec_tag_frame(buffer, frame->length, frame->index);
+
+	if(ops->send(ethercat->transport.state, buffer, frame->length) == -1)
+		return;
+
+	ethercat->counters.frames_sent++;
+
+	if(ethercat->capture)
+		ec_capture_sent(ethercat->capture, buffer, frame->length);
+}
+
+
+static void ec_flush_frames(ethercat_t *ethercat)
+{
+	if(ethercat->transport.ops->flush)
+		ethercat->transport.ops->flush(ethercat->transport.state);
+}
+
+
+/**
+ * Receives responses until all outstanding frames have been
+ * matched or the deadline expires. Frames that do not belong 
+ * to this cycle are dropped. Returns the number of frames 
+ * that are still missing.
+ */
+static int ec_receive_frames(ethercat_t *ethercat, int pending)
+{
+	const ethercat_transport_ops_t *ops = ethercat->transport.ops;
+	int64_t deadline = ec_monotonic_ns() + (int64_t) ethercat->timeout_us * 1000;
+
+	while(pending > 0) {
+		uint8_t *buffer = ethercat->spare_rx;
+		int nbytes = ops->receive(ethercat->transport.state, &buffer);
+
+		if(nbytes == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("recv()");
+				break;
+			}
+
+			int64_t remaining = deadline - ec_monotonic_ns();
+			if(remaining <= 0)
+				break;
+
+			// Busy-poll transports without a way to wait
+			if(ops->wait && ops->wait(ethercat->transport.state, remaining) == -1)
+				break;
+			continue;
+		}
+
+		if(ethercat->capture)
+			ec_capture_received(ethercat->capture, buffer, nbytes);
+
+		ethercat_frame_t *frame = ec_match_frame(ethercat, buffer, nbytes);
+
+		if(frame == NULL) {
+			ethercat->counters.frames_stray++;
+			continue;
+		}
+
+		// Keep the response, receive the next one in the frame's buffer
+		if(buffer == ethercat->spare_rx) {
+			ethercat->spare_rx = frame->rx_buffer;
+			frame->rx_buffer = buffer;
+		}
+
+		frame->rx = buffer;
+		frame->received = nbytes;
+
+		ethercat->counters.frames_received++;
+		pending--;
+	}
+
+	return pending;
+}
+
+
+/**
+ * Performs one cycle: sends all frames, waits for the responses
+ * and dispatches the callbacks of operations whose frame arrived
+ * intact. One-shot operations in frames that were lost stay queued
+ * for the next cycle. Returns -1 if any frame was lost or invalid.
+ */
+int ec_do_cycle(ethercat_t *ethercat)
+{
+	ethercat_operations_t *operations = &ethercat->operations;
+
+	EC_STATS(ec_apply_stats_reset(ethercat));
+	EC_STATS(int64_t t_start = ec_stats_clock());
+	int64_t start_ns = ethercat->recorder?ec_monotonic_ns():0;
+
+	// Requests submitted by other threads join this cycle
+	if(__atomic_load_n(&ethercat->submissions, __ATOMIC_RELAXED) || ethercat->backlog)
+		ec_submit_cycle(ethercat);
+
+	// Mailbox transfers queue their datagrams for this cycle
+	if(ethercat->mailbox)
+		ec_mailbox_cycle(ethercat);
+
+	uint64_t cycle = ethercat->counters.cycles;
+
+	// Changes made through handles take effect from this cycle on
+	ec_apply_changes(ethercat);
+
+	// Deferred one-shots are reconsidered every cycle
+	if(ethercat->deferred)
+		ethercat->layout_dirty = true;
+
+	if(ethercat->layout_dirty && ec_compile_frames(ethercat, cycle) == -1) {
+		perror("ec_compile_frames()");
+		return -1;
+	}
+
+	if(ethercat->frames_dirty && ec_compile_dirty_frames(ethercat, cycle) == -1) {
+		perror("ec_compile_dirty_frames()");
+		return -1;
+	}
+
+	if(operations->rated_count)
+		ec_toggle_operations(ethercat, cycle);
+
+	ethercat->counters.cycles++;
+
+	// Update write payloads
+	for(int i = 0; i < operations->limit; i++) {
+		if(!is_write_command(operations->command[i]))
+			continue;
+
+		ethercat_operation_t *info = &operations->info[i];
+		if(!info->scheduled || info->idle)
+			continue;
+
+		uint8_t *data = ethercat->frames[info->frame].tx + info->offset;
+
+		if(info->write_data)
+			memcpy(data, info->write_data, operations->length[i]);
+		else if(info->write_callback)
+			info->write_callback(operations->address[i], info->payload, operations->length[i], (void *) data);
+	}
+
+	EC_STATS(int64_t t_build = ec_stats_clock());
+
+	// Send all frames back-to-back, then gather the responses
+	for(int f = 0; f < ethercat->frame_count; f++) {
+		ethercat->frames[f].received = 0;
+		ec_send_frame(ethercat, &ethercat->frames[f], false);
+	}
+	ec_flush_frames(ethercat);
+
+	EC_STATS(int64_t t_send = ec_stats_clock());
+
+	int pending = ec_receive_frames(ethercat, ethercat->frame_count);
+
+	for(int retry = 0; pending > 0 && retry < ethercat->retries; retry++) {
+		for(int f = 0; f < ethercat->frame_count; f++) {
+			if(ethercat->frames[f].received == 0) {
+				ec_send_frame(ethercat, &ethercat->frames[f], true);
+				ethercat->counters.frames_retried++;
+			}
+		}
+		ec_flush_frames(ethercat);
+
+		pending = ec_receive_frames(ethercat, pending);
+	}
+
+	ethercat->counters.frames_lost += pending;
+
+	EC_STATS(int64_t t_wire = ec_stats_clock());
+
+	for(int f = 0; f < ethercat->frame_count; f++) {
+		ethercat_frame_t *frame = &ethercat->frames[f];
+		if(frame->received && !ec_check_frame(frame)) {
+			ethercat->counters.frames_invalid++;
+			frame->received = 0;
+		}
+	}
+
+	EC_STATS(int64_t t_decode = ec_stats_clock());
+
+	// Decode packets
+	bool complete = true;
+	uint8_t scratch[ETHERCAT_MAX_PAYLOAD + 2];
+
+	// Readers of maps retry while the copies are in progress
+	if(ethercat->maps)
+		ec_begin_maps(ethercat);
+
+	for(int i = 0; i < operations->limit; i++) {
+		ethercat_operation_t *info = &operations->info[i];
+
+		if(operations->command[i] == cmd_noop || !info->scheduled || info->idle)
+			continue;
+
+		ethercat_frame_t *frame = &ethercat->frames[info->frame];
+
+		if(frame->received == 0) {
+			complete = false;
+			continue;
+		}
+
+		uint8_t *ptr = frame->rx + info->offset;
+		datagram_header_t *header = (datagram_header_t *) (frame->rx + info->datagram);
+		const uint8_t *wkc = frame->rx + info->datagram + sizeof(datagram_header_t) + header->length;
+
+		if(info->read_data) {
+			// Plain copies need neither the address nor the counter in place
+			memcpy(info->read_data, ptr, operations->length[i]);
+			if(info->read_wkc)
+				*info->read_wkc = wkc[0] | (wkc[1] << 8);
+		} else if(info->read_callback) {
+			// Write-only operations get the data as written. Merged
+			// datagrams start at the lowest register of the group.
+			address_t address = header->address;
+			if(is_mergeable_command(operations->command[i]))
+				address.physical.adp = operations->address[i].physical.adp;
+
+			if(ptr + operations->length[i] == wkc) {
+				info->read_callback(address, info->payload, operations->length[i], (const void *) ptr);
+			} else {
+				// Hand over the operation's part followed by the working counter
+				memcpy(scratch, ptr, operations->length[i]);
+				memcpy(scratch + operations->length[i], wkc, 2);
+				info->read_callback(address, info->payload, operations->length[i], (const void *) scratch);
+			}
+		}
+
+		if((operations->flags[i] & EC_CALL_ONESHOT) == EC_CALL_ONESHOT)
+			ec_remove_operation(ethercat, i);
+	}
+
+	if(ethercat->maps)
+		ec_end_maps(ethercat);
+
+	// Other processes see this cycle from here on
+	if(ethercat->exports && ethercat->exports->header)
+		ec_publish_export(ethercat, complete);
+
+	if(ethercat->recorder && ethercat->recorder->running)
+		ec_record_cycle(ethercat, start_ns, complete);
+
+	if(ethercat->transport.ops->release)
+		ethercat->transport.ops->release(ethercat->transport.state);
+
+#ifdef EC_ENABLE_STATS
+	int64_t t_end = ec_stats_clock();
+
+	ec_record_stat(ethercat, EC_STAT_BUILD, ec_stats_ns(t_build - t_start));
+	ec_record_stat(ethercat, EC_STAT_SEND, ec_stats_ns(t_send - t_build));
+	ec_record_stat(ethercat, EC_STAT_WIRE, ec_stats_ns(t_wire - t_send));
+	ec_record_stat(ethercat, EC_STAT_DECODE, ec_stats_ns(t_decode - t_wire));
+	ec_record_stat(ethercat, EC_STAT_CALLBACK, ec_stats_ns(t_end - t_decode));
+	ec_record_stat(ethercat, EC_STAT_CYCLE, ec_stats_ns(t_end - t_start));
+#endif
+
+	if(!complete) {
+		ethercat->counters.cycles_incomplete++;
+
+		if(ethercat->capture && ethercat->capture->error_path)
+			ec_capture_error(ethercat);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void ec_get_counters(const ethercat_t *ethercat, ec_counters_t *counters)
+{
+	*counters = ethercat->counters;
+}
+
+
+#ifdef EC_ENABLE_STATS
+#if defined(__x86_64__)
+uint64_t ec_tsc_scale = (uint64_t) 1 << 32;
+
+void ec_calibrate_stats_clock()
+{
+	int64_t start_ns = ec_monotonic_ns();
+	uint64_t start_ticks = __rdtsc();
+
+	int64_t end_ns;
+	while((end_ns = ec_monotonic_ns()) - start_ns < 2000000) { }
+	uint64_t end_ticks = __rdtsc();
+
+	ec_tsc_scale = ((uint64_t) (end_ns - start_ns) << 32) / (end_ticks - start_ticks);
+}
+#else
+void ec_calibrate_stats_clock()
+{
+}
+#endif
+#endif
+
+
+int ec_get_stats(const ethercat_t *ethercat, ec_stats_t *stats)
+{
+#ifdef EC_ENABLE_STATS
+	for(int p = 0; p < EC_STAT_COUNT; p++) {
+		const ec_histogram_t *from = &ethercat->stats.phase[p];
+		ec_histogram_t *to = &stats->phase[p];
+
+		to->count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+		to->sum_ns = __atomic_load_n(&from->sum_ns, __ATOMIC_RELAXED);
+		to->min_ns = __atomic_load_n(&from->min_ns, __ATOMIC_RELAXED);
+		to->max_ns = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+		for(int b = 0; b < EC_STAT_BUCKETS; b++)
+			to->buckets[b] = __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+	}
+
+	stats->overruns = __atomic_load_n(&ethercat->counters.cycles_overrun, __ATOMIC_RELAXED);
+	return 0;
+#else
+	memset(stats, 0, sizeof(ec_stats_t));
+	return -1;
+#endif
+}
+
+
+void ec_reset_stats(ethercat_t *ethercat)
+{
+#ifdef EC_ENABLE_STATS
+	__atomic_store_n(&ethercat->stats_reset, true, __ATOMIC_RELEASE);
+#endif
+}
+
+
+uint64_t ec_stats_percentile(const ec_histogram_t *histogram, double percentile)
+{
+	if(histogram->count == 0)
+		return 0;
+
+	uint64_t target = (uint64_t) (histogram->count * percentile / 100.0);
+	uint64_t seen = 0;
+
+	for(int b = 0; b < EC_STAT_BUCKETS; b++) {
+		seen += histogram->buckets[b];
+		if(seen > target || seen == histogram->count) {
+			// First value of the next bucket
+			int next = b + 1;
+			uint64_t bound = (next < 16)?next:((uint64_t) (16 + next % 16) << (next / 16 - 1));
+			return (bound - 1 < histogram->max_ns)?(bound - 1):histogram->max_ns;
+		}
 	}
 
-	// Remove one-shot operations
-	// ...
+	return histogram->max_ns;
 }
 
 /********************
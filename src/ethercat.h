@@ -3,18 +3,42 @@
 
 #include <stdint.h>
 
+#include "ethercat_record.h"
+
 // Periodic or one-shot operations
 #define EC_CALL_ONESHOT  0x01
 #define EC_CALL_PERIODIC 0x02
 
+// Periodic operations that only run every divisor-th cycle (2-255), in
+// the cycles where cycle % divisor == phase. EC_PHASE_AUTO picks the
+// phase that carries the fewest bytes so far.
+#define EC_CALL_EVERY(divisor, phase) ((((divisor) & 0xFF) << 8) | (((phase) & 0xFF) << 16))
+#define EC_PHASE_AUTO    0xFF
+
+// One-shot operations that wait for a later cycle while the
+// cycle budget is used up
+#define EC_CALL_LOW_PRIORITY 0x80
+
 // Addressing modes
 #define EC_ADDR_AI       0x04
 #define EC_ADDR_CA	 0x08
 #define EC_ADDR_BR	 0x10
 #define EC_ADDR_LG	 0x20
 
+// Read/write requests only: read by the addressed slave and written
+// by all following ones (ARMW with EC_ADDR_AI, FRMW otherwise)
+#define EC_ADDR_RMW	 0x40
+
+// Transports
+#define EC_TRANSPORT_SOCKET 0x00
+#define EC_TRANSPORT_MMAP   0x01
+#define EC_TRANSPORT_XDP    0x02
+#define EC_TRANSPORT_LOOPBACK 0x03
+#define EC_TRANSPORT_SIM    0x04
+
 
 struct ethercat_t;
+struct ethercat_sim_t;
 
 union address_t {
 	struct {
@@ -27,13 +51,308 @@ union address_t {
 typedef void(ec_read_callback_t)(const address_t, void *, uint16_t length, const void *);
 typedef void(ec_write_callback_t)(const address_t, void *, uint16_t length, void *);
 
+// Identifies a request, -1 if it could not be made. Handles of finished
+// one-shots and cancelled requests are no longer valid.
+typedef int64_t ec_handle_t;
+
+// Called by the cyclic executor after each cycle, before the next one is sent
+typedef void(ec_cycle_hook_t)(ethercat_t *, void *);
+
+struct ec_options_t {
+	int transport;
+	int max_operations;
+
+	// Simulated bus used by EC_TRANSPORT_SIM, owned by the caller
+	ethercat_sim_t *simulator;
+
+	// Time to wait for all frames of a cycle and number
+	// of times lost frames are resent before giving up
+	int timeout_us;
+	int retries;
+
+	// Reads of neighbouring registers (below 0x1000) of the same slave
+	// at most merge_gap bytes apart, and writes that are exactly
+	// adjacent, share one datagram. -1 disables merging. The default 0
+	// only merges reads that overlap or touch, a larger gap reads the
+	// registers in between, which clears those with read side effects.
+	int merge_gap;
+
+	// Datagram bytes (header, data and working counter) per cycle up to
+	// which low priority one-shots are added, 0 for no limit. The oldest
+	// one is sent every cycle, even when it exceeds the budget.
+	int cycle_budget;
+
+	// Cyclic executor: CPU to pin the thread to (-1 for none),
+	// SCHED_FIFO priority (0 keeps the default policy) and how
+	// long to busy-wait before each deadline instead of sleeping
+	int cpu;
+	int priority;
+	int spin_us;
+};
+
+struct ec_counters_t {
+	uint64_t cycles;
+	uint64_t cycles_incomplete;
+	uint64_t cycles_overrun;
+
+	uint64_t frames_sent;
+	uint64_t frames_received;
+	uint64_t frames_lost;
+	uint64_t frames_invalid;
+	uint64_t frames_stray;
+	uint64_t frames_retried;
+
+	// Low priority one-shots left for a later cycle, each counted once
+	uint64_t operations_deferred;
+};
+
+// Histograms collected when built with EC_ENABLE_STATS
+#define EC_STAT_BUILD    0	// Compiling frames and write callbacks
+#define EC_STAT_SEND     1	// Handing frames to the transport
+#define EC_STAT_WIRE     2	// Waiting for responses, including retries
+#define EC_STAT_DECODE   3	// Validating responses
+#define EC_STAT_CALLBACK 4	// Read callbacks and retiring one-shots
+#define EC_STAT_CYCLE    5	// Whole ec_do_cycle
+#define EC_STAT_WAKEUP   6	// Cyclic executor wake-up latency after its deadline
+#define EC_STAT_JITTER   7	// Cyclic executor deviation from the period
+#define EC_STAT_COUNT    8
+
+// Log-linear buckets, 16 per power of two up to 2^32 ns
+#define EC_STAT_BUCKETS  464
+
+struct ec_histogram_t {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[EC_STAT_BUCKETS];
+};
+
+struct ec_stats_t {
+	ec_histogram_t phase[EC_STAT_COUNT];
+	uint64_t overruns;
+};
+
+// Position of a slave's process data in the process image
+struct ec_image_slave_t {
+	uint16_t station;
+
+	int output_offset;	// Into ec_image_outputs
+	int output_length;
+	int input_offset;	// Into ec_image_inputs
+	int input_length;
+};
+
+// Slave found by ec_scan, registers 0x0000-0x0009 and 0x0110
+struct ec_slave_info_t {
+	int position;
+	uint16_t station;
+
+	uint8_t type;
+	uint8_t revision;
+	uint16_t build;
+	uint8_t fmmu_count;
+	uint8_t sm_count;
+	uint8_t port_descriptor;
+	uint16_t features;
+	uint16_t dl_status;
+
+	// Ports with communication and the position of the slave this
+	// one is attached to (-1 for the first slave)
+	int ports;
+	int parent;
+};
+
+// Distributed clock of a slave, delay and offset relative to the reference clock
+struct ec_dc_slave_t {
+	int position;
+	uint16_t station;
+	uint32_t delay_ns;
+	int64_t offset_ns;
+};
+
+// Outcome of an SDO transfer, abort_code is 0 on success
+struct ec_sdo_result_t {
+	uint16_t station;
+	uint16_t index;
+	uint8_t subindex;
+
+	uint32_t abort_code;
+
+	// Uploaded value, only valid during the callback
+	const uint8_t *data;
+	int length;
+};
+
+typedef void(ec_sdo_callback_t)(const ec_sdo_result_t *, void *);
+
+// Application memory mapped requests copy into or out of, set up with
+// ec_map_init. A map is used either for reads or for writes.
+struct ec_map_t {
+	uint8_t *data;
+	int length;
+
+	// Odd while a cycle copies into data
+	uint32_t sequence;
+
+	int operations;
+	bool write;
+	ec_map_t *next;
+};
+
+// One-shot request submitted from any thread, owned by the caller and
+// only touched by the master until it is done
+struct ec_submission_t {
+	address_t address;
+	uint16_t length;
+	int flags;
+	bool write;
+	void *data;	// Data to write or buffer for the data read
+
+	// Valid once done, result is -1 if the master was destroyed first
+	uint16_t wkc;
+	int result;
+
+	// Futex word and queue link
+	uint32_t state;
+	ec_submission_t *next;
+};
+
+// Frame capture to pcapng
+struct ec_capture_options_t {
+	// Size of the ring holding the most recent frames, rounded up to a power of two
+	int ring_bytes;
+
+	// File every frame is streamed to, NULL to only keep the ring
+	const char *path;
+
+	// After an incomplete cycle, the last error_seconds are dumped to
+	// error_path-<cycle>.pcapng, NULL to disable
+	const char *error_path;
+	int error_seconds;
+};
+
+// Telemetry recorder
+struct ec_recorder_options_t {
+	// Samples per block, and blocks the cycle can fill ahead of the writer
+	int block_samples;
+	int blocks;
+
+	// Write with O_DIRECT where the file system supports it
+	bool direct;
+};
+
+void ec_default_options(ec_options_t *);
+
 ethercat_t *ec_create(const char *);
+ethercat_t *ec_create_ex(const char *, const ec_options_t *);
 void ec_destroy(ethercat_t **);
 
-void ec_request_read(ethercat_t *, const address_t, uint16_t, ec_read_callback_t *, void *, int);
-void ec_request_write(ethercat_t *, const address_t, uint16_t, ec_write_callback_t *, void *, int);
+// One-shots in a frame that was lost stay queued for the next cycle. The
+// payload and data pointers must stay valid until the one-shot has been
+// answered or cancelled, cancel the ones still pending before freeing them.
+ec_handle_t ec_request_read(ethercat_t *, const address_t, uint16_t, ec_read_callback_t *, void *, int);
+ec_handle_t ec_request_write(ethercat_t *, const address_t, uint16_t, ec_write_callback_t *, void *, int);
+ec_handle_t ec_request_read_write(ethercat_t *, const address_t, uint16_t, ec_write_callback_t *, ec_read_callback_t *, void *, int);
+
+// Copy straight into or out of data every time the request is sent,
+// without a callback. wkc receives the working counter unless NULL.
+ec_handle_t ec_request_read_to(ethercat_t *, const address_t, uint16_t, void *data, uint16_t *wkc, int flags);
+ec_handle_t ec_request_write_from(ethercat_t *, const address_t, uint16_t, const void *data, int flags);
+
+// Bind requests to a range of a map, the cycle copies without callbacks.
+// ec_map_load reads a consistent copy of a read map from any thread,
+// -1 if the cycle kept copying into it.
+void ec_map_init(ec_map_t *, void *data, int length);
+ec_handle_t ec_map_read(ethercat_t *, ec_map_t *, int offset, const address_t, uint16_t length, int flags);
+ec_handle_t ec_map_write(ethercat_t *, ec_map_t *, int offset, const address_t, uint16_t length, int flags);
+int ec_map_load(const ec_map_t *, int offset, void *data, int length);
+
+// Change a request from the next cycle on, only the frame holding it is
+// rebuilt. Return -1 if the handle is no longer valid.
+int ec_cancel(ethercat_t *, ec_handle_t);
+int ec_pause(ethercat_t *, ec_handle_t);
+int ec_resume(ethercat_t *, ec_handle_t);
+int ec_modify(ethercat_t *, ec_handle_t, const address_t, uint16_t length);
+int ec_modify_callbacks(ethercat_t *, ec_handle_t, ec_write_callback_t *, ec_read_callback_t *, void *);
+
+int ec_do_cycle(ethercat_t *ethercat);
+
+// Maps the SM2/SM3 process data of the slaves at the given station
+// addresses to one logical range exchanged with a single LRW per cycle
+int ec_image_configure(ethercat_t *, const uint16_t *stations, int count, uint32_t logical_address);
+int ec_image_slave(const ethercat_t *, int slave, ec_image_slave_t *);
+
+uint8_t *ec_image_outputs(ethercat_t *);
+const uint8_t *ec_image_inputs(const ethercat_t *);
+uint16_t ec_image_working_counter(const ethercat_t *, uint16_t *expected);
+
+// Publish registers and ranges of the process image to a POSIX shared
+// memory segment after every cycle, see ethercat_export.h for readers
+int ec_export_register(ethercat_t *, const char *name, const address_t, uint16_t length, int flags);
+int ec_export_inputs(ethercat_t *, const char *name, int offset, int length);
+int ec_export_outputs(ethercat_t *, const char *name, int offset, int length);
+int ec_export_publish(ethercat_t *, const char *shm_name);
+
+// Counts all slaves and assigns station addresses first_station onwards
+int ec_scan(ethercat_t *, uint16_t first_station, ec_slave_info_t *, int max);
+
+// Requests an AL state from all count slaves (stations NULL) or the
+// given stations and waits until it is reached, an error or timeout
+int ec_set_state(ethercat_t *, const uint16_t *stations, int count, uint16_t state,
+	int interval_us, int timeout_ms);
+
+// Measures delays, sets offsets and adds the drift compensation ARMW
+int ec_dc_configure(ethercat_t *, const ec_slave_info_t *, int count, bool lock_cycle);
+int ec_dc_slave(const ethercat_t *, int slave, ec_dc_slave_t *);
+uint64_t ec_dc_reference_time(const ethercat_t *, uint16_t *wkc);
+
+// Reads the mailbox configuration (SM0/SM1) of the slaves at the given
+// station addresses and maps their mailbox status bits to status_address,
+// SDOs can then be queued to them
+int ec_mailbox_configure(ethercat_t *, const uint16_t *stations, int count, uint32_t status_address);
+
+// Queue SDO transfers that progress with the regular cycles, the
+// callback is called from ec_do_cycle once the transfer has finished
+int ec_sdo_download(ethercat_t *, uint16_t station, uint16_t index, uint8_t subindex,
+	const void *data, int length, ec_sdo_callback_t *, void *);
+int ec_sdo_upload(ethercat_t *, uint16_t station, uint16_t index, uint8_t subindex,
+	ec_sdo_callback_t *, void *);
+
+// Thread-safe one-shot requests, they join the next cycle and data must
+// stay valid until ec_wait returns 0 (-1 after timeout_us, -1 waits forever)
+int ec_submit_read(ethercat_t *, ec_submission_t *, const address_t, uint16_t length, void *data, int flags);
+int ec_submit_write(ethercat_t *, ec_submission_t *, const address_t, uint16_t length, const void *data,
+	int flags);
+int ec_wait(ec_submission_t *, int timeout_us);
+
+// Copies every frame sent and received into a ring, a background thread
+// writes it to pcapng files. ec_capture_dump is safe from any thread.
+void ec_default_capture_options(ec_capture_options_t *);
+int ec_capture_start(ethercat_t *, const ec_capture_options_t *);
+int ec_capture_dump(ethercat_t *, const char *path, int seconds);
+void ec_capture_stop(ethercat_t *);
+
+// Records variables of maps and the cycle timing every cycle into a
+// columnar file, see ethercat_record.h for the format and readers
+void ec_default_recorder_options(ec_recorder_options_t *);
+int ec_record_variable(ethercat_t *, const char *name, const ec_map_t *, int offset, int length, int type);
+int ec_record_start(ethercat_t *, const char *path, const ec_recorder_options_t *);
+void ec_record_stop(ethercat_t *);
+
+// Runs ec_do_cycle every period_ns on a dedicated thread until stopped
+int ec_run_cyclic(ethercat_t *, int64_t period_ns, ec_cycle_hook_t *, void *);
+void ec_stop_cyclic(ethercat_t *);
+
+void ec_get_counters(const ethercat_t *, ec_counters_t *);
+
+// Returns -1 when built without EC_ENABLE_STATS. Safe to call while
+// another thread cycles, a reset takes effect at the next cycle.
+int ec_get_stats(const ethercat_t *, ec_stats_t *);
+void ec_reset_stats(ethercat_t *);
 
-void ec_do_cycle(ethercat_t *ethercat);
+// Upper bound of the bucket holding the given percentile (0-100)
+uint64_t ec_stats_percentile(const ec_histogram_t *, double percentile);
 
 #endif
 
@@ -0,0 +1,128 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+void ec_batch_init(ethercat_batch_t *batch)
+{
+	memset(batch, 0, sizeof(ethercat_batch_t));
+}
+
+
+/**
+ * Adds the handle of a one-shot to the batch, wkc is checked against
+ * expected once the batch has been answered. A request that could
+ * not be made fails the whole batch when it is run.
+ */
+void ec_batch_add(ethercat_t *ethercat, ethercat_batch_t *batch, ec_handle_t handle, const uint16_t *wkc,
+	uint16_t expected)
+{
+	int index = ec_find_operation(ethercat, handle);
+
+	if(index == -1) {
+		batch->failed = true;
+		return;
+	}
+
+	if(batch->count == batch->capacity) {
+		int capacity = batch->capacity?2 * batch->capacity:16;
+		ethercat_batch_entry_t *entries = (ethercat_batch_entry_t *) realloc(batch->entries,
+			capacity * sizeof(ethercat_batch_entry_t));
+
+		if(entries == NULL) {
+			perror("realloc()");
+			ec_cancel(ethercat, handle);
+			batch->failed = true;
+			return;
+		}
+
+		batch->entries = entries;
+		batch->capacity = capacity;
+	}
+
+	ethercat_batch_entry_t *entry = &batch->entries[batch->count++];
+	entry->handle = handle;
+	entry->ado = ethercat->operations.address[index].physical.ado;
+	entry->wkc = wkc;
+	entry->expected = expected;
+}
+
+
+static int find_pending(const ethercat_t *ethercat, const ethercat_batch_t *batch)
+{
+	for(int i = 0; i < batch->count; i++) {
+		if(ec_find_operation(ethercat, batch->entries[i].handle) != -1)
+			return i;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Runs cycles until every one-shot of the batch has been answered.
+ * One-shots in a lost frame stay queued and go out again with the
+ * next cycle, after ETHERCAT_BATCH_CYCLES the ones still queued are
+ * cancelled. Then checks the working counters.
+ *
+ * Leaves the batch empty, so that it can be filled for the next step.
+ */
+int ec_batch_run(ethercat_t *ethercat, ethercat_batch_t *batch, const char *step)
+{
+	if(batch->failed) {
+		fprintf(stderr, "Could not queue all requests while %s.\n", step);
+		ec_batch_cancel(ethercat, batch);
+		return -1;
+	}
+
+	for(int cycle = 0; cycle < ETHERCAT_BATCH_CYCLES && find_pending(ethercat, batch) != -1; cycle++)
+		ec_do_cycle(ethercat);
+
+	int pending = find_pending(ethercat, batch);
+
+	if(pending != -1) {
+		fprintf(stderr, "No response from slave at %04x while %s.\n", batch->entries[pending].ado, step);
+		ec_batch_cancel(ethercat, batch);
+		return -1;
+	}
+
+	int result = 0;
+
+	for(int i = 0; i < batch->count; i++) {
+		const ethercat_batch_entry_t *entry = &batch->entries[i];
+
+		if(entry->wkc && *entry->wkc != entry->expected) {
+			fprintf(stderr, "Slave at %04x did not answer while %s (wkc %d).\n", entry->ado, step, *entry->wkc);
+			result = -1;
+			break;
+		}
+	}
+
+	batch->count = 0;
+	return result;
+}
+
+
+/**
+ * Cancels the one-shots of the batch that are still queued, their
+ * payloads are no longer touched once this returns.
+ */
+void ec_batch_cancel(ethercat_t *ethercat, ethercat_batch_t *batch)
+{
+	for(int i = 0; i < batch->count; i++)
+		ec_cancel(ethercat, batch->entries[i].handle);
+
+	batch->count = 0;
+	batch->failed = false;
+}
+
+
+void ec_batch_free(ethercat_t *ethercat, ethercat_batch_t *batch)
+{
+	ec_batch_cancel(ethercat, batch);
+	free(batch->entries);
+	ec_batch_init(batch);
+}
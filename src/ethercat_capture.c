@@ -0,0 +1,481 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Record of a frame or padding up to the end of the ring
+struct capture_record_t
+{
+	uint32_t length;	// Including this header, a multiple of 16
+	uint16_t frame_length;
+	uint8_t direction;	// EPB flags, or CAPTURE_PADDING
+	uint8_t reserved;
+	int64_t time_ns;	// CLOCK_MONOTONIC
+};
+
+static const uint8_t CAPTURE_PADDING = 0x00;
+static const uint8_t CAPTURE_INBOUND = 0x01;
+static const uint8_t CAPTURE_OUTBOUND = 0x02;
+
+static const int CAPTURE_ALIGNMENT = 16;
+static const int CAPTURE_MIN_RING = 65536;
+
+// How often the flush thread streams and walks the ring
+static const int64_t CAPTURE_INTERVAL_NS = 10000000;
+
+// Dump request states
+static const int DUMP_IDLE = 0;
+static const int DUMP_FILLING = 1;	// A thread is writing the request
+static const int DUMP_PENDING = 2;
+
+// pcapng block types
+static const uint32_t PCAPNG_SECTION = 0x0A0D0D0A;
+static const uint32_t PCAPNG_INTERFACE = 0x00000001;
+static const uint32_t PCAPNG_PACKET = 0x00000006;
+
+static const uint16_t LINKTYPE_ETHERNET = 1;
+
+typedef void(capture_emit_t)(ethercat_capture_t *, const capture_record_t *, const uint8_t *, void *);
+
+
+void ec_default_capture_options(ec_capture_options_t *options)
+{
+	options->ring_bytes = 16 * 1024 * 1024;
+	options->path = NULL;
+	options->error_path = NULL;
+	options->error_seconds = 5;
+}
+
+
+/**
+ * Appends a frame to the ring, called by the cycling thread for every
+ * frame sent and received. Old records are overwritten, the flush
+ * thread checks every copy it makes against reserve.
+ */
+static void capture_frame(ethercat_capture_t *capture, const uint8_t *frame, int length, uint8_t direction)
+{
+	if(length > ETHERCAT_MAX_FRAME)
+		length = ETHERCAT_MAX_FRAME;
+
+	uint32_t record_length = (sizeof(capture_record_t) + length + CAPTURE_ALIGNMENT - 1) & ~(CAPTURE_ALIGNMENT - 1);
+	uint64_t head = capture->head;
+	uint64_t offset = head & (capture->size - 1);
+	uint64_t skip = (offset + record_length > capture->size)?capture->size - offset:0;
+
+	__atomic_store_n(&capture->reserve, head + skip + record_length, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if(skip) {
+		capture_record_t *padding = (capture_record_t *) (capture->ring + offset);
+		padding->length = skip;
+		padding->frame_length = 0;
+		padding->direction = CAPTURE_PADDING;
+		offset = 0;
+	}
+
+	capture_record_t *record = (capture_record_t *) (capture->ring + offset);
+	record->length = record_length;
+	record->frame_length = length;
+	record->direction = direction;
+	record->time_ns = ec_monotonic_ns();
+	memcpy(record + 1, frame, length);
+
+	__atomic_store_n(&capture->head, head + skip + record_length, __ATOMIC_RELEASE);
+}
+
+
+void ec_capture_sent(ethercat_capture_t *capture, const uint8_t *frame, int length)
+{
+	capture_frame(capture, frame, length, CAPTURE_OUTBOUND);
+}
+
+
+void ec_capture_received(ethercat_capture_t *capture, const uint8_t *frame, int length)
+{
+	capture_frame(capture, frame, length, CAPTURE_INBOUND);
+}
+
+
+/**
+ * Visits the records from position up to end. Each record is copied
+ * before it is looked at and dropped if the writer has reached it in
+ * the meantime. The walk then resumes at the oldest lap start that was
+ * not overwritten, laps always start with a record. Returns the
+ * position reached.
+ */
+static uint64_t walk(ethercat_capture_t *capture, uint64_t position, uint64_t end, capture_emit_t *emit, void *arg)
+{
+	uint8_t frame[ETHERCAT_MAX_FRAME];
+
+	while(position < end) {
+		uint64_t offset = position & (capture->size - 1);
+		capture_record_t record;
+
+		memcpy(&record, capture->ring + offset, sizeof(capture_record_t));
+
+		bool valid = record.length >= sizeof(capture_record_t) && record.length <= capture->size - offset &&
+			record.frame_length <= ETHERCAT_MAX_FRAME;
+
+		if(valid && emit && record.direction != CAPTURE_PADDING)
+			memcpy(frame, capture->ring + offset + sizeof(capture_record_t), record.frame_length);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint64_t reserve = __atomic_load_n(&capture->reserve, __ATOMIC_RELAXED);
+
+		if(reserve > position + capture->size || !valid) {
+			uint64_t lap = ((reserve + capture->size - 1) / capture->size - 1) * capture->size;
+
+			capture->overruns++;
+			if(lap <= position)
+				break;
+
+			position = lap;
+			continue;
+		}
+
+		if(emit && record.direction != CAPTURE_PADDING)
+			emit(capture, &record, frame, arg);
+
+		position += record.length;
+	}
+
+	return position;
+}
+
+
+static void put16(uint8_t *ptr, uint16_t value)
+{
+	memcpy(ptr, &value, 2);
+}
+
+
+static void put32(uint8_t *ptr, uint32_t value)
+{
+	memcpy(ptr, &value, 4);
+}
+
+
+// Option header, code followed by the length of the value
+static void put_option(uint8_t *ptr, uint16_t code, uint16_t length)
+{
+	put16(ptr, code);
+	put16(ptr + 2, length);
+}
+
+
+/**
+ * Starts a pcapng file with a section header and one Ethernet interface
+ * with nanosecond timestamps, all in host byte order.
+ */
+static FILE *open_pcapng(const char *path)
+{
+	FILE *file = fopen(path, "wb");
+
+	if(file == NULL) {
+		perror("fopen()");
+		return NULL;
+	}
+
+	uint8_t blocks[60];
+	memset(blocks, 0, sizeof(blocks));
+
+	put32(blocks, PCAPNG_SECTION);
+	put32(blocks + 4, 28);
+	put32(blocks + 8, 0x1A2B3C4D);
+	put32(blocks + 12, 0x00000001);		// Version 1.0
+	memset(blocks + 16, 0xFF, 8);		// Section length unknown
+	put32(blocks + 24, 28);
+
+	uint8_t *interface = blocks + 28;
+	put32(interface, PCAPNG_INTERFACE);
+	put32(interface + 4, 32);
+	put16(interface + 8, LINKTYPE_ETHERNET);
+	put_option(interface + 16, 9, 1);	// if_tsresol
+	interface[20] = 9;			// 10^-9 s
+	put32(interface + 28, 32);
+
+	if(fwrite(blocks, sizeof(blocks), 1, file) != 1) {
+		perror("fwrite()");
+		fclose(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+
+/**
+ * Writes one enhanced packet block with the direction in epb_flags.
+ */
+static void write_packet(ethercat_capture_t *capture, const capture_record_t *record, const uint8_t *frame,
+	void *arg)
+{
+	FILE *file = (FILE *) arg;
+	uint8_t block[28 + ETHERCAT_MAX_FRAME + 3 + 16];
+
+	uint32_t padded = (record->frame_length + 3) & ~3;
+	uint32_t length = 28 + padded + 16;
+	uint64_t time = record->time_ns + capture->realtime_offset_ns;
+
+	put32(block, PCAPNG_PACKET);
+	put32(block + 4, length);
+	put32(block + 8, 0);			// Interface
+	put32(block + 12, time >> 32);
+	put32(block + 16, time & 0xFFFFFFFF);
+	put32(block + 20, record->frame_length);
+	put32(block + 24, record->frame_length);
+	memcpy(block + 28, frame, record->frame_length);
+	memset(block + 28 + record->frame_length, 0, padded - record->frame_length);
+
+	uint8_t *options = block + 28 + padded;
+	put_option(options, 2, 4);		// epb_flags
+	put32(options + 4, record->direction);
+	put32(options + 8, 0);			// End of options
+	put32(options + 12, length);
+
+	fwrite(block, length, 1, file);
+}
+
+
+struct capture_dump_t
+{
+	FILE *file;
+	int64_t from_ns;
+};
+
+
+static void write_recent_packet(ethercat_capture_t *capture, const capture_record_t *record, const uint8_t *frame,
+	void *arg)
+{
+	capture_dump_t *dump = (capture_dump_t *) arg;
+
+	if(record->time_ns >= dump->from_ns)
+		write_packet(capture, record, frame, dump->file);
+}
+
+
+/**
+ * Writes what is left in the ring since the requested time, the ring
+ * keeps being written meanwhile.
+ */
+static void write_dump(ethercat_capture_t *capture)
+{
+	capture_dump_t dump;
+	dump.from_ns = capture->dump_from_ns;
+	dump.file = open_pcapng(capture->dump_path);
+
+	if(dump.file) {
+		uint64_t head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+		walk(capture, capture->oldest, head, write_recent_packet, &dump);
+
+		if(fclose(dump.file) != 0)
+			perror("fclose()");
+	}
+
+	__atomic_store_n(&capture->dump, DUMP_IDLE, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Streams new records to the file and keeps the oldest record known
+ * a quarter of the ring ahead of the writer, from where dumps start.
+ */
+static void flush_capture(ethercat_capture_t *capture)
+{
+	uint64_t head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+
+	if(capture->file) {
+		capture->written = walk(capture, capture->written, head, write_packet, capture->file);
+		fflush(capture->file);
+	}
+
+	uint64_t keep = capture->size - capture->size / 4;
+
+	if(head > keep)
+		capture->oldest = walk(capture, capture->oldest, head - keep, NULL, NULL);
+
+	if(__atomic_load_n(&capture->dump, __ATOMIC_ACQUIRE) == DUMP_PENDING)
+		write_dump(capture);
+}
+
+
+static void *capture_thread(void *arg)
+{
+	ethercat_capture_t *capture = (ethercat_capture_t *) arg;
+
+	struct timespec interval;
+	interval.tv_sec = 0;
+	interval.tv_nsec = CAPTURE_INTERVAL_NS;
+
+	while(__atomic_load_n(&capture->running, __ATOMIC_ACQUIRE)) {
+		nanosleep(&interval, NULL);
+		flush_capture(capture);
+	}
+
+	// Everything the cycle captured before stopping
+	flush_capture(capture);
+	return NULL;
+}
+
+
+static void free_capture(ethercat_capture_t *capture)
+{
+	if(capture->file && fclose(capture->file) != 0)
+		perror("fclose()");
+
+	if(capture->ring)
+		munmap(capture->ring, capture->size);
+
+	free(capture->error_path);
+	free(capture);
+}
+
+
+/**
+ * Starts copying every frame sent and received into a ring and a
+ * thread that streams it to a pcapng file and writes dumps. Must not
+ * be called while the cyclic executor runs.
+ */
+int ec_capture_start(ethercat_t *ethercat, const ec_capture_options_t *options)
+{
+	if(ethercat->capture) {
+		fprintf(stderr, "Capture is already running.\n");
+		return -1;
+	}
+
+	if(options->ring_bytes <= 0 || options->error_seconds < 0) {
+		fprintf(stderr, "Invalid capture ring (%d bytes) or error dump (%d s).\n",
+			options->ring_bytes, options->error_seconds);
+		return -1;
+	}
+
+	ethercat_capture_t *capture = (ethercat_capture_t *) calloc(1, sizeof(ethercat_capture_t));
+
+	if(capture == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	capture->size = CAPTURE_MIN_RING;
+	while(capture->size < (uint64_t) options->ring_bytes)
+		capture->size *= 2;
+
+	// Populated up front, the cycle must not fault pages in
+	void *ring = mmap(NULL, capture->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+	if(ring == MAP_FAILED) {
+		perror("mmap()");
+		free(capture);
+		return -1;
+	}
+
+	capture->ring = (uint8_t *) ring;
+
+	if(options->path && (capture->file = open_pcapng(options->path)) == NULL) {
+		free_capture(capture);
+		return -1;
+	}
+
+	if(options->error_path && (capture->error_path = strdup(options->error_path)) == NULL) {
+		perror("strdup()");
+		free_capture(capture);
+		return -1;
+	}
+
+	capture->error_seconds = options->error_seconds;
+
+	struct timespec realtime, monotonic;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+	capture->realtime_offset_ns = ((int64_t) realtime.tv_sec - monotonic.tv_sec) * 1000000000 +
+		realtime.tv_nsec - monotonic.tv_nsec;
+
+	__atomic_store_n(&capture->running, true, __ATOMIC_RELEASE);
+
+	int error = pthread_create(&capture->thread, NULL, capture_thread, capture);
+
+	if(error != 0) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(error));
+		free_capture(capture);
+		return -1;
+	}
+
+	ethercat->capture = capture;
+	return 0;
+}
+
+
+/**
+ * Writes the frames of the last seconds still in the ring to a new
+ * pcapng file. The flush thread writes it within its next interval,
+ * returns -1 while an earlier dump is pending. Safe from any thread.
+ */
+int ec_capture_dump(ethercat_t *ethercat, const char *path, int seconds)
+{
+	ethercat_capture_t *capture = ethercat->capture;
+
+	if(capture == NULL)
+		return -1;
+
+	if(strlen(path) >= sizeof(capture->dump_path)) {
+		fprintf(stderr, "Dump path %s is too long.\n", path);
+		return -1;
+	}
+
+	int idle = DUMP_IDLE;
+
+	if(!__atomic_compare_exchange_n(&capture->dump, &idle, DUMP_FILLING, false,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return -1;
+
+	strcpy(capture->dump_path, path);
+	capture->dump_from_ns = ec_monotonic_ns() - (int64_t) seconds * 1000000000;
+
+	__atomic_store_n(&capture->dump, DUMP_PENDING, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+// Dumps the last error_seconds after an incomplete cycle
+void ec_capture_error(ethercat_t *ethercat)
+{
+	ethercat_capture_t *capture = ethercat->capture;
+	char path[sizeof(capture->dump_path)];
+
+	if(snprintf(path, sizeof(path), "%s-%llu.pcapng", capture->error_path,
+		(unsigned long long) ethercat->counters.cycles) < (int) sizeof(path))
+		ec_capture_dump(ethercat, path, capture->error_seconds);
+}
+
+
+/**
+ * Stops capturing after the flush thread has written everything
+ * captured so far and a pending dump. Must not be called while the
+ * cyclic executor runs.
+ */
+void ec_capture_stop(ethercat_t *ethercat)
+{
+	ethercat_capture_t *capture = ethercat->capture;
+
+	if(capture == NULL)
+		return;
+
+	ethercat->capture = NULL;
+
+	__atomic_store_n(&capture->running, false, __ATOMIC_RELEASE);
+	pthread_join(capture->thread, NULL);
+
+	if(capture->overruns)
+		fprintf(stderr, "Capture ring overran %llu times, frames were lost.\n",
+			(unsigned long long) capture->overruns);
+
+	free_capture(capture);
+}
@@ -0,0 +1,147 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static void ec_sleep_until(int64_t deadline_ns)
+{
+	struct timespec deadline;
+	deadline.tv_sec = deadline_ns / 1000000000;
+	deadline.tv_nsec = deadline_ns % 1000000000;
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) { }
+}
+
+
+/**
+ * Sleeps until shortly before each deadline, spins the rest of the
+ * way and runs a cycle followed by the hook. A cycle that finishes
+ * after the next deadline is an overrun, the missed periods are
+ * skipped so the executor stays on its original time grid.
+ */
+static void *ec_cyclic_thread(void *arg)
+{
+	ethercat_t *ethercat = (ethercat_t *) arg;
+	ethercat_cyclic_t *cyclic = &ethercat->cyclic;
+
+	int64_t period = cyclic->period_ns;
+	int64_t spin = (int64_t) cyclic->spin_us * 1000;
+	int64_t deadline = ec_monotonic_ns() + period;
+	EC_STATS(int64_t previous = 0);
+
+	while(__atomic_load_n(&cyclic->running, __ATOMIC_ACQUIRE)) {
+		if(spin < period)
+			ec_sleep_until(deadline - spin);
+
+		// Without spinning the sleep already ended at the deadline
+		if(spin > 0)
+			while(ec_monotonic_ns() < deadline) { }
+
+#ifdef EC_ENABLE_STATS
+		int64_t start = ec_monotonic_ns();
+		ec_record_stat(ethercat, EC_STAT_WAKEUP, start - deadline);
+		if(previous)
+			ec_record_stat(ethercat, EC_STAT_JITTER, llabs(start - previous - period));
+		previous = start;
+#endif
+
+		ec_do_cycle(ethercat);
+
+		if(cyclic->hook)
+			cyclic->hook(ethercat, cyclic->arg);
+
+		deadline += period;
+
+		if(ethercat->dc && ethercat->dc->lock)
+			deadline += ec_dc_cycle_correction(ethercat, period);
+
+		int64_t now = ec_monotonic_ns();
+		if(now > deadline) {
+			__atomic_fetch_add(&ethercat->counters.cycles_overrun, 1, __ATOMIC_RELAXED);
+			deadline += ((now - deadline) / period + 1) * period;
+		}
+	}
+
+	return NULL;
+}
+
+
+int ec_run_cyclic(ethercat_t *ethercat, int64_t period_ns, ec_cycle_hook_t *hook, void *arg)
+{
+	ethercat_cyclic_t *cyclic = &ethercat->cyclic;
+
+	if(period_ns <= 0) {
+		fprintf(stderr, "Invalid cycle period (%lld ns).\n", (long long) period_ns);
+		return -1;
+	}
+
+	if(cyclic->running) {
+		fprintf(stderr, "Cyclic executor is already running.\n");
+		return -1;
+	}
+
+	cyclic->period_ns = period_ns;
+	cyclic->hook = hook;
+	cyclic->arg = arg;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	if(cyclic->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cyclic->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+	}
+
+	if(cyclic->priority > 0) {
+		struct sched_param param;
+		param.sched_priority = cyclic->priority;
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+
+		// Page faults in the cycle are as bad as being preempted
+		if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+			perror("mlockall()");
+	}
+
+	__atomic_store_n(&cyclic->running, true, __ATOMIC_RELEASE);
+
+	int error = pthread_create(&cyclic->thread, &attr, ec_cyclic_thread, ethercat);
+	pthread_attr_destroy(&attr);
+
+	if(error != 0) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(error));
+		__atomic_store_n(&cyclic->running, false, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Stops the executor after its current cycle. Must not be called
+ * from the hook.
+ */
+void ec_stop_cyclic(ethercat_t *ethercat)
+{
+	ethercat_cyclic_t *cyclic = &ethercat->cyclic;
+
+	if(!__atomic_load_n(&cyclic->running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&cyclic->running, false, __ATOMIC_RELEASE);
+	pthread_join(cyclic->thread, NULL);
+}
@@ -0,0 +1,322 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// ESC feature bit for distributed clocks
+static const uint16_t FEATURE_DC = 0x0004;
+
+// DC system time counts from 2000-01-01 00:00
+static const int64_t DC_EPOCH_S = 946684800;
+
+
+// Latched times of one slave
+struct dc_setup_t
+{
+	uint8_t ports[16];	// Receive time of port 0-3
+	uint8_t unit[8];	// Receive time of the processing unit
+	uint16_t wkc;
+	uint16_t unit_wkc;
+
+	uint8_t offset[8];
+	uint8_t delay[4];
+};
+
+
+/**
+ * Receives the reference clock's system time through the ARMW.
+ */
+static void read_reference_time(const address_t address, void *payload, uint16_t length, const void *data)
+{
+	ethercat_dc_t *dc = (ethercat_dc_t *) payload;
+	const uint8_t *tmp = (const uint8_t *) data;
+
+	dc->reference_time = ec_get64(tmp);
+	dc->wkc = ec_get16(tmp + length);
+}
+
+
+/**
+ * Time from the frame entering port 0 until it leaves through the
+ * last port with communication, i.e. the round trip through all
+ * slaves behind this one.
+ */
+static uint32_t loop_time(const dc_setup_t *setup, uint16_t dl_status)
+{
+	uint32_t first = ec_get32(setup->ports);
+	uint32_t loop = 0;
+
+	for(int port = 1; port < 4; port++) {
+		if(!(dl_status & (DL_STATUS_COMMUNICATION << (2 * port))))
+			continue;
+
+		uint32_t time = ec_get32(setup->ports + 4 * port) - first;
+		if(time > loop)
+			loop = time;
+	}
+
+	return loop;
+}
+
+
+static int64_t master_time_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((int64_t) now.tv_sec - DC_EPOCH_S) * 1000000000 + now.tv_nsec;
+}
+
+
+void ec_free_dc(ethercat_t *ethercat)
+{
+	if(ethercat->dc) {
+		free(ethercat->dc->slaves);
+		free(ethercat->dc);
+	}
+	ethercat->dc = NULL;
+}
+
+
+static int dc_setup(ethercat_t *ethercat, ethercat_batch_t *batch, ethercat_dc_t *dc, const ec_slave_info_t *slaves,
+	int count, dc_setup_t *setup)
+{
+	// Latch the receive times of all ports at once
+	address_t address;
+	address.physical.ado = 0x0000;
+	address.physical.adp = reg_dc_receive_time;
+	ec_batch_add(ethercat, batch, ec_request_write(ethercat, address, 4, NULL, NULL, EC_CALL_ONESHOT | EC_ADDR_BR),
+		NULL, 0);
+
+	int64_t master_time = master_time_ns();
+
+	if(ec_batch_run(ethercat, batch, "latching receive times") == -1)
+		return -1;
+
+	for(int i = 0; i < count; i++) {
+		if(!(slaves[i].features & FEATURE_DC))
+			continue;
+
+		address.physical.ado = slaves[i].station;
+		address.physical.adp = reg_dc_receive_time;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 16, setup[i].ports, &setup[i].wkc,
+			EC_CALL_ONESHOT), &setup[i].wkc, 1);
+
+		address.physical.adp = reg_dc_receive_time_unit;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 8, setup[i].unit, &setup[i].unit_wkc,
+			EC_CALL_ONESHOT), &setup[i].unit_wkc, 1);
+	}
+
+	if(ec_batch_run(ethercat, batch, "reading receive times") == -1)
+		return -1;
+
+	// Delays relative to the reference clock, which is the first DC slave
+	uint32_t *delays = (uint32_t *) calloc(count, sizeof(uint32_t));
+
+	if(delays == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	for(int i = 0; i < count; i++) {
+		if(!(slaves[i].features & FEATURE_DC))
+			continue;
+
+		ec_dc_slave_t *info = &dc->slaves[dc->slave_count++];
+		info->position = slaves[i].position;
+		info->station = slaves[i].station;
+
+		if(dc->slave_count == 1) {
+			dc->reference = slaves[i].position;
+		} else {
+			// Nearest DC slave towards the master, the frame passes it
+			// on the way out and again on the way back
+			int parent = slaves[i].parent;
+			while(parent >= 0 && !(slaves[parent].features & FEATURE_DC))
+				parent = slaves[parent].parent;
+
+			if(parent >= 0) {
+				uint32_t outer = loop_time(&setup[parent], slaves[parent].dl_status);
+				uint32_t inner = loop_time(&setup[i], slaves[i].dl_status);
+				delays[i] = delays[parent] + (outer - inner) / 2;
+			}
+		}
+
+		// System time of the reference at the latch plus the time the
+		// frame needed to get here, in this slave's local time
+		int64_t local = ec_get64(setup[i].unit);
+		int64_t reference = master_time + delays[i];
+
+		info->delay_ns = delays[i];
+		info->offset_ns = reference - local;
+
+		ec_put64(setup[i].offset, info->offset_ns);
+		ec_put32(setup[i].delay, delays[i]);
+	}
+
+	free(delays);
+
+	if(dc->slave_count == 0) {
+		fprintf(stderr, "No slave supports distributed clocks.\n");
+		return -1;
+	}
+
+	for(int i = 0; i < count; i++) {
+		if(!(slaves[i].features & FEATURE_DC))
+			continue;
+
+		address.physical.ado = slaves[i].station;
+		address.physical.adp = reg_dc_system_offset;
+		ec_batch_add(ethercat, batch, ec_request_write_from(ethercat, address, 8, setup[i].offset, EC_CALL_ONESHOT),
+			NULL, 0);
+
+		address.physical.adp = reg_dc_system_delay;
+		ec_batch_add(ethercat, batch, ec_request_write_from(ethercat, address, 4, setup[i].delay, EC_CALL_ONESHOT),
+			NULL, 0);
+	}
+
+	if(ec_batch_run(ethercat, batch, "setting clock offsets") == -1)
+		return -1;
+
+	// Every cycle the reference clock's time is read and written to all
+	// following slaves, which compensate their drift against it
+	address.physical.ado = (uint16_t) -dc->reference;
+	address.physical.adp = reg_dc_system_time;
+	ec_request_read_write(ethercat, address, 8, NULL, read_reference_time, dc,
+		EC_CALL_PERIODIC | EC_ADDR_AI | EC_ADDR_RMW);
+
+	return 0;
+}
+
+
+/**
+ * Sets up distributed clocks for the slaves as returned by ec_scan. The
+ * receive times of all ports are latched with a broadcast write, from
+ * which the propagation delay of every slave is derived along the
+ * topology, assuming branches are lines.
+ * The first DC slave becomes the reference clock and is set to the
+ * host's real time, all others get offsets and delays relative to it.
+ *
+ * From then on every cycle carries an ARMW distributing the reference
+ * time for drift compensation. With lock_cycle the cyclic executor
+ * also adjusts its deadlines to follow the reference clock.
+ *
+ * Blocks for three cycles, more when frames are lost, must be called
+ * before starting the cyclic executor.
+ */
+int ec_dc_configure(ethercat_t *ethercat, const ec_slave_info_t *slaves, int count, bool lock_cycle)
+{
+	if(ethercat->dc) {
+		fprintf(stderr, "Distributed clocks are already configured.\n");
+		return -1;
+	}
+
+	if(count <= 0) {
+		fprintf(stderr, "Invalid number of slaves (%d).\n", count);
+		return -1;
+	}
+
+	dc_setup_t *setup = (dc_setup_t *) calloc(count, sizeof(dc_setup_t));
+	ethercat_dc_t *dc = (ethercat_dc_t *) calloc(1, sizeof(ethercat_dc_t));
+	ec_dc_slave_t *dc_slaves = (ec_dc_slave_t *) calloc(count, sizeof(ec_dc_slave_t));
+
+	if(setup == NULL || dc == NULL || dc_slaves == NULL) {
+		perror("calloc()");
+		free(setup);
+		free(dc);
+		free(dc_slaves);
+		return -1;
+	}
+
+	ethercat->dc = dc;
+	dc->slaves = dc_slaves;
+	dc->lock = lock_cycle;
+
+	ethercat_batch_t batch;
+	ec_batch_init(&batch);
+
+	int result = dc_setup(ethercat, &batch, dc, slaves, count, setup);
+	ec_batch_free(ethercat, &batch);
+	free(setup);
+
+	if(result == -1)
+		ec_free_dc(ethercat);
+
+	return result;
+}
+
+
+/**
+ * Correction of the next deadline that keeps the reference time at
+ * which cycles arrive at the same phase of the period, so the cycle
+ * follows the reference clock instead of the host clock.
+ */
+int64_t ec_dc_cycle_correction(ethercat_t *ethercat, int64_t period_ns)
+{
+	ethercat_dc_t *dc = ethercat->dc;
+
+	if(dc == NULL || !dc->lock || dc->wkc == 0)
+		return 0;
+
+	int64_t phase = dc->reference_time % period_ns;
+
+	if(!dc->phase_valid) {
+		dc->phase_ns = phase;
+		dc->phase_valid = true;
+		return 0;
+	}
+
+	int64_t error = phase - dc->phase_ns;
+	if(error > period_ns / 2)
+		error -= period_ns;
+	else if(error < -period_ns / 2)
+		error += period_ns;
+
+	// PI controller, the integral follows the rate difference of the clocks
+	int64_t limit = period_ns / 16;
+
+	dc->integral_ns += error;
+	if(dc->integral_ns > 256 * limit)
+		dc->integral_ns = 256 * limit;
+	else if(dc->integral_ns < -256 * limit)
+		dc->integral_ns = -256 * limit;
+
+	int64_t correction = -(error / 8 + dc->integral_ns / 256);
+
+	if(correction > limit)
+		correction = limit;
+	else if(correction < -limit)
+		correction = -limit;
+
+	return correction;
+}
+
+
+int ec_dc_slave(const ethercat_t *ethercat, int slave, ec_dc_slave_t *info)
+{
+	const ethercat_dc_t *dc = ethercat->dc;
+
+	if(dc == NULL || slave < 0 || slave >= dc->slave_count)
+		return -1;
+
+	*info = dc->slaves[slave];
+	return 0;
+}
+
+
+/**
+ * System time of the reference clock as read in the last cycle and
+ * the working counter of the ARMW (one per DC slave from the reference
+ * clock on).
+ */
+uint64_t ec_dc_reference_time(const ethercat_t *ethercat, uint16_t *wkc)
+{
+	const ethercat_dc_t *dc = ethercat->dc;
+
+	if(wkc)
+		*wkc = dc?dc->wkc:0;
+
+	return dc?dc->reference_time:0;
+}
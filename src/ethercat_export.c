@@ -0,0 +1,381 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+#include "ethercat_export.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static size_t align8(size_t value)
+{
+	return (value + 7) & ~(size_t) 7;
+}
+
+
+/**
+ * Cancels the register reads before their staging copy is freed and
+ * removes the segment, also after a publish that failed part way.
+ */
+static void unpublish(ethercat_t *ethercat, ethercat_export_t *exports)
+{
+	if(exports->reads) {
+		for(int i = 0; i < exports->entry_count; i++)
+			ec_cancel(ethercat, exports->reads[i]);
+	}
+
+	// Readers still attached see the segment closed, new ones no longer find it
+	if(exports->header) {
+		__atomic_store_n(&exports->header->closed, 1, __ATOMIC_RELEASE);
+		munmap(exports->header, exports->size);
+		shm_unlink(exports->name);
+	}
+
+	free(exports->reads);
+	free(exports->name);
+	free(exports->staging);
+
+	exports->reads = NULL;
+	exports->name = NULL;
+	exports->staging = NULL;
+	exports->header = NULL;
+	exports->data = NULL;
+}
+
+
+void ec_free_export(ethercat_t *ethercat)
+{
+	ethercat_export_t *exports = ethercat->exports;
+
+	if(exports == NULL)
+		return;
+
+	unpublish(ethercat, exports);
+	free(exports->entries);
+	free(exports->flags);
+	free(exports);
+
+	ethercat->exports = NULL;
+}
+
+
+/**
+ * Appends a descriptor, only possible until the segment is published.
+ */
+static ec_export_entry_t *add_entry(ethercat_t *ethercat, const char *name, int source, int flags)
+{
+	if(strlen(name) >= EC_EXPORT_NAME_LENGTH) {
+		fprintf(stderr, "Export name %s is longer than %d characters.\n", name, EC_EXPORT_NAME_LENGTH - 1);
+		return NULL;
+	}
+
+	if(ethercat->exports == NULL) {
+		ethercat->exports = (ethercat_export_t *) calloc(1, sizeof(ethercat_export_t));
+
+		if(ethercat->exports == NULL) {
+			perror("calloc()");
+			return NULL;
+		}
+	}
+
+	ethercat_export_t *exports = ethercat->exports;
+
+	if(exports->header) {
+		fprintf(stderr, "Exports are already published as %s.\n", exports->name);
+		return NULL;
+	}
+
+	for(int i = 0; i < exports->entry_count; i++) {
+		if(strcmp(exports->entries[i].name, name) == 0) {
+			fprintf(stderr, "Export %s already exists.\n", name);
+			return NULL;
+		}
+	}
+
+	if(exports->entry_count == exports->entry_capacity) {
+		int capacity = exports->entry_capacity?2 * exports->entry_capacity:16;
+		ec_export_entry_t *entries =
+			(ec_export_entry_t *) realloc(exports->entries, capacity * sizeof(ec_export_entry_t));
+
+		if(entries)
+			exports->entries = entries;
+
+		int *entry_flags = (int *) realloc(exports->flags, capacity * sizeof(int));
+
+		if(entry_flags)
+			exports->flags = entry_flags;
+
+		if(entries == NULL || entry_flags == NULL) {
+			perror("realloc()");
+			return NULL;
+		}
+
+		exports->entry_capacity = capacity;
+	}
+
+	ec_export_entry_t *entry = &exports->entries[exports->entry_count];
+	memset(entry, 0, sizeof(ec_export_entry_t));
+	strcpy(entry->name, name);
+	entry->source = source;
+
+	exports->flags[exports->entry_count++] = flags;
+	return entry;
+}
+
+
+/**
+ * Exports registers read with the given flags, which must make the
+ * request periodic. The read is only added once the segment is
+ * published.
+ */
+int ec_export_register(ethercat_t *ethercat, const char *name, const address_t address, uint16_t length,
+	int flags)
+{
+	if((flags & (EC_CALL_PERIODIC | EC_CALL_ONESHOT)) != EC_CALL_PERIODIC) {
+		fprintf(stderr, "Exported registers must be read periodically.\n");
+		return -1;
+	}
+
+	if(length == 0 || length > ETHERCAT_MAX_PAYLOAD) {
+		fprintf(stderr, "Invalid length (%d) for export %s.\n", length, name);
+		return -1;
+	}
+
+	ec_export_entry_t *entry = add_entry(ethercat, name, EC_EXPORT_REGISTER, flags);
+
+	if(entry == NULL)
+		return -1;
+
+	entry->address = address.logical;
+	entry->length = length;
+	return 0;
+}
+
+
+static int export_image(ethercat_t *ethercat, const char *name, int source, int offset, int length)
+{
+	const ethercat_image_t *image = ethercat->image;
+
+	if(image == NULL) {
+		fprintf(stderr, "The process image is not configured.\n");
+		return -1;
+	}
+
+	int image_length = (source == EC_EXPORT_INPUTS)?image->input_length:image->output_length;
+
+	if(offset < 0 || length <= 0 || offset + length > image_length) {
+		fprintf(stderr, "Range %d+%d is outside the %d bytes of %s.\n", offset, length, image_length,
+			(source == EC_EXPORT_INPUTS)?"inputs":"outputs");
+		return -1;
+	}
+
+	ec_export_entry_t *entry = add_entry(ethercat, name, source, 0);
+
+	if(entry == NULL)
+		return -1;
+
+	entry->address = offset;
+	entry->length = length;
+	return 0;
+}
+
+
+// Ranges of the process image, ec_image_configure must have been called
+int ec_export_inputs(ethercat_t *ethercat, const char *name, int offset, int length)
+{
+	return export_image(ethercat, name, EC_EXPORT_INPUTS, offset, length);
+}
+
+
+int ec_export_outputs(ethercat_t *ethercat, const char *name, int offset, int length)
+{
+	return export_image(ethercat, name, EC_EXPORT_OUTPUTS, offset, length);
+}
+
+
+static int create_segment(ethercat_export_t *exports, const char *name)
+{
+	// A segment left behind by a master that did not shut down is replaced
+	if(shm_unlink(name) == -1 && errno != ENOENT) {
+		perror("shm_unlink()");
+		return -1;
+	}
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if(fd == -1) {
+		perror("shm_open()");
+		return -1;
+	}
+
+	if(ftruncate(fd, exports->size) == -1) {
+		perror("ftruncate()");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+
+	void *memory = mmap(NULL, exports->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(memory == MAP_FAILED) {
+		perror("mmap()");
+		shm_unlink(name);
+		return -1;
+	}
+
+	exports->header = (ec_export_header_t *) memory;
+	return 0;
+}
+
+
+/**
+ * Lays out the data area, working counters first followed by the data
+ * of each entry, with a staging copy for the registers.
+ */
+static int layout_entries(ethercat_export_t *exports)
+{
+	size_t offset = align8(exports->entry_count * sizeof(uint16_t));
+
+	for(int i = 0; i < exports->entry_count; i++) {
+		exports->entries[i].wkc_offset = i * sizeof(uint16_t);
+		exports->entries[i].offset = offset;
+		offset = align8(offset + exports->entries[i].length);
+	}
+
+	exports->data_length = offset;
+	exports->staging = (uint8_t *) calloc(1, offset);
+	exports->reads = (ec_handle_t *) calloc(exports->entry_count, sizeof(ec_handle_t));
+
+	if(exports->staging == NULL || exports->reads == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	for(int i = 0; i < exports->entry_count; i++)
+		exports->reads[i] = -1;
+
+	return 0;
+}
+
+
+// Adds the register reads into the staging copy
+static int add_reads(ethercat_t *ethercat, ethercat_export_t *exports)
+{
+	for(int i = 0; i < exports->entry_count; i++) {
+		const ec_export_entry_t *entry = &exports->entries[i];
+
+		if(entry->source != EC_EXPORT_REGISTER)
+			continue;
+
+		address_t address;
+		address.logical = entry->address;
+
+		exports->reads[i] = ec_request_read_to(ethercat, address, entry->length, exports->staging + entry->offset,
+			(uint16_t *) (exports->staging + entry->wkc_offset), exports->flags[i]);
+
+		if(exports->reads[i] == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Creates the shared memory segment name (as for shm_open, "/name")
+ * with the entries added so far, which are published after every cycle
+ * from then on. Readers attach with ec_export_attach.
+ */
+int ec_export_publish(ethercat_t *ethercat, const char *name)
+{
+	ethercat_export_t *exports = ethercat->exports;
+
+	if(exports == NULL || exports->entry_count == 0) {
+		fprintf(stderr, "Nothing to export.\n");
+		return -1;
+	}
+
+	if(exports->header || exports->staging) {
+		fprintf(stderr, "Exports are already published.\n");
+		return -1;
+	}
+
+	if(layout_entries(exports) == -1) {
+		unpublish(ethercat, exports);
+		return -1;
+	}
+
+	size_t data_offset = align8(sizeof(ec_export_header_t) + exports->entry_count * sizeof(ec_export_entry_t));
+	exports->size = data_offset + exports->data_length;
+	exports->name = strdup(name);
+
+	if(exports->name == NULL) {
+		perror("strdup()");
+		unpublish(ethercat, exports);
+		return -1;
+	}
+
+	// The reads start once the segment exists, nothing is left behind if it fails
+	if(create_segment(exports, name) == -1 || add_reads(ethercat, exports) == -1) {
+		unpublish(ethercat, exports);
+		return -1;
+	}
+
+	ec_export_header_t *header = exports->header;
+	header->version = EC_EXPORT_VERSION;
+	header->size = exports->size;
+	header->entry_count = exports->entry_count;
+	header->data_offset = data_offset;
+	header->data_length = exports->data_length;
+	memcpy(header + 1, exports->entries, exports->entry_count * sizeof(ec_export_entry_t));
+
+	exports->data = (uint8_t *) header + data_offset;
+
+	// Readers check the magic first, it marks the layout as complete
+	__atomic_store_n(&header->magic, EC_EXPORT_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/**
+ * Copies the registers read and the image ranges into the segment,
+ * called by the cycling thread at the end of every cycle. Readers
+ * retry while the sequence is odd.
+ */
+void ec_publish_export(ethercat_t *ethercat, bool complete)
+{
+	ethercat_export_t *exports = ethercat->exports;
+	ec_export_header_t *header = exports->header;
+	const ethercat_image_t *image = ethercat->image;
+
+	__atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for(int i = 0; i < exports->entry_count; i++) {
+		const ec_export_entry_t *entry = &exports->entries[i];
+		uint8_t *data = exports->data + entry->offset;
+		uint16_t *wkc = (uint16_t *) (exports->data + entry->wkc_offset);
+
+		if(entry->source == EC_EXPORT_REGISTER) {
+			memcpy(data, exports->staging + entry->offset, entry->length);
+			*wkc = *(const uint16_t *) (exports->staging + entry->wkc_offset);
+		} else {
+			const uint8_t *source = (entry->source == EC_EXPORT_INPUTS)?ec_image_inputs(ethercat):image->outputs;
+			memcpy(data, source + entry->address, entry->length);
+			*wkc = image->wkc;
+		}
+	}
+
+	header->cycle = ethercat->counters.cycles;
+	header->time_ns = ec_monotonic_ns();
+	header->complete = complete;
+
+	__atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,78 @@
+#ifndef __ETHERCAT_EXPORT_H__
+#define __ETHERCAT_EXPORT_H__
+
+#include <stdint.h>
+
+/**
+ * Layout of the POSIX shared memory segment a master publishes with
+ * ec_export_publish, and the reader library for other processes. The
+ * segment starts with a header, followed by the entry descriptors and
+ * the data area. Descriptors are written once before the segment is
+ * published and never change.
+ *
+ * The cycling thread rewrites the data area after every cycle, with
+ * the sequence odd while it does. Readers copy and retry until the
+ * sequence was even and unchanged, so they never make a system call
+ * and never hold up the cycle.
+ *
+ * Readers only need this header and ethercat_export_reader.c.
+ */
+
+#define EC_EXPORT_MAGIC   0x31584345	// "ECX1"
+#define EC_EXPORT_VERSION 1
+
+// Sources of entries
+#define EC_EXPORT_REGISTER 0x00	// Periodic read of slave registers
+#define EC_EXPORT_INPUTS   0x01	// Range of the process image inputs
+#define EC_EXPORT_OUTPUTS  0x02	// Range of the process image outputs
+
+#define EC_EXPORT_NAME_LENGTH 32
+
+struct ec_export_entry_t {
+	char name[EC_EXPORT_NAME_LENGTH];
+	uint32_t source;
+	uint32_t address;	// Logical or ado | adp << 16 of registers, image offset otherwise
+	uint32_t length;
+
+	// Into the data area, the data is 8 byte aligned
+	uint32_t offset;
+	uint32_t wkc_offset;
+	uint32_t reserved;
+};
+
+struct ec_export_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		// Of the whole segment
+	uint32_t entry_count;	// Descriptors follow the header
+	uint32_t data_offset;	// From the start of the segment
+	uint32_t data_length;
+
+	// Set when the master is destroyed, the segment is no longer updated
+	uint32_t closed;
+
+	// Odd while the fields below and the data area are written
+	uint32_t sequence;
+
+	uint64_t cycle;		// Cycles done by the master
+	int64_t time_ns;	// CLOCK_MONOTONIC when the cycle finished
+	uint32_t complete;	// All frames of the cycle came back
+	uint32_t reserved;
+};
+
+struct ec_export_reader_t;
+
+ec_export_reader_t *ec_export_attach(const char *name);
+void ec_export_detach(ec_export_reader_t **);
+
+const ec_export_header_t *ec_export_header(const ec_export_reader_t *);
+const ec_export_entry_t *ec_export_entry(const ec_export_reader_t *, int index);
+const ec_export_entry_t *ec_export_find(const ec_export_reader_t *, const char *name);
+
+// Consistent copies of one entry or the whole data area as left by one
+// cycle, -1 once the master is gone or while it never finishes a write
+int ec_export_load(const ec_export_reader_t *, const ec_export_entry_t *, void *data, uint16_t *wkc,
+	uint64_t *cycle);
+int ec_export_snapshot(const ec_export_reader_t *, void *data, uint64_t *cycle);
+
+#endif
@@ -0,0 +1,202 @@
+#include "ethercat_export.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Attempts before giving up on a sequence that stays odd, which only
+// happens when the master died while writing
+static const int EXPORT_RETRIES = 1000000;
+
+
+struct ec_export_reader_t
+{
+	const ec_export_header_t *header;
+	const uint8_t *data;
+	size_t size;
+};
+
+
+static bool check_layout(const ec_export_header_t *header, size_t size)
+{
+	if(size < sizeof(ec_export_header_t) || header->magic != EC_EXPORT_MAGIC) {
+		fprintf(stderr, "Not an exported process image.\n");
+		return false;
+	}
+
+	if(header->version != EC_EXPORT_VERSION) {
+		fprintf(stderr, "Exported process image has version %u, expected %u.\n",
+			header->version, EC_EXPORT_VERSION);
+		return false;
+	}
+
+	uint64_t entries = sizeof(ec_export_header_t) + (uint64_t) header->entry_count * sizeof(ec_export_entry_t);
+
+	if(header->size != size || entries > header->data_offset ||
+	   (uint64_t) header->data_offset + header->data_length > size) {
+		fprintf(stderr, "Exported process image is truncated.\n");
+		return false;
+	}
+
+	const ec_export_entry_t *entry = (const ec_export_entry_t *) (header + 1);
+
+	for(uint32_t i = 0; i < header->entry_count; i++, entry++) {
+		if((uint64_t) entry->offset + entry->length > header->data_length ||
+		   (uint64_t) entry->wkc_offset + 2 > header->data_length) {
+			fprintf(stderr, "Entry %u lies outside the exported data.\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Maps the segment published under name read-only. Loads afterwards
+ * only read memory.
+ */
+ec_export_reader_t *ec_export_attach(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+
+	if(fd == -1) {
+		perror("shm_open()");
+		return NULL;
+	}
+
+	struct stat info;
+
+	if(fstat(fd, &info) == -1) {
+		perror("fstat()");
+		close(fd);
+		return NULL;
+	}
+
+	void *memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(memory == MAP_FAILED) {
+		perror("mmap()");
+		return NULL;
+	}
+
+	const ec_export_header_t *header = (const ec_export_header_t *) memory;
+
+	if(!check_layout(header, info.st_size)) {
+		munmap(memory, info.st_size);
+		return NULL;
+	}
+
+	ec_export_reader_t *reader = (ec_export_reader_t *) malloc(sizeof(ec_export_reader_t));
+
+	if(reader == NULL) {
+		perror("malloc()");
+		munmap(memory, info.st_size);
+		return NULL;
+	}
+
+	reader->header = header;
+	reader->data = (const uint8_t *) memory + header->data_offset;
+	reader->size = info.st_size;
+
+	return reader;
+}
+
+
+void ec_export_detach(ec_export_reader_t **readerv)
+{
+	ec_export_reader_t *reader = *readerv;
+
+	if(reader) {
+		munmap((void *) reader->header, reader->size);
+		free(reader);
+	}
+	*readerv = NULL;
+}
+
+
+const ec_export_header_t *ec_export_header(const ec_export_reader_t *reader)
+{
+	return reader->header;
+}
+
+
+const ec_export_entry_t *ec_export_entry(const ec_export_reader_t *reader, int index)
+{
+	if(index < 0 || (uint32_t) index >= reader->header->entry_count)
+		return NULL;
+
+	return (const ec_export_entry_t *) (reader->header + 1) + index;
+}
+
+
+const ec_export_entry_t *ec_export_find(const ec_export_reader_t *reader, const char *name)
+{
+	for(uint32_t i = 0; i < reader->header->entry_count; i++) {
+		const ec_export_entry_t *entry = ec_export_entry(reader, i);
+
+		if(strncmp(entry->name, name, EC_EXPORT_NAME_LENGTH) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Copies length bytes at offset of the data area, and the working
+ * counter at wkc_offset unless wkc is NULL, as left by one cycle.
+ */
+static int load(const ec_export_reader_t *reader, uint32_t offset, uint32_t length, void *data,
+	uint32_t wkc_offset, uint16_t *wkc, uint64_t *cycle)
+{
+	const ec_export_header_t *header = reader->header;
+
+	for(int retry = 0; retry < EXPORT_RETRIES; retry++) {
+		if(__atomic_load_n(&header->closed, __ATOMIC_RELAXED))
+			return -1;
+
+		uint32_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+
+		if(sequence & 1)
+			continue;
+
+		memcpy(data, reader->data + offset, length);
+		if(wkc)
+			memcpy(wkc, reader->data + wkc_offset, 2);
+		uint64_t done = __atomic_load_n(&header->cycle, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if(__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == sequence) {
+			if(cycle)
+				*cycle = done;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+int ec_export_load(const ec_export_reader_t *reader, const ec_export_entry_t *entry, void *data, uint16_t *wkc,
+	uint64_t *cycle)
+{
+	return load(reader, entry->offset, entry->length, data, entry->wkc_offset, wkc, cycle);
+}
+
+
+/**
+ * Copies the whole data area, entries are found at their offsets and
+ * working counters at their wkc_offset in the copy.
+ */
+int ec_export_snapshot(const ec_export_reader_t *reader, void *data, uint64_t *cycle)
+{
+	return load(reader, 0, reader->header->data_length, data, 0, NULL, cycle);
+}
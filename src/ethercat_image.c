@@ -0,0 +1,296 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sync manager direction in control register bits 2-3
+static const uint8_t SM_DIRECTION_READ = 0x00;
+static const uint8_t SM_DIRECTION_WRITE = 0x01;
+
+
+// Configuration read from and written to one slave
+struct image_setup_t
+{
+	uint8_t sm[16];		// SM2 and SM3
+	uint8_t fmmu[32];	// FMMU0 (outputs) and FMMU1 (inputs)
+	uint8_t fmmu_read[32];	// Read back after writing them
+	uint16_t wkc;
+
+	uint16_t output_physical;
+	uint16_t input_physical;
+};
+
+
+/**
+ * Fills the outputs of the LRW from the application's output buffer.
+ */
+static void write_image(const address_t address, void *payload, uint16_t length, void *data)
+{
+	ethercat_image_t *image = (ethercat_image_t *) payload;
+	memcpy(data, image->outputs, image->output_length);
+}
+
+
+/**
+ * Copies the inputs into the back buffer and makes it the front buffer.
+ */
+static void read_image(const address_t address, void *payload, uint16_t length, const void *data)
+{
+	ethercat_image_t *image = (ethercat_image_t *) payload;
+	const uint8_t *tmp = (const uint8_t *) data;
+
+	int back = 1 - __atomic_load_n(&image->front, __ATOMIC_RELAXED);
+	memcpy(image->inputs[back], tmp + image->output_length, image->input_length);
+
+	image->wkc = tmp[length] | (tmp[length + 1] << 8);
+	__atomic_store_n(&image->front, back, __ATOMIC_RELEASE);
+}
+
+
+static void set_fmmu(uint8_t *fmmu, uint32_t logical, uint16_t length, uint16_t physical, uint8_t type)
+{
+	memset(fmmu, 0, 16);
+
+	if(length == 0)
+		return;
+
+	ec_put32(fmmu, logical);
+	ec_put16(fmmu + 4, length);
+	fmmu[6] = 0;		// Logical start bit
+	fmmu[7] = 7;		// Logical end bit
+	ec_put16(fmmu + 8, physical);
+	fmmu[10] = 0;		// Physical start bit
+	fmmu[11] = type;
+	fmmu[12] = 0x01;	// Activate
+}
+
+
+void ec_free_image(ethercat_t *ethercat)
+{
+	ethercat_image_t *image = ethercat->image;
+
+	if(image) {
+		ec_cancel(ethercat, image->exchange);
+
+		free(image->slaves);
+		free(image->outputs);
+		free(image->inputs[0]);
+		free(image->inputs[1]);
+		free(image);
+	}
+	ethercat->image = NULL;
+}
+
+
+static int image_setup(ethercat_t *ethercat, ethercat_image_t *image, image_setup_t *setup,
+	ethercat_batch_t *batch, const uint16_t *stations)
+{
+	int count = image->slave_count;
+	ec_image_slave_t *slaves = image->slaves;
+
+	// Read sync manager configuration
+	for(int i = 0; i < count; i++) {
+		address_t address;
+		address.physical.ado = stations[i];
+		address.physical.adp = reg_sm + 2 * 8;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 16, setup[i].sm, &setup[i].wkc,
+			EC_CALL_ONESHOT), &setup[i].wkc, 1);
+	}
+
+	if(ec_batch_run(ethercat, batch, "reading sync managers") == -1)
+		return -1;
+
+	// Outputs first, then inputs
+	for(int i = 0; i < count; i++) {
+		slaves[i].station = stations[i];
+
+		for(int n = 0; n < 2; n++) {
+			const uint8_t *sm = setup[i].sm + 8 * n;
+			uint16_t start = ec_get16(sm);
+			uint16_t length = ec_get16(sm + 2);
+			uint8_t direction = (sm[4] >> 2) & 0x03;
+
+			if(!(sm[6] & 0x01) || length == 0)
+				continue;
+
+			if(direction == SM_DIRECTION_WRITE && slaves[i].output_length == 0) {
+				slaves[i].output_offset = image->output_length;
+				slaves[i].output_length = length;
+				setup[i].output_physical = start;
+				image->output_length += length;
+			} else if(direction == SM_DIRECTION_READ && slaves[i].input_length == 0) {
+				slaves[i].input_offset = image->input_length;
+				slaves[i].input_length = length;
+				setup[i].input_physical = start;
+				image->input_length += length;
+			}
+		}
+
+		if(slaves[i].output_length)
+			image->expected_wkc += 2;
+		if(slaves[i].input_length)
+			image->expected_wkc += 1;
+	}
+
+	int length = image->output_length + image->input_length;
+
+	if(length == 0) {
+		fprintf(stderr, "No slave has process data.\n");
+		return -1;
+	}
+
+	if(length > ETHERCAT_MAX_PAYLOAD) {
+		fprintf(stderr, "Process image of %d bytes does not fit in a frame.\n", length);
+		return -1;
+	}
+
+	// Map process data with FMMUs and read them back
+	for(int i = 0; i < count; i++) {
+		set_fmmu(setup[i].fmmu, image->logical_address + slaves[i].output_offset,
+			slaves[i].output_length, setup[i].output_physical, FMMU_WRITE);
+		set_fmmu(setup[i].fmmu + 16, image->logical_address + image->output_length + slaves[i].input_offset,
+			slaves[i].input_length, setup[i].input_physical, FMMU_READ);
+
+		address_t address;
+		address.physical.ado = stations[i];
+		address.physical.adp = reg_fmmu;
+		ec_batch_add(ethercat, batch, ec_request_write_from(ethercat, address, 32, setup[i].fmmu, EC_CALL_ONESHOT),
+			NULL, 0);
+	}
+
+	if(ec_batch_run(ethercat, batch, "writing FMMUs") == -1)
+		return -1;
+
+	for(int i = 0; i < count; i++) {
+		address_t address;
+		address.physical.ado = stations[i];
+		address.physical.adp = reg_fmmu;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 32, setup[i].fmmu_read, &setup[i].wkc,
+			EC_CALL_ONESHOT), &setup[i].wkc, 1);
+	}
+
+	if(ec_batch_run(ethercat, batch, "configuring FMMUs") == -1)
+		return -1;
+
+	for(int i = 0; i < count; i++) {
+		if(memcmp(setup[i].fmmu, setup[i].fmmu_read, 32) != 0) {
+			fprintf(stderr, "Slave %d did not take its FMMU configuration.\n", i);
+			return -1;
+		}
+	}
+
+	image->outputs = (uint8_t *) calloc(image->output_length + 1, 1);
+	image->inputs[0] = (uint8_t *) calloc(image->input_length + 1, 1);
+	image->inputs[1] = (uint8_t *) calloc(image->input_length + 1, 1);
+
+	if(!image->outputs || !image->inputs[0] || !image->inputs[1]) {
+		perror("calloc()");
+		return -1;
+	}
+
+	address_t address;
+	address.logical = image->logical_address;
+	image->exchange = ec_request_read_write(ethercat, address, length, write_image, read_image, image,
+		EC_CALL_PERIODIC | EC_ADDR_LG);
+
+	return (image->exchange == -1)?-1:0;
+}
+
+
+/**
+ * Reads the SM2/SM3 configuration of every slave, lays out all outputs
+ * followed by all inputs from logical_address on and maps them with
+ * FMMU0 (outputs) and FMMU1 (inputs). All process data is then exchanged
+ * with a single periodic LRW.
+ *
+ * Blocks for a few cycles, must be called before starting the cyclic
+ * executor while slaves are in PreOp.
+ */
+int ec_image_configure(ethercat_t *ethercat, const uint16_t *stations, int count, uint32_t logical_address)
+{
+	if(ethercat->image) {
+		fprintf(stderr, "Process image is already configured.\n");
+		return -1;
+	}
+
+	if(count <= 0) {
+		fprintf(stderr, "Invalid number of slaves (%d).\n", count);
+		return -1;
+	}
+
+	image_setup_t *setup = (image_setup_t *) calloc(count, sizeof(image_setup_t));
+	ethercat_image_t *image = (ethercat_image_t *) calloc(1, sizeof(ethercat_image_t));
+	ec_image_slave_t *slaves = (ec_image_slave_t *) calloc(count, sizeof(ec_image_slave_t));
+
+	if(setup == NULL || image == NULL || slaves == NULL) {
+		perror("calloc()");
+		free(setup);
+		free(image);
+		free(slaves);
+		return -1;
+	}
+
+	ethercat->image = image;
+	image->slaves = slaves;
+	image->slave_count = count;
+	image->logical_address = logical_address;
+	image->exchange = -1;
+
+	ethercat_batch_t batch;
+	ec_batch_init(&batch);
+
+	int result = image_setup(ethercat, image, setup, &batch, stations);
+	ec_batch_free(ethercat, &batch);
+	free(setup);
+
+	if(result == -1)
+		ec_free_image(ethercat);
+
+	return result;
+}
+
+
+int ec_image_slave(const ethercat_t *ethercat, int slave, ec_image_slave_t *info)
+{
+	const ethercat_image_t *image = ethercat->image;
+
+	if(image == NULL || slave < 0 || slave >= image->slave_count)
+		return -1;
+
+	*info = image->slaves[slave];
+	return 0;
+}
+
+
+uint8_t *ec_image_outputs(ethercat_t *ethercat)
+{
+	return ethercat->image?ethercat->image->outputs:NULL;
+}
+
+
+/**
+ * Inputs of the last exchange. The buffer stays valid until the next
+ * exchange completes, fetch it again every cycle.
+ */
+const uint8_t *ec_image_inputs(const ethercat_t *ethercat)
+{
+	const ethercat_image_t *image = ethercat->image;
+
+	if(image == NULL)
+		return NULL;
+
+	return image->inputs[__atomic_load_n(&image->front, __ATOMIC_ACQUIRE)];
+}
+
+
+uint16_t ec_image_working_counter(const ethercat_t *ethercat, uint16_t *expected)
+{
+	const ethercat_image_t *image = ethercat->image;
+
+	if(expected)
+		*expected = image?image->expected_wkc:0;
+
+	return image?image->wkc:0;
+}
@@ -2,10 +2,28 @@
 #define __ETHERCAT_INTERNAL_H__
 
 #include "ethercat.h"
+#include "ethercat_export.h"
+#include "ethercat_transport.h"
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 
 static const uint16_t ETHERCAT_TYPE = 0x88A4;
 
+// Frame buffers are allocated on cache line boundaries
+static const int ETHERCAT_ALIGNMENT = 64;
+static const int ETHERCAT_MAX_FRAME = 1514;
+
+// Largest payload that fits a frame with a single datagram
+static const int ETHERCAT_MAX_PAYLOAD = ETHERCAT_MAX_FRAME - 14 - 2 - 12;
+
+// Frames of a cycle, responses are matched by an 8 bit datagram index
+// and at this size the frames sent in one round never share an index
+// with those of the round before
+static const int ETHERCAT_MAX_FRAMES = 128;
+
 
 enum payload_type_t
 {
@@ -32,9 +50,47 @@ enum command_type_t
   cmd_lgcl_w,
   cmd_lgcl_rw,
 
-  cmd_cadr_rmwr
+  // Read by the addressed slave, written by all others
+  cmd_ainc_rmw,
+  cmd_cadr_rmw
+};
+
+
+enum esc_register_t
+{
+  reg_type = 0x0000,
+  reg_revision = 0x0001,
+  reg_build = 0x0002,
+  reg_fmmu_count = 0x0004,
+  reg_sm_count = 0x0005,
+  reg_ram_size = 0x0006,
+  reg_port_descriptor = 0x0007,
+  reg_features = 0x0008,
+  reg_station_address = 0x0010,
+  reg_dl_status = 0x0110,
+  reg_al_control = 0x0120,
+  reg_al_status = 0x0130,
+  reg_al_status_code = 0x0134,
+  reg_fmmu = 0x0600,
+  reg_sm = 0x0800,
+  reg_dc_receive_time = 0x0900,
+  reg_dc_system_time = 0x0910,
+  reg_dc_receive_time_unit = 0x0918,
+  reg_dc_system_offset = 0x0920,
+  reg_dc_system_delay = 0x0928,
+  reg_dc_system_difference = 0x092C
 };
 
+// DL status bits 9, 11, 13 and 15: communication established on port 0-3
+static const uint16_t DL_STATUS_COMMUNICATION = 0x0200;
+
+// FMMU types
+static const uint8_t FMMU_READ = 0x01;
+static const uint8_t FMMU_WRITE = 0x02;
+
+// Sync manager status, mailbox full
+static const uint8_t SM_STATUS_FULL = 0x08;
+
 
 struct ethercat_header_t
 {
@@ -79,34 +135,655 @@ static const char *command_description[] = {
   "Logical memory read",
   "Logical memory write",
   "Logical memory read/write",
+  "Auto increment read/multiple write",
   "Configured address read/multiple write",
-  "Unrecognized (0xE)",
   "Unrecognized (0xF)"
 };
 
 
+static const int ETHERCAT_DEFAULT_OPERATIONS = 256;
+static const int ETHERCAT_DEFAULT_TIMEOUT_US = 1000;
+static const int ETHERCAT_DEFAULT_RETRIES = 0;
+static const int ETHERCAT_SDO_TIMEOUT_MS = 2000;
+
+// Reads are merged only when they overlap or touch, bytes in a gap
+// would be read along and some registers (AL status 0x0130, SYNC status
+// 0x098E, latch times) clear events when they are read
+static const int ETHERCAT_DEFAULT_MERGE_GAP = 0;
+
+// Only registers are merged, memory above may be sync managers
+static const int ETHERCAT_MERGE_LIMIT = 0x1000;
+
+
+/**
+ * Cold part of an operation, only touched when the
+ * operation is dispatched or the frame is compiled.
+ */
 struct ethercat_operation_t
 {
-	command_type_t command;
-	address_t address;
-	uint16_t length;
-	int flags;
-
 	ec_read_callback_t *read_callback;
 	ec_write_callback_t *write_callback;
 	void *payload;
 
-	ethercat_operation_t *prev;
-	ethercat_operation_t *next;
+	// Plain copies from and to the application instead of callbacks,
+	// possibly into a map shared with other threads
+	void *read_data;
+	uint16_t *read_wkc;
+	const void *write_data;
+	ec_map_t *map;
+
+	// Frame and offset of payload in compiled frame
+	int frame;
+	int offset;
+
+	// Offset of the datagram carrying the payload, which is shared
+	// when neighbouring operations have been merged
+	int datagram;
+
+	// Merged operations are placed with their first one in table
+	// order, which holds the register range of the whole datagram
+	int leader;
+	int next_merged;
+	uint16_t merged_adp;
+	uint16_t merged_length;
+
+	// Part of the frames of the current cycle. Operations with a divisor
+	// keep their datagram outside their phase, idle turns it into a NOP.
+	bool scheduled;
+	bool idle;
+
+	// Counted once in operations_deferred when it first had to wait
+	bool deferred;
+
+	// Order of requests, low priority one-shots are sent oldest first
+	uint64_t sequence;
+
+	bool paused;
+
+	// Incremented whenever the slot is freed, invalidating handles
+	uint32_t generation;
+
+	// Changes made through the handle, applied at the next cycle. Slots
+	// stay queued until then, even when freed in the meantime.
+	int changes;
+	bool queued;
+	int next_change;
+
+	address_t new_address;
+	uint16_t new_length;
+	ec_read_callback_t *new_read_callback;
+	ec_write_callback_t *new_write_callback;
+	void *new_payload;
+
+	// Next slot on free-list
+	int next_free;
+};
+
+enum operation_change_t
+{
+	change_cancel = 0x01,
+	change_pause = 0x02,
+	change_resume = 0x04,
+	change_layout = 0x08,	// Address and length
+	change_callbacks = 0x10
+};
+
+
+/**
+ * Preallocated operation table. Fields used while scanning
+ * are stored in separate arrays, slots that are not in use
+ * have their command set to cmd_noop.
+ */
+struct ethercat_operations_t
+{
+	int capacity;
+	int limit;	// One past the highest slot in use
+	int free;	// First free slot or -1
+
+	uint8_t *command;
+	address_t *address;
+	uint16_t *length;
+	int *flags;
+
+	ethercat_operation_t *info;
+
+	// Scratch space for sorting operations while merging
+	int *order;
+
+	// Scheduled operations with a divisor, switched between their
+	// command and NOP every cycle without compiling the frames
+	int *rated;
+	int rated_count;
+};
+
+/**
+ * Frame template and receive buffer, the operation table is
+ * spread over as many frames as needed to stay within the MTU.
+ */
+struct ethercat_frame_t
+{
+	int length;
+	int received;
+
+	// Datagram index used to match the response
+	uint8_t index;
+
+	// Operations in this frame changed, only this frame is rebuilt
+	bool dirty;
+
+	uint8_t *tx;
+	bool shared;	// tx is a buffer of the transport, sent without a copy
+
+	// Response, either rx_buffer or a slot in the receive ring
+	uint8_t *rx;
+	uint8_t *rx_buffer;
+};
+
+// Process image set up by ec_image_configure
+struct ethercat_image_t
+{
+	uint32_t logical_address;
+	int output_length;
+	int input_length;
+
+	int slave_count;
+	ec_image_slave_t *slaves;
+
+	// Written by the application, copied into the frame when sent
+	uint8_t *outputs;
+
+	// Inputs are received into one buffer while the other one is read
+	uint8_t *inputs[2];
+	int front;	// Accessed atomically
+
+	uint16_t wkc;
+	uint16_t expected_wkc;
+
+	ec_handle_t exchange;	// Periodic LRW of the image
+};
+
+void ec_free_image(ethercat_t *ethercat);
+
+// Entries and shared memory segment of ec_export_publish
+struct ethercat_export_t
+{
+	// Descriptors as published and the request flags of registers
+	ec_export_entry_t *entries;
+	int *flags;
+	int entry_count;
+	int entry_capacity;
+
+	// Segment, NULL until published
+	char *name;
+	ec_export_header_t *header;
+	uint8_t *data;
+	size_t size;
+
+	// Registers are read into a private copy of the data area, with
+	// the handle of each entry's read (-1 for image ranges)
+	uint8_t *staging;
+	ec_handle_t *reads;
+	int data_length;
+};
+
+void ec_free_export(ethercat_t *ethercat);
+void ec_publish_export(ethercat_t *ethercat, bool complete);
+
+// Queued SDO transfer
+struct ethercat_sdo_t
+{
+	bool upload;
+	uint16_t index;
+	uint8_t subindex;
+
+	uint8_t *data;
+	int length;
+	int offset;	// Bytes transferred so far
+	uint8_t toggle;
+
+	int64_t deadline_ns;
+
+	ec_sdo_callback_t *callback;
+	void *arg;
+
+	ethercat_sdo_t *next;
+};
+
+enum mailbox_state_t
+{
+	mbx_idle,
+	mbx_send,	// Request is written this cycle
+	mbx_poll,	// Waiting for mailbox in to fill up
+	mbx_fetch	// Mailbox in is read this cycle
+};
+
+struct ethercat_mailbox_slave_t
+{
+	uint16_t station;
+
+	uint16_t out_address;
+	uint16_t out_length;
+	uint16_t in_address;
+	uint16_t in_length;
+
+	mailbox_state_t state;
+	uint8_t counter;
+
+	uint8_t *out;
+	uint8_t *in;
+
+	// Filled in by the read callbacks, evaluated at the next cycle,
+	// status holds the mailbox full bit from the status area
+	uint8_t status;
+	uint16_t in_wkc;
+
+	// One-shots of the transfer, they stay queued when their frame was lost
+	ec_handle_t write;
+	ec_handle_t fetch;
+
+	ethercat_sdo_t *head;
+	ethercat_sdo_t *tail;
+};
+
+// SDO engine set up by ec_mailbox_configure
+struct ethercat_mailbox_t
+{
+	int slave_count;
+	ethercat_mailbox_slave_t *slaves;
+
+	// Logical area with one mailbox full bit per slave
+	uint32_t status_address;
+	uint16_t status_wkc;
+	ec_handle_t status;	// LRD of the status area, only one is queued
+};
+
+void ec_mailbox_cycle(ethercat_t *ethercat);
+void ec_free_mailbox(ethercat_t *ethercat);
+
+// Distributed clocks set up by ec_dc_configure
+struct ethercat_dc_t
+{
+	int slave_count;
+	ec_dc_slave_t *slaves;
+	int reference;	// Position of the reference clock
+
+	// Written by the ARMW read callback
+	uint64_t reference_time;
+	uint16_t wkc;
+
+	// Locking the cyclic executor to the reference clock
+	bool lock;
+	bool phase_valid;
+	int64_t phase_ns;
+	int64_t integral_ns;
+};
+
+int64_t ec_dc_cycle_correction(ethercat_t *ethercat, int64_t period_ns);
+void ec_free_dc(ethercat_t *ethercat);
+
+void ec_submit_cycle(ethercat_t *ethercat);
+void ec_free_submissions(ethercat_t *ethercat);
+
+int ec_find_operation(const ethercat_t *ethercat, ec_handle_t handle);
+
+// Cycles a blocking setup step waits for its one-shots
+static const int ETHERCAT_BATCH_CYCLES = 3;
+
+struct ethercat_batch_entry_t
+{
+	ec_handle_t handle;
+	uint16_t ado;
+
+	// Working counter stored by the one-shot, checked unless NULL
+	const uint16_t *wkc;
+	uint16_t expected;
+};
+
+/**
+ * One-shots of a blocking setup step. Their payloads usually live on
+ * the stack or in memory freed after the step, so the ones still
+ * queued when the step gives up are cancelled.
+ */
+struct ethercat_batch_t
+{
+	ethercat_batch_entry_t *entries;
+	int count;
+	int capacity;
+	bool failed;	// A request could not be queued
+};
+
+void ec_batch_init(ethercat_batch_t *batch);
+void ec_batch_add(ethercat_t *ethercat, ethercat_batch_t *batch, ec_handle_t handle, const uint16_t *wkc,
+	uint16_t expected);
+int ec_batch_run(ethercat_t *ethercat, ethercat_batch_t *batch, const char *step);
+void ec_batch_cancel(ethercat_t *ethercat, ethercat_batch_t *batch);
+void ec_batch_free(ethercat_t *ethercat, ethercat_batch_t *batch);
+
+void ec_begin_maps(ethercat_t *ethercat);
+void ec_end_maps(ethercat_t *ethercat);
+void ec_unbind_map(ethercat_t *ethercat, int index);
+
+// Frame capture started by ec_capture_start
+struct ethercat_capture_t
+{
+	// Records written by the cycling thread, old ones are overwritten
+	uint8_t *ring;
+	uint64_t size;		// A power of two
+	uint64_t head;		// End of the complete records, accessed atomically
+	uint64_t reserve;	// End of the record being written, accessed atomically
+
+	pthread_t thread;
+	bool running;	// Accessed atomically, cleared to stop the thread
+
+	// Flush thread: streamed up to written, dumps start at oldest
+	FILE *file;
+	uint64_t written;
+	uint64_t oldest;
+	uint64_t overruns;
+	int64_t realtime_offset_ns;
+
+	// Requested by ec_capture_dump, the state is accessed atomically
+	int dump;
+	char dump_path[PATH_MAX];
+	int64_t dump_from_ns;
+
+	char *error_path;
+	int error_seconds;
+};
+
+void ec_capture_sent(ethercat_capture_t *capture, const uint8_t *frame, int length);
+void ec_capture_received(ethercat_capture_t *capture, const uint8_t *frame, int length);
+void ec_capture_error(ethercat_t *ethercat);
+
+// Columns and block buffers of the telemetry recorder
+struct ethercat_recorder_t
+{
+	// Built-in columns first, they have no source in a map
+	ec_record_column_t *columns;
+	const uint8_t **sources;
+	int column_count;
+	int column_capacity;
+
+	int block_samples;
+	uint64_t block_size;
+	uint64_t data_offset;
+
+	// Blocks are filled by the cycling thread in turn and written by
+	// the writer thread in the same order, their states are accessed atomically
+	uint8_t **blocks;
+	int *states;
+	int block_count;
+	int fill;
+	int flush;
+	uint64_t dropped;
+
+	// Writer thread
+	pthread_t thread;
+	bool running;	// Accessed atomically, cleared to stop the thread
+	int fd;
+	bool failed;
+
+	// Time ranges of the blocks written
+	ec_record_index_t *index;
+	int index_count;
+	int index_capacity;
+};
+
+void ec_record_cycle(ethercat_t *ethercat, int64_t start_ns, bool complete);
+
+// Cyclic executor started by ec_run_cyclic
+struct ethercat_cyclic_t
+{
+	pthread_t thread;
+	bool running;	// Accessed atomically, cleared to stop the thread
+
+	int64_t period_ns;
+	ec_cycle_hook_t *hook;
+	void *arg;
+
+	int cpu;
+	int priority;
+	int spin_us;
 };
 
 struct ethercat_t
 {
-	int socket;
+	ethercat_transport_t transport;
+
+	ethercat_operations_t operations;
+
+	// Compiled frames, only rebuilt when the set of operations changes
+	bool layout_dirty;
+	bool frames_dirty;
+	int frame_count;
+	int frame_capacity;
+
+	ethercat_frame_t *frames;
+
+	// Receive buffer that is swapped with a frame once matched
+	uint8_t *spare_rx;
+	uint8_t next_index;
 
-	ethercat_operation_t *operations;
+	int timeout_us;
+	int retries;
+	int merge_gap;
+
+	// Scheduling of rate divided and low priority operations
+	int cycle_budget;
+	int deferred;
+	uint64_t next_sequence;
+
+	// First operation with changes to apply at the next cycle or -1
+	int changes;
+
+	ec_counters_t counters;
+
+	ethercat_cyclic_t cyclic;
+
+	ethercat_image_t *image;
+	ethercat_mailbox_t *mailbox;
+	ethercat_dc_t *dc;
+
+	// Submissions pushed by any thread, newest first, and the ones
+	// taken over by the cycling thread that did not fit in the table
+	ec_submission_t *submissions;
+	ec_submission_t *backlog;
+	ec_submission_t *backlog_tail;
+
+	// Read maps with requests, their sequence is bumped around decoding
+	ec_map_t *maps;
+
+	// Exported to shared memory at the end of every cycle
+	ethercat_export_t *exports;
+
+	// Copies of all frames sent and received
+	ethercat_capture_t *capture;
+
+	// Values of mapped variables recorded every cycle
+	ethercat_recorder_t *recorder;
+
+#ifdef EC_ENABLE_STATS
+	// Only written by the cycling thread, read with relaxed atomics
+	ec_stats_t stats;
+	bool stats_reset;
+#endif
 };
 
 
+// Divisor and phase of EC_CALL_EVERY, a divisor below 2 runs every cycle
+static inline int ec_call_divisor(int flags)
+{
+	return (flags >> 8) & 0xFF;
+}
+
+
+static inline int ec_call_phase(int flags)
+{
+	return (flags >> 16) & 0xFF;
+}
+
+
+// Divisor and phase of periodic operations not running every cycle, else 0
+static inline int ec_call_rate(int flags)
+{
+	return ((flags & EC_CALL_PERIODIC) && ec_call_divisor(flags) > 1)?((flags >> 8) & 0xFFFF):0;
+}
+
+
+static inline bool ec_call_due(int flags, uint64_t cycle)
+{
+	int divisor = ec_call_divisor(flags);
+	return !(flags & EC_CALL_PERIODIC) || divisor < 2 || (int) (cycle % divisor) == ec_call_phase(flags);
+}
+
+
+static inline int64_t ec_monotonic_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// Little endian values in frames and ESC registers
+static inline uint16_t ec_get16(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8);
+}
+
+
+static inline uint32_t ec_get32(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+
+static inline uint64_t ec_get64(const uint8_t *ptr)
+{
+	return ec_get32(ptr) | ((uint64_t) ec_get32(ptr + 4) << 32);
+}
+
+
+static inline void ec_put16(uint8_t *ptr, uint16_t value)
+{
+	ptr[0] = value & 0xFF;
+	ptr[1] = value >> 8;
+}
+
+
+static inline void ec_put32(uint8_t *ptr, uint32_t value)
+{
+	for(int i = 0; i < 4; i++)
+		ptr[i] = (value >> (8 * i)) & 0xFF;
+}
+
+
+static inline void ec_put64(uint8_t *ptr, uint64_t value)
+{
+	for(int i = 0; i < 8; i++)
+		ptr[i] = (value >> (8 * i)) & 0xFF;
+}
+
+
+
+/**
+ * Statements that only exist when built with EC_ENABLE_STATS.
+ */
+#ifdef EC_ENABLE_STATS
+#define EC_STATS(statement) statement
+#else
+#define EC_STATS(statement)
+#endif
+
+#ifdef EC_ENABLE_STATS
+
+/**
+ * Phases are timed with the TSC where available, reading it is several
+ * times cheaper than clock_gettime. Ticks are converted with a scale
+ * calibrated against CLOCK_MONOTONIC when the first master is created.
+ */
+#if defined(__x86_64__)
+#include <x86intrin.h>
+
+extern uint64_t ec_tsc_scale;	// Nanoseconds per tick, 32.32 fixed point
+
+static inline int64_t ec_stats_clock()
+{
+	return __rdtsc();
+}
+
+static inline int64_t ec_stats_ns(int64_t ticks)
+{
+	return (int64_t) (((unsigned __int128) ticks * ec_tsc_scale) >> 32);
+}
+#else
+static inline int64_t ec_stats_clock()
+{
+	return ec_monotonic_ns();
+}
+
+static inline int64_t ec_stats_ns(int64_t ticks)
+{
+	return ticks;
+}
 #endif
 
+void ec_calibrate_stats_clock();
+
+
+static inline int ec_stat_bucket(uint64_t value)
+{
+	if(value < 16)
+		return value;
+	if(value > 0xFFFFFFFF)
+		value = 0xFFFFFFFF;
+
+	int exponent = 63 - __builtin_clzll(value);
+	return (exponent - 3) * 16 + ((value >> (exponent - 4)) & 0x0F);
+}
+
+
+/**
+ * Single writer update, readers on other threads see each field
+ * atomically but not necessarily a consistent set of fields.
+ */
+static inline void ec_record_stat(ethercat_t *ethercat, int phase, int64_t ns)
+{
+	ec_histogram_t *histogram = &ethercat->stats.phase[phase];
+	uint64_t value = (ns < 0)?0:ns;
+	uint64_t *bucket = &histogram->buckets[ec_stat_bucket(value)];
+	uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+
+	__atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->sum_ns, __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+
+	if(count == 0 || value < __atomic_load_n(&histogram->min_ns, __ATOMIC_RELAXED))
+		__atomic_store_n(&histogram->min_ns, value, __ATOMIC_RELAXED);
+	if(value > __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED))
+		__atomic_store_n(&histogram->max_ns, value, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&histogram->count, count + 1, __ATOMIC_RELAXED);
+}
+
+
+// Applies a reset requested by ec_reset_stats, called by the cycling thread
+static inline void ec_apply_stats_reset(ethercat_t *ethercat)
+{
+	if(__atomic_load_n(&ethercat->stats_reset, __ATOMIC_RELAXED) &&
+	   __atomic_exchange_n(&ethercat->stats_reset, false, __ATOMIC_ACQUIRE)) {
+		for(int p = 0; p < EC_STAT_COUNT; p++) {
+			ec_histogram_t *histogram = &ethercat->stats.phase[p];
+
+			__atomic_store_n(&histogram->count, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&histogram->sum_ns, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&histogram->min_ns, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&histogram->max_ns, 0, __ATOMIC_RELAXED);
+			for(int b = 0; b < EC_STAT_BUCKETS; b++)
+				__atomic_store_n(&histogram->buckets[b], 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+#endif
+
+#endif
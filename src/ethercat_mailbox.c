@@ -0,0 +1,728 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mailbox header is followed by the CoE header and the SDO command
+static const int MAILBOX_HEADER = 6;
+static const int SDO_HEADER = 6 + 2 + 8;	// Up to data of an initiate request
+static const int SEGMENT_HEADER = 6 + 2 + 1;	// Up to data of a segment
+
+static const uint8_t MAILBOX_TYPE_ERROR = 0x00;
+static const uint8_t MAILBOX_TYPE_COE = 0x03;
+
+static const uint8_t COE_SDO_REQUEST = 0x02;
+static const uint8_t COE_SDO_RESPONSE = 0x03;
+
+// FMMU mapping the mailbox full bit, FMMU0/1 are used by the process image
+static const int STATUS_FMMU = 2;
+
+static const uint32_t SDO_ABORT_TIMEOUT = 0x05040000;
+static const uint32_t SDO_ABORT_COMMAND = 0x05040001;
+static const uint32_t SDO_ABORT_MEMORY = 0x05040005;
+static const uint32_t SDO_ABORT_GENERAL = 0x08000000;
+
+
+/********************
+ * Datagram callbacks
+ */
+
+static void write_mailbox_out(const address_t address, void *payload, uint16_t length, void *data)
+{
+	memcpy(data, ((ethercat_mailbox_slave_t *) payload)->out, length);
+}
+
+
+static void read_mailbox_in(const address_t address, void *payload, uint16_t length, const void *data)
+{
+	ethercat_mailbox_slave_t *slave = (ethercat_mailbox_slave_t *) payload;
+	const uint8_t *tmp = (const uint8_t *) data;
+
+	memcpy(slave->in, data, length);
+	slave->in_wkc = tmp[length] | (tmp[length + 1] << 8);
+}
+
+
+static void queue_write(ethercat_t *ethercat, ethercat_mailbox_slave_t *slave)
+{
+	address_t address;
+	address.physical.ado = slave->station;
+	address.physical.adp = slave->out_address;
+	slave->write = ec_request_write(ethercat, address, slave->out_length, write_mailbox_out, slave, EC_CALL_ONESHOT);
+}
+
+
+/**
+ * Distributes the mailbox full bits of the logical status area.
+ */
+static void read_mailbox_status(const address_t address, void *payload, uint16_t length, const void *data)
+{
+	ethercat_mailbox_t *mailbox = (ethercat_mailbox_t *) payload;
+	const uint8_t *tmp = (const uint8_t *) data;
+
+	for(int i = 0; i < mailbox->slave_count; i++) {
+		bool full = (tmp[i >> 3] >> (i & 0x07)) & 0x01;
+		mailbox->slaves[i].status = full?SM_STATUS_FULL:0x00;
+	}
+
+	mailbox->status_wkc = tmp[length] | (tmp[length + 1] << 8);
+}
+
+
+static void queue_status(ethercat_t *ethercat, ethercat_mailbox_t *mailbox)
+{
+	address_t address;
+	address.logical = mailbox->status_address;
+	mailbox->status = ec_request_read(ethercat, address, (mailbox->slave_count + 7) / 8, read_mailbox_status,
+		mailbox, EC_CALL_ONESHOT | EC_ADDR_LG);
+}
+
+
+static void queue_fetch(ethercat_t *ethercat, ethercat_mailbox_slave_t *slave)
+{
+	address_t address;
+	address.physical.ado = slave->station;
+	address.physical.adp = slave->in_address;
+
+	slave->in_wkc = 0;
+	slave->fetch = ec_request_read(ethercat, address, slave->in_length, read_mailbox_in, slave, EC_CALL_ONESHOT);
+}
+
+
+/********************
+ * SDO messages
+ */
+
+/**
+ * Writes mailbox and CoE headers in front of an SDO message with
+ * the given number of bytes following the CoE header.
+ */
+static void sdo_header(ethercat_mailbox_slave_t *slave, int length, uint8_t service)
+{
+	uint8_t *out = slave->out;
+
+	memset(out, 0, slave->out_length);
+	slave->counter = (slave->counter % 7) + 1;
+
+	ec_put16(out + 0, 2 + length);
+	ec_put16(out + 2, 0x0000);
+	out[4] = 0x00;
+	out[5] = MAILBOX_TYPE_COE | (slave->counter << 4);
+	ec_put16(out + 6, service << 12);
+}
+
+
+static void sdo_initiate(ethercat_mailbox_slave_t *slave, ethercat_sdo_t *sdo)
+{
+	uint8_t *out = slave->out;
+
+	sdo->offset = 0;
+	sdo->toggle = 0x00;
+
+	if(sdo->upload) {
+		sdo_header(slave, 8, COE_SDO_REQUEST);
+		out[8] = 0x40;
+	} else if(sdo->length <= 4) {
+		// Expedited, data in the request itself
+		sdo_header(slave, 8, COE_SDO_REQUEST);
+		out[8] = 0x23 | ((4 - sdo->length) << 2);
+		memcpy(out + 12, sdo->data, sdo->length);
+		sdo->offset = sdo->length;
+	} else {
+		int bytes = slave->out_length - SDO_HEADER;
+		if(bytes > sdo->length)
+			bytes = sdo->length;
+
+		sdo_header(slave, 8 + bytes, COE_SDO_REQUEST);
+		out[8] = 0x21;
+		ec_put32(out + 12, sdo->length);
+		memcpy(out + 16, sdo->data, bytes);
+		sdo->offset = bytes;
+	}
+
+	ec_put16(out + 9, sdo->index);
+	out[11] = sdo->subindex;
+}
+
+
+static void sdo_segment(ethercat_mailbox_slave_t *slave, ethercat_sdo_t *sdo)
+{
+	uint8_t *out = slave->out;
+
+	if(sdo->upload) {
+		sdo_header(slave, 8, COE_SDO_REQUEST);
+		out[8] = 0x60 | sdo->toggle;
+		return;
+	}
+
+	int bytes = slave->out_length - SEGMENT_HEADER;
+	if(bytes > sdo->length - sdo->offset)
+		bytes = sdo->length - sdo->offset;
+
+	bool last = (sdo->offset + bytes == sdo->length);
+	int unused = (bytes < 7)?(7 - bytes):0;
+
+	sdo_header(slave, 1 + bytes + unused, COE_SDO_REQUEST);
+	out[8] = sdo->toggle | (unused << 1) | (last?0x01:0x00);
+	memcpy(out + 9, sdo->data + sdo->offset, bytes);
+	sdo->offset += bytes;
+}
+
+
+static int sdo_store(ethercat_sdo_t *sdo, const uint8_t *data, int bytes)
+{
+	if(sdo->offset + bytes > sdo->length) {
+		uint8_t *buffer = (uint8_t *) realloc(sdo->data, sdo->offset + bytes);
+		if(buffer == NULL)
+			return -1;
+		sdo->data = buffer;
+		sdo->length = sdo->offset + bytes;
+	}
+
+	memcpy(sdo->data + sdo->offset, data, bytes);
+	sdo->offset += bytes;
+	return 0;
+}
+
+
+static void sdo_complete(ethercat_mailbox_slave_t *slave, uint32_t abort_code)
+{
+	ethercat_sdo_t *sdo = slave->head;
+
+	slave->head = sdo->next;
+	if(slave->head == NULL)
+		slave->tail = NULL;
+	slave->state = mbx_idle;
+
+	if(sdo->callback) {
+		ec_sdo_result_t result;
+		result.station = slave->station;
+		result.index = sdo->index;
+		result.subindex = sdo->subindex;
+		result.abort_code = abort_code;
+		result.data = (sdo->upload && abort_code == 0)?sdo->data:NULL;
+		result.length = (sdo->upload && abort_code == 0)?sdo->offset:0;
+
+		sdo->callback(&result, sdo->arg);
+	}
+
+	free(sdo->data);
+	free(sdo);
+}
+
+
+/**
+ * Handles a message read from mailbox in. Returns false when it is
+ * not a response to the current transfer and polling has to continue.
+ */
+static bool sdo_response(ethercat_mailbox_slave_t *slave, ethercat_sdo_t *sdo)
+{
+	const uint8_t *in = slave->in;
+	uint16_t length = ec_get16(in);
+	uint8_t type = in[5] & 0x0F;
+
+	if(length + MAILBOX_HEADER > slave->in_length)
+		return false;
+
+	if(type == MAILBOX_TYPE_ERROR) {
+		sdo_complete(slave, SDO_ABORT_GENERAL);
+		return true;
+	}
+
+	uint8_t service = in[7] >> 4;
+
+	if(type != MAILBOX_TYPE_COE || length < 10)
+		return false;
+
+	uint8_t command = in[8];
+	uint16_t index = ec_get16(in + 9);
+	uint8_t subindex = in[11];
+
+	if(service == COE_SDO_REQUEST && command == 0x80) {
+		if(index == sdo->index && subindex == sdo->subindex)
+			sdo_complete(slave, ec_get32(in + 12));
+		else if(sdo->offset > 0)
+			sdo_complete(slave, ec_get32(in + 12));	// Segments carry no index
+		else
+			return false;
+		return true;
+	}
+
+	if(service != COE_SDO_RESPONSE)
+		return false;
+
+	switch(command >> 5) {
+		case 0x03:	// Initiate download response
+			if(sdo->upload || index != sdo->index || subindex != sdo->subindex)
+				return false;
+			break;
+
+		case 0x01:	// Download segment response
+			if(sdo->upload || (command & 0x10) != sdo->toggle)
+				return false;
+			sdo->toggle ^= 0x10;
+			break;
+
+		case 0x02: {	// Initiate upload response
+			if(!sdo->upload || index != sdo->index || subindex != sdo->subindex)
+				return false;
+
+			if(command & 0x02) {
+				int size = (command & 0x01)?(4 - ((command >> 2) & 0x03)):4;
+				if(sdo_store(sdo, in + 12, size) == -1) {
+					sdo_complete(slave, SDO_ABORT_MEMORY);
+					return true;
+				}
+				sdo_complete(slave, 0);
+				return true;
+			}
+
+			uint32_t size = ec_get32(in + 12);
+			int bytes = length - 10;
+			if(bytes > (int) size)
+				bytes = size;
+
+			free(sdo->data);
+			sdo->data = (uint8_t *) malloc(size + 1);
+			sdo->length = size;
+
+			if(sdo->data == NULL || sdo_store(sdo, in + 16, bytes) == -1) {
+				sdo_complete(slave, SDO_ABORT_MEMORY);
+				return true;
+			}
+
+			if(sdo->offset >= sdo->length) {
+				sdo_complete(slave, 0);
+				return true;
+			}
+			break;
+		}
+
+		case 0x00: {	// Upload segment response
+			if(!sdo->upload || (command & 0x10) != sdo->toggle)
+				return false;
+
+			int bytes = length - 3;
+			if(bytes == 7)
+				bytes -= (command >> 1) & 0x07;
+
+			if(sdo_store(sdo, in + 9, bytes) == -1) {
+				sdo_complete(slave, SDO_ABORT_MEMORY);
+				return true;
+			}
+
+			sdo->toggle ^= 0x10;
+
+			if(command & 0x01) {
+				sdo_complete(slave, 0);
+				return true;
+			}
+			break;
+		}
+
+		default:
+			sdo_complete(slave, SDO_ABORT_COMMAND);
+			return true;
+	}
+
+	// Downloads are done once all data was acknowledged
+	if(!sdo->upload && sdo->offset >= sdo->length) {
+		sdo_complete(slave, 0);
+		return true;
+	}
+
+	sdo_segment(slave, sdo);
+	slave->state = mbx_send;
+	return true;
+}
+
+
+/**
+ * Advances the transfer of one slave by one step and queues the
+ * datagram it needs in this cycle. Returns true while the slave
+ * waits for mailbox in to fill up.
+ */
+static bool mailbox_slave_cycle(ethercat_t *ethercat, ethercat_mailbox_slave_t *slave, int64_t now)
+{
+	// Bounded, a completed transfer may start the next one
+	for(int step = 0; step < 2 && slave->head; step++) {
+		ethercat_sdo_t *sdo = slave->head;
+
+		if(slave->state == mbx_idle) {
+			sdo->deadline_ns = now + (int64_t) ETHERCAT_SDO_TIMEOUT_MS * 1000000;
+			sdo_initiate(slave, sdo);
+			slave->state = mbx_send;
+		}
+
+		if(now > sdo->deadline_ns) {
+			// A late answer must not be taken for the next transfer
+			ec_cancel(ethercat, slave->write);
+			ec_cancel(ethercat, slave->fetch);
+			sdo_complete(slave, SDO_ABORT_TIMEOUT);
+			continue;
+		}
+
+		switch(slave->state) {
+			case mbx_send:
+				queue_write(ethercat, slave);
+				slave->status = 0;
+				slave->state = mbx_poll;
+				return true;
+
+			case mbx_poll:
+				if(!(slave->status & SM_STATUS_FULL))
+					return true;
+
+				queue_fetch(ethercat, slave);
+				slave->state = mbx_fetch;
+				return false;
+
+			case mbx_fetch:
+				// The frame was lost and the fetch goes out again, it
+				// empties mailbox in, so its response must be taken
+				if(ec_find_operation(ethercat, slave->fetch) != -1)
+					return false;
+
+				// Anything but our response, keep waiting
+				if(slave->in_wkc == 0 || !sdo_response(slave, sdo)) {
+					slave->status = 0;
+					slave->state = mbx_poll;
+					return true;
+				}
+
+				if(slave->state == mbx_send)
+					continue;
+				break;
+
+			default:
+				return false;
+		}
+	}
+
+	return false;
+}
+
+
+/**
+ * Runs at the start of every cycle. The full bits of all polling slaves
+ * are read with a single LRD of the status area, which is only added
+ * while at least one slave waits for a response and the previous one
+ * is not still queued after a lost frame.
+ */
+void ec_mailbox_cycle(ethercat_t *ethercat)
+{
+	ethercat_mailbox_t *mailbox = ethercat->mailbox;
+	int64_t now = ec_monotonic_ns();
+	bool polling = false;
+
+	for(int i = 0; i < mailbox->slave_count; i++)
+		polling |= mailbox_slave_cycle(ethercat, &mailbox->slaves[i], now);
+
+	if(polling && ec_find_operation(ethercat, mailbox->status) == -1)
+		queue_status(ethercat, mailbox);
+}
+
+
+/********************
+ * Setup
+ */
+
+// Configuration read from and written to one slave
+struct mailbox_setup_t
+{
+	uint8_t sm[16];		// SM0 and SM1
+	uint8_t fmmu[16];	// FMMU2, mailbox status
+	uint8_t fmmu_read[16];	// Read back after writing it
+	uint8_t fmmu_count;
+	uint16_t wkc;
+	uint16_t count_wkc;
+};
+
+
+/**
+ * Maps the mailbox full bit of SM1 into bit n of the status area.
+ */
+static void set_status_fmmu(uint8_t *fmmu, uint32_t logical, int n)
+{
+	memset(fmmu, 0, 16);
+
+	ec_put32(fmmu, logical + n / 8);
+	ec_put16(fmmu + 4, 1);
+	fmmu[6] = n % 8;	// Logical start bit
+	fmmu[7] = n % 8;	// Logical end bit
+	ec_put16(fmmu + 8, reg_sm + 8 + 5);
+	fmmu[10] = 3;		// Physical start bit
+	fmmu[11] = FMMU_READ;
+	fmmu[12] = 0x01;	// Activate
+}
+
+
+void ec_free_mailbox(ethercat_t *ethercat)
+{
+	ethercat_mailbox_t *mailbox = ethercat->mailbox;
+
+	if(mailbox) {
+		ec_cancel(ethercat, mailbox->status);
+
+		for(int i = 0; i < mailbox->slave_count; i++) {
+			ethercat_mailbox_slave_t *slave = &mailbox->slaves[i];
+
+			ec_cancel(ethercat, slave->write);
+			ec_cancel(ethercat, slave->fetch);
+
+			while(slave->head) {
+				ethercat_sdo_t *sdo = slave->head;
+				slave->head = sdo->next;
+				free(sdo->data);
+				free(sdo);
+			}
+
+			free(slave->out);
+			free(slave->in);
+		}
+
+		free(mailbox->slaves);
+		free(mailbox);
+	}
+	ethercat->mailbox = NULL;
+}
+
+
+static int mailbox_setup(ethercat_t *ethercat, ethercat_mailbox_t *mailbox, mailbox_setup_t *setup,
+	ethercat_batch_t *batch, const uint16_t *stations)
+{
+	int count = mailbox->slave_count;
+
+	// Read mailbox sync managers and the number of FMMUs
+	for(int i = 0; i < count; i++) {
+		address_t address;
+		address.physical.ado = stations[i];
+		address.physical.adp = reg_sm;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 16, setup[i].sm, &setup[i].wkc,
+			EC_CALL_ONESHOT), &setup[i].wkc, 1);
+
+		address.physical.adp = reg_fmmu_count;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 1, &setup[i].fmmu_count,
+			&setup[i].count_wkc, EC_CALL_ONESHOT), &setup[i].count_wkc, 1);
+	}
+
+	if(ec_batch_run(ethercat, batch, "reading sync managers") == -1)
+		return -1;
+
+	for(int i = 0; i < count; i++) {
+		ethercat_mailbox_slave_t *slave = &mailbox->slaves[i];
+		const uint8_t *sm = setup[i].sm;
+
+		slave->station = stations[i];
+		slave->state = mbx_idle;
+		slave->out_address = ec_get16(sm + 0);
+		slave->out_length = ec_get16(sm + 2);
+		slave->in_address = ec_get16(sm + 8);
+		slave->in_length = ec_get16(sm + 10);
+
+		if(slave->out_length < SDO_HEADER || slave->in_length < SDO_HEADER ||
+		   slave->out_length > ETHERCAT_MAX_PAYLOAD || slave->in_length > ETHERCAT_MAX_PAYLOAD) {
+			fprintf(stderr, "Slave %04x has no usable mailbox (%d/%d bytes).\n",
+				stations[i], slave->out_length, slave->in_length);
+			return -1;
+		}
+
+		if(setup[i].fmmu_count <= STATUS_FMMU) {
+			fprintf(stderr, "Slave %04x has only %d FMMUs.\n", stations[i], setup[i].fmmu_count);
+			return -1;
+		}
+
+		slave->out = (uint8_t *) calloc(slave->out_length, 1);
+		slave->in = (uint8_t *) calloc(slave->in_length, 1);
+
+		if(slave->out == NULL || slave->in == NULL) {
+			perror("calloc()");
+			return -1;
+		}
+	}
+
+	// Map the status bits with FMMUs and read them back
+	for(int i = 0; i < count; i++) {
+		set_status_fmmu(setup[i].fmmu, mailbox->status_address, i);
+
+		address_t address;
+		address.physical.ado = stations[i];
+		address.physical.adp = reg_fmmu + 16 * STATUS_FMMU;
+		ec_batch_add(ethercat, batch, ec_request_write_from(ethercat, address, 16, setup[i].fmmu, EC_CALL_ONESHOT),
+			NULL, 0);
+	}
+
+	if(ec_batch_run(ethercat, batch, "writing FMMUs") == -1)
+		return -1;
+
+	for(int i = 0; i < count; i++) {
+		address_t address;
+		address.physical.ado = stations[i];
+		address.physical.adp = reg_fmmu + 16 * STATUS_FMMU;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 16, setup[i].fmmu_read, &setup[i].wkc,
+			EC_CALL_ONESHOT), &setup[i].wkc, 1);
+	}
+
+	if(ec_batch_run(ethercat, batch, "mapping mailbox status") == -1)
+		return -1;
+
+	for(int i = 0; i < count; i++) {
+		if(memcmp(setup[i].fmmu, setup[i].fmmu_read, 16) != 0) {
+			fprintf(stderr, "Slave %04x did not take its FMMU configuration.\n", stations[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Reads SM0 (mailbox out) and SM1 (mailbox in) of every slave and maps
+ * the mailbox full bit of slave n to bit n of the status area at
+ * status_address with FMMU2. The status area takes one bit per slave
+ * and must not overlap the process image.
+ *
+ * Blocks for a few cycles, the slaves must be in PreOp or a higher state.
+ */
+int ec_mailbox_configure(ethercat_t *ethercat, const uint16_t *stations, int count, uint32_t status_address)
+{
+	if(ethercat->mailbox) {
+		fprintf(stderr, "Mailboxes are already configured.\n");
+		return -1;
+	}
+
+	if(count <= 0 || (count + 7) / 8 > ETHERCAT_MAX_PAYLOAD) {
+		fprintf(stderr, "Invalid number of slaves (%d).\n", count);
+		return -1;
+	}
+
+	mailbox_setup_t *setup = (mailbox_setup_t *) calloc(count, sizeof(mailbox_setup_t));
+	ethercat_mailbox_t *mailbox = (ethercat_mailbox_t *) calloc(1, sizeof(ethercat_mailbox_t));
+	ethercat_mailbox_slave_t *slaves = (ethercat_mailbox_slave_t *) calloc(count, sizeof(ethercat_mailbox_slave_t));
+
+	if(setup == NULL || mailbox == NULL || slaves == NULL) {
+		perror("calloc()");
+		free(setup);
+		free(mailbox);
+		free(slaves);
+		return -1;
+	}
+
+	ethercat->mailbox = mailbox;
+	mailbox->slaves = slaves;
+	mailbox->slave_count = count;
+	mailbox->status_address = status_address;
+	mailbox->status = -1;
+
+	for(int i = 0; i < count; i++) {
+		slaves[i].write = -1;
+		slaves[i].fetch = -1;
+	}
+
+	ethercat_batch_t batch;
+	ec_batch_init(&batch);
+
+	int result = mailbox_setup(ethercat, mailbox, setup, &batch, stations);
+	ec_batch_free(ethercat, &batch);
+	free(setup);
+
+	if(result == -1)
+		ec_free_mailbox(ethercat);
+
+	return result;
+}
+
+
+/********************
+ * Requests
+ */
+
+static int ec_queue_sdo(ethercat_t *ethercat, uint16_t station, ethercat_sdo_t *sdo)
+{
+	ethercat_mailbox_t *mailbox = ethercat->mailbox;
+
+	if(mailbox == NULL) {
+		fprintf(stderr, "Mailboxes are not configured.\n");
+		return -1;
+	}
+
+	for(int i = 0; i < mailbox->slave_count; i++) {
+		ethercat_mailbox_slave_t *slave = &mailbox->slaves[i];
+
+		if(slave->station != station)
+			continue;
+
+		if(slave->tail)
+			slave->tail->next = sdo;
+		else
+			slave->head = sdo;
+		slave->tail = sdo;
+
+		return 0;
+	}
+
+	fprintf(stderr, "Slave %04x has no mailbox configured.\n", station);
+	return -1;
+}
+
+
+int ec_sdo_download(ethercat_t *ethercat, uint16_t station, uint16_t index, uint8_t subindex,
+	const void *data, int length, ec_sdo_callback_t *callback, void *arg)
+{
+	if(length <= 0) {
+		fprintf(stderr, "Invalid SDO length (%d).\n", length);
+		return -1;
+	}
+
+	ethercat_sdo_t *sdo = (ethercat_sdo_t *) calloc(1, sizeof(ethercat_sdo_t));
+
+	if(sdo == NULL || (sdo->data = (uint8_t *) malloc(length)) == NULL) {
+		perror("malloc()");
+		free(sdo);
+		return -1;
+	}
+
+	memcpy(sdo->data, data, length);
+	sdo->upload = false;
+	sdo->index = index;
+	sdo->subindex = subindex;
+	sdo->length = length;
+	sdo->callback = callback;
+	sdo->arg = arg;
+
+	if(ec_queue_sdo(ethercat, station, sdo) == -1) {
+		free(sdo->data);
+		free(sdo);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int ec_sdo_upload(ethercat_t *ethercat, uint16_t station, uint16_t index, uint8_t subindex,
+	ec_sdo_callback_t *callback, void *arg)
+{
+	ethercat_sdo_t *sdo = (ethercat_sdo_t *) calloc(1, sizeof(ethercat_sdo_t));
+
+	if(sdo == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	sdo->upload = true;
+	sdo->index = index;
+	sdo->subindex = subindex;
+	sdo->callback = callback;
+	sdo->arg = arg;
+
+	if(ec_queue_sdo(ethercat, station, sdo) == -1) {
+		free(sdo);
+		return -1;
+	}
+
+	return 0;
+}
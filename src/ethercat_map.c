@@ -0,0 +1,180 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <sched.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// Attempts of ec_map_load before giving up on a sequence that stays odd,
+// the reader yields the CPU every MAP_YIELD of them
+static const int MAP_RETRIES = 100000;
+static const int MAP_YIELD = 64;
+
+
+void ec_map_init(ec_map_t *map, void *data, int length)
+{
+	map->data = (uint8_t *) data;
+	map->length = length;
+	map->sequence = 0;
+	map->operations = 0;
+	map->write = false;
+	map->next = NULL;
+}
+
+
+/**
+ * Checks the range and that the map is only used in one direction,
+ * reads are copied by the cycle and writes by the application.
+ */
+static bool check_map(const ec_map_t *map, int offset, uint16_t length, bool write)
+{
+	if(offset < 0 || offset + length > map->length) {
+		fprintf(stderr, "Range %d+%d is outside the map of %d bytes.\n", offset, length, map->length);
+		return false;
+	}
+
+	if(map->operations && map->write != write) {
+		fprintf(stderr, "Map is already used for %s.\n", map->write?"writes":"reads");
+		return false;
+	}
+
+	return true;
+}
+
+
+static void bind_map(ethercat_t *ethercat, ec_map_t *map, ec_handle_t handle, bool write)
+{
+	ethercat->operations.info[ec_find_operation(ethercat, handle)].map = map;
+
+	// Read maps join the list whose sequences the cycle bumps
+	if(map->operations++ == 0) {
+		map->write = write;
+
+		if(!write) {
+			map->next = ethercat->maps;
+			ethercat->maps = map;
+		}
+	}
+}
+
+
+/**
+ * Reads into map at offset every time the request is sent. Datagrams
+ * merged from several mapped requests are scattered to their offsets.
+ */
+ec_handle_t ec_map_read(ethercat_t *ethercat, ec_map_t *map, int offset, const address_t address,
+	uint16_t length, int flags)
+{
+	if(!check_map(map, offset, length, false))
+		return -1;
+
+	ec_handle_t handle = ec_request_read_to(ethercat, address, length, map->data + offset, NULL, flags);
+
+	if(handle != -1)
+		bind_map(ethercat, map, handle, false);
+
+	return handle;
+}
+
+
+/**
+ * Writes from map at offset every time the request is sent. The cycle
+ * copies without synchronisation, so write maps are only updated from
+ * the cycle hook or between cycles.
+ */
+ec_handle_t ec_map_write(ethercat_t *ethercat, ec_map_t *map, int offset, const address_t address,
+	uint16_t length, int flags)
+{
+	if(!check_map(map, offset, length, true))
+		return -1;
+
+	ec_handle_t handle = ec_request_write_from(ethercat, address, length, map->data + offset, flags);
+
+	if(handle != -1)
+		bind_map(ethercat, map, handle, true);
+
+	return handle;
+}
+
+
+/**
+ * Copies a range of a read map as left by a complete cycle, retrying
+ * while the cycling thread copies into it. Safe from any thread. Gives
+ * up with -1 when no consistent copy could be made, as with a cycling
+ * thread preempted while copying on the reader's CPU.
+ */
+int ec_map_load(const ec_map_t *map, int offset, void *data, int length)
+{
+	if(offset < 0 || length < 0 || offset + length > map->length)
+		return -1;
+
+	for(int retry = 0; retry < MAP_RETRIES; retry++) {
+		uint32_t sequence = __atomic_load_n(&map->sequence, __ATOMIC_ACQUIRE);
+
+		if(!(sequence & 1)) {
+			memcpy(data, map->data + offset, length);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			if(__atomic_load_n(&map->sequence, __ATOMIC_RELAXED) == sequence)
+				return 0;
+		}
+
+		if(retry % MAP_YIELD == MAP_YIELD - 1) {
+			sched_yield();
+		} else {
+#if defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+	}
+
+	return -1;
+}
+
+
+// Marks all read maps as being written, before the first copy
+void ec_begin_maps(ethercat_t *ethercat)
+{
+	for(ec_map_t *map = ethercat->maps; map; map = map->next)
+		__atomic_store_n(&map->sequence, map->sequence + 1, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+// Publishes the copies of this cycle
+void ec_end_maps(ethercat_t *ethercat)
+{
+	for(ec_map_t *map = ethercat->maps; map; map = map->next)
+		__atomic_store_n(&map->sequence, map->sequence + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Detaches an operation from its map, which is dropped from the list
+ * with the last one. That may happen while decoding, so the sequence
+ * is made even again first.
+ */
+void ec_unbind_map(ethercat_t *ethercat, int index)
+{
+	ethercat_operation_t *info = &ethercat->operations.info[index];
+	ec_map_t *map = info->map;
+
+	info->map = NULL;
+
+	if(--map->operations > 0 || map->write)
+		return;
+
+	if(map->sequence & 1)
+		__atomic_store_n(&map->sequence, map->sequence + 1, __ATOMIC_RELEASE);
+
+	for(ec_map_t **link = &ethercat->maps; *link; link = &(*link)->next) {
+		if(*link == map) {
+			*link = map->next;
+			break;
+		}
+	}
+
+	map->next = NULL;
+}
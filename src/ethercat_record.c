@@ -0,0 +1,516 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+#include "ethercat_record.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Block states
+static const int BLOCK_FREE = 0;	// Filled by the cycling thread
+static const int BLOCK_FULL = 1;	// Written to the file by the writer thread
+
+// How often the writer thread looks for full blocks
+static const int64_t RECORD_INTERVAL_NS = 10000000;
+
+
+static uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+
+static void *alloc_block(size_t size)
+{
+	void *block = NULL;
+	int error = posix_memalign(&block, EC_RECORD_ALIGNMENT, size);
+
+	if(error != 0) {
+		fprintf(stderr, "posix_memalign(): %s\n", strerror(error));
+		return NULL;
+	}
+
+	memset(block, 0, size);
+	return block;
+}
+
+
+void ec_default_recorder_options(ec_recorder_options_t *options)
+{
+	options->block_samples = 4096;
+	options->blocks = 4;
+	options->direct = true;
+}
+
+
+static void free_recorder(ethercat_recorder_t *recorder)
+{
+	if(recorder->fd != -1)
+		close(recorder->fd);
+
+	for(int i = 0; i < recorder->block_count; i++)
+		free(recorder->blocks[i]);
+
+	free(recorder->blocks);
+	free(recorder->states);
+	free(recorder->index);
+	free(recorder->columns);
+	free(recorder->sources);
+	free(recorder);
+}
+
+
+/**
+ * Appends a column, only possible until the recorder is started. The
+ * built-in columns are added with the first one.
+ */
+static int add_column(ethercat_t *ethercat, const char *name, int type, int size, const uint8_t *source)
+{
+	if(strlen(name) >= EC_RECORD_NAME_LENGTH) {
+		fprintf(stderr, "Variable name %s is longer than %d characters.\n", name, EC_RECORD_NAME_LENGTH - 1);
+		return -1;
+	}
+
+	if(ethercat->recorder == NULL) {
+		ethercat_recorder_t *recorder = (ethercat_recorder_t *) calloc(1, sizeof(ethercat_recorder_t));
+
+		if(recorder == NULL) {
+			perror("calloc()");
+			return -1;
+		}
+
+		recorder->fd = -1;
+		ethercat->recorder = recorder;
+
+		if(add_column(ethercat, "cycle", EC_RECORD_UNSIGNED, 8, NULL) == -1 ||
+		   add_column(ethercat, "time_ns", EC_RECORD_SIGNED, 8, NULL) == -1 ||
+		   add_column(ethercat, "duration_ns", EC_RECORD_UNSIGNED, 4, NULL) == -1 ||
+		   add_column(ethercat, "complete", EC_RECORD_UNSIGNED, 1, NULL) == -1) {
+			free_recorder(recorder);
+			ethercat->recorder = NULL;
+			return -1;
+		}
+	}
+
+	ethercat_recorder_t *recorder = ethercat->recorder;
+
+	if(recorder->running) {
+		fprintf(stderr, "Variables must be added before the recorder is started.\n");
+		return -1;
+	}
+
+	for(int i = 0; i < recorder->column_count; i++) {
+		if(strcmp(recorder->columns[i].name, name) == 0) {
+			fprintf(stderr, "Variable %s is already recorded.\n", name);
+			return -1;
+		}
+	}
+
+	if(recorder->column_count == recorder->column_capacity) {
+		int capacity = recorder->column_capacity?2 * recorder->column_capacity:16;
+		ec_record_column_t *columns =
+			(ec_record_column_t *) realloc(recorder->columns, capacity * sizeof(ec_record_column_t));
+
+		if(columns)
+			recorder->columns = columns;
+
+		const uint8_t **sources = (const uint8_t **) realloc(recorder->sources, capacity * sizeof(uint8_t *));
+
+		if(sources)
+			recorder->sources = sources;
+
+		if(columns == NULL || sources == NULL) {
+			perror("realloc()");
+			return -1;
+		}
+
+		recorder->column_capacity = capacity;
+	}
+
+	ec_record_column_t *column = &recorder->columns[recorder->column_count];
+	memset(column, 0, sizeof(ec_record_column_t));
+	strcpy(column->name, name);
+	column->type = type;
+	column->size = size;
+
+	recorder->sources[recorder->column_count++] = source;
+	return 0;
+}
+
+
+/**
+ * Records length bytes at offset of a map every cycle, as the map holds
+ * them at the end of the cycle. type (EC_RECORD_*) only tells readers
+ * how to interpret the values.
+ */
+int ec_record_variable(ethercat_t *ethercat, const char *name, const ec_map_t *map, int offset, int length, int type)
+{
+	if(offset < 0 || length <= 0 || offset + length > map->length) {
+		fprintf(stderr, "Range %d+%d is outside the map of %d bytes.\n", offset, length, map->length);
+		return -1;
+	}
+
+	if(type < EC_RECORD_UNSIGNED || type > EC_RECORD_BYTES) {
+		fprintf(stderr, "Invalid type (%d) for variable %s.\n", type, name);
+		return -1;
+	}
+
+	return add_column(ethercat, name, type, length, map->data + offset);
+}
+
+
+static int open_file(const char *path, bool direct)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	if(direct) {
+		int fd = open(path, flags | O_DIRECT, 0644);
+
+		// Not every file system supports O_DIRECT (tmpfs for one)
+		if(fd != -1 || errno != EINVAL)
+			return fd;
+	}
+
+	return open(path, flags, 0644);
+}
+
+
+static int write_all(int fd, const void *data, size_t length, uint64_t offset)
+{
+	const uint8_t *ptr = (const uint8_t *) data;
+
+	while(length > 0) {
+		ssize_t written = pwrite(fd, ptr, length, offset);
+
+		if(written == -1) {
+			if(errno == EINTR)
+				continue;
+
+			perror("pwrite()");
+			return -1;
+		}
+
+		ptr += written;
+		offset += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Writes a full block at its place in the file and notes its time
+ * range for the index.
+ */
+static int write_block(ethercat_recorder_t *recorder, const uint8_t *block)
+{
+	if(recorder->index_count == recorder->index_capacity) {
+		int capacity = recorder->index_capacity?2 * recorder->index_capacity:1024;
+		ec_record_index_t *index =
+			(ec_record_index_t *) realloc(recorder->index, capacity * sizeof(ec_record_index_t));
+
+		if(index == NULL) {
+			perror("realloc()");
+			return -1;
+		}
+
+		recorder->index = index;
+		recorder->index_capacity = capacity;
+	}
+
+	uint64_t offset = recorder->data_offset + recorder->index_count * recorder->block_size;
+
+	if(write_all(recorder->fd, block, recorder->block_size, offset) == -1)
+		return -1;
+
+	const ec_record_block_t *header = (const ec_record_block_t *) block;
+	ec_record_index_t *entry = &recorder->index[recorder->index_count++];
+
+	entry->first_ns = header->first_ns;
+	entry->last_ns = header->last_ns;
+	entry->first_cycle = header->first_cycle;
+	entry->samples = header->samples;
+	return 0;
+}
+
+
+// Writes the full blocks in the order they were filled
+static void flush_blocks(ethercat_recorder_t *recorder)
+{
+	while(__atomic_load_n(&recorder->states[recorder->flush], __ATOMIC_ACQUIRE) == BLOCK_FULL) {
+		uint8_t *block = recorder->blocks[recorder->flush];
+
+		if(!recorder->failed && write_block(recorder, block) == -1)
+			recorder->failed = true;
+
+		((ec_record_block_t *) block)->samples = 0;
+		__atomic_store_n(&recorder->states[recorder->flush], BLOCK_FREE, __ATOMIC_RELEASE);
+
+		recorder->flush = (recorder->flush + 1) % recorder->block_count;
+	}
+}
+
+
+static void *record_thread(void *arg)
+{
+	ethercat_recorder_t *recorder = (ethercat_recorder_t *) arg;
+
+	struct timespec interval;
+	interval.tv_sec = 0;
+	interval.tv_nsec = RECORD_INTERVAL_NS;
+
+	while(__atomic_load_n(&recorder->running, __ATOMIC_ACQUIRE)) {
+		nanosleep(&interval, NULL);
+		flush_blocks(recorder);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Lays out the blocks, each column 8 byte aligned after the block
+ * header, and writes the file header with the column descriptors.
+ */
+static int write_header(ethercat_recorder_t *recorder)
+{
+	uint64_t offset = sizeof(ec_record_block_t);
+
+	for(int i = 0; i < recorder->column_count; i++) {
+		recorder->columns[i].offset = offset;
+		offset = align_up(offset + (uint64_t) recorder->columns[i].size * recorder->block_samples, 8);
+	}
+
+	recorder->block_size = align_up(offset, EC_RECORD_ALIGNMENT);
+	recorder->data_offset = align_up(sizeof(ec_record_file_t) +
+		recorder->column_count * sizeof(ec_record_column_t), EC_RECORD_ALIGNMENT);
+
+	uint8_t *header = (uint8_t *) alloc_block(recorder->data_offset);
+
+	if(header == NULL)
+		return -1;
+
+	ec_record_file_t *file = (ec_record_file_t *) header;
+	file->magic = EC_RECORD_MAGIC;
+	file->version = EC_RECORD_VERSION;
+	file->column_count = recorder->column_count;
+	file->block_samples = recorder->block_samples;
+	file->block_size = recorder->block_size;
+	file->data_offset = recorder->data_offset;
+	memcpy(file + 1, recorder->columns, recorder->column_count * sizeof(ec_record_column_t));
+
+	int result = write_all(recorder->fd, header, recorder->data_offset, 0);
+	free(header);
+
+	return result;
+}
+
+
+/**
+ * Undoes a start that failed part way, the recorder can be started again.
+ */
+static void abort_start(ethercat_recorder_t *recorder)
+{
+	close(recorder->fd);
+	recorder->fd = -1;
+
+	for(int i = 0; i < recorder->block_count; i++)
+		free(recorder->blocks[i]);
+
+	free(recorder->blocks);
+	free(recorder->states);
+
+	recorder->blocks = NULL;
+	recorder->states = NULL;
+	recorder->block_count = 0;
+}
+
+
+/**
+ * Starts recording every cycle into path. The cycling thread appends
+ * to per-column buffers of a block, a writer thread writes full blocks
+ * to the file. Must not be called while the cyclic executor runs.
+ */
+int ec_record_start(ethercat_t *ethercat, const char *path, const ec_recorder_options_t *options)
+{
+	ethercat_recorder_t *recorder = ethercat->recorder;
+
+	if(recorder == NULL) {
+		fprintf(stderr, "No variables to record.\n");
+		return -1;
+	}
+
+	if(recorder->running || recorder->fd != -1) {
+		fprintf(stderr, "Recorder is already started.\n");
+		return -1;
+	}
+
+	if(options->block_samples <= 0 || options->blocks < 2) {
+		fprintf(stderr, "Invalid number of samples per block (%d) or blocks (%d).\n",
+			options->block_samples, options->blocks);
+		return -1;
+	}
+
+	recorder->block_samples = options->block_samples;
+
+	recorder->fd = open_file(path, options->direct);
+
+	if(recorder->fd == -1) {
+		perror("open()");
+		return -1;
+	}
+
+	if(write_header(recorder) == -1) {
+		abort_start(recorder);
+		return -1;
+	}
+
+	recorder->blocks = (uint8_t **) calloc(options->blocks, sizeof(uint8_t *));
+	recorder->states = (int *) calloc(options->blocks, sizeof(int));
+
+	if(recorder->blocks == NULL || recorder->states == NULL) {
+		perror("calloc()");
+		abort_start(recorder);
+		return -1;
+	}
+
+	for(int i = 0; i < options->blocks; i++) {
+		if((recorder->blocks[i] = (uint8_t *) alloc_block(recorder->block_size)) == NULL) {
+			abort_start(recorder);
+			return -1;
+		}
+
+		recorder->block_count++;
+	}
+
+	__atomic_store_n(&recorder->running, true, __ATOMIC_RELEASE);
+
+	int error = pthread_create(&recorder->thread, NULL, record_thread, recorder);
+
+	if(error != 0) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(error));
+		__atomic_store_n(&recorder->running, false, __ATOMIC_RELEASE);
+		abort_start(recorder);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Appends one sample to every column, called by the cycling thread at
+ * the end of each cycle. While the writer thread is behind and the next
+ * block is not written yet, samples are dropped.
+ */
+void ec_record_cycle(ethercat_t *ethercat, int64_t start_ns, bool complete)
+{
+	ethercat_recorder_t *recorder = ethercat->recorder;
+
+	if(__atomic_load_n(&recorder->states[recorder->fill], __ATOMIC_ACQUIRE) != BLOCK_FREE) {
+		recorder->dropped++;
+		return;
+	}
+
+	uint8_t *block = recorder->blocks[recorder->fill];
+	ec_record_block_t *header = (ec_record_block_t *) block;
+	const ec_record_column_t *columns = recorder->columns;
+
+	uint32_t sample = header->samples;
+	uint64_t cycle = ethercat->counters.cycles;
+	int64_t now = ec_monotonic_ns();
+	uint32_t duration = now - start_ns;
+	uint8_t done = complete;
+
+	if(sample == 0) {
+		header->first_cycle = cycle;
+		header->first_ns = now;
+	}
+
+	memcpy(block + columns[EC_RECORD_CYCLE].offset + sample * 8, &cycle, 8);
+	memcpy(block + columns[EC_RECORD_TIME].offset + sample * 8, &now, 8);
+	memcpy(block + columns[EC_RECORD_DURATION].offset + sample * 4, &duration, 4);
+	block[columns[EC_RECORD_COMPLETE].offset + sample] = done;
+
+	for(int i = EC_RECORD_BUILTIN; i < recorder->column_count; i++)
+		memcpy(block + columns[i].offset + sample * columns[i].size, recorder->sources[i], columns[i].size);
+
+	header->last_ns = now;
+	header->samples = sample + 1;
+
+	if(header->samples == (uint32_t) recorder->block_samples) {
+		__atomic_store_n(&recorder->states[recorder->fill], BLOCK_FULL, __ATOMIC_RELEASE);
+		recorder->fill = (recorder->fill + 1) % recorder->block_count;
+	}
+}
+
+
+/**
+ * Writes the index and footer, padded so the file stays a multiple of
+ * the alignment with the footer in its last bytes.
+ */
+static int write_index(ethercat_recorder_t *recorder)
+{
+	uint64_t offset = recorder->data_offset + recorder->index_count * recorder->block_size;
+	size_t entries = recorder->index_count * sizeof(ec_record_index_t);
+	size_t length = align_up(entries + sizeof(ec_record_footer_t), EC_RECORD_ALIGNMENT);
+
+	uint8_t *buffer = (uint8_t *) alloc_block(length);
+
+	if(buffer == NULL)
+		return -1;
+
+	memcpy(buffer, recorder->index, entries);
+
+	ec_record_footer_t *footer = (ec_record_footer_t *) (buffer + length - sizeof(ec_record_footer_t));
+	footer->index_offset = offset;
+	footer->block_count = recorder->index_count;
+	footer->magic = EC_RECORD_MAGIC;
+
+	int result = write_all(recorder->fd, buffer, length, offset);
+	free(buffer);
+
+	return result;
+}
+
+
+/**
+ * Writes the partly filled block, the index and the footer, and closes
+ * the file. Must not be called while the cyclic executor runs.
+ */
+void ec_record_stop(ethercat_t *ethercat)
+{
+	ethercat_recorder_t *recorder = ethercat->recorder;
+
+	if(recorder == NULL)
+		return;
+
+	ethercat->recorder = NULL;
+
+	if(recorder->running) {
+		__atomic_store_n(&recorder->running, false, __ATOMIC_RELEASE);
+		pthread_join(recorder->thread, NULL);
+
+		ec_record_block_t *header = (ec_record_block_t *) recorder->blocks[recorder->fill];
+
+		if(recorder->states[recorder->fill] == BLOCK_FREE && header->samples > 0)
+			recorder->states[recorder->fill] = BLOCK_FULL;
+
+		flush_blocks(recorder);
+
+		if(recorder->failed || write_index(recorder) == -1)
+			fprintf(stderr, "Recording is incomplete, the index is missing.\n");
+
+		if(recorder->dropped)
+			fprintf(stderr, "Recorder dropped %llu samples.\n", (unsigned long long) recorder->dropped);
+	}
+
+	free_recorder(recorder);
+}
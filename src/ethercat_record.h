@@ -0,0 +1,95 @@
+#ifndef __ETHERCAT_RECORD_H__
+#define __ETHERCAT_RECORD_H__
+
+#include <stdint.h>
+
+/**
+ * File format of the telemetry recorder started with ec_record_start,
+ * and the reader library for offline analysis.
+ *
+ * The file starts with a header and the column descriptors, followed
+ * by blocks of a fixed size. Each block holds up to block_samples
+ * consecutive cycles, stored column by column. When the recorder
+ * stops, an index of the blocks' time ranges and a footer are appended.
+ * Blocks start at multiples of EC_RECORD_ALIGNMENT, so block n is
+ * found at data_offset + n * block_size even without the index.
+ *
+ * Values are stored as they are in the map, little endian. Readers
+ * only need this header and ethercat_record_reader.c.
+ */
+
+#define EC_RECORD_MAGIC     0x31524345	// "ECR1"
+#define EC_RECORD_VERSION   1
+#define EC_RECORD_ALIGNMENT 4096
+
+// Types of values, for readers
+#define EC_RECORD_UNSIGNED 0x00
+#define EC_RECORD_SIGNED   0x01
+#define EC_RECORD_FLOAT    0x02
+#define EC_RECORD_BYTES    0x03
+
+#define EC_RECORD_NAME_LENGTH 32
+
+// Columns every file starts with
+#define EC_RECORD_CYCLE    0	// uint64_t, cycles done including this one
+#define EC_RECORD_TIME     1	// int64_t CLOCK_MONOTONIC at the end of the cycle
+#define EC_RECORD_DURATION 2	// uint32_t nanoseconds spent in ec_do_cycle
+#define EC_RECORD_COMPLETE 3	// uint8_t, all frames came back
+#define EC_RECORD_BUILTIN  4
+
+struct ec_record_file_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t column_count;	// Descriptors follow the header
+	uint32_t block_samples;
+	uint64_t block_size;
+	uint64_t data_offset;	// Of the first block
+};
+
+struct ec_record_column_t {
+	char name[EC_RECORD_NAME_LENGTH];
+	uint32_t type;
+	uint32_t size;		// Of one value
+	uint64_t offset;	// Of the values from the start of each block
+};
+
+// Start of every block
+struct ec_record_block_t {
+	uint64_t first_cycle;
+	int64_t first_ns;
+	int64_t last_ns;
+	uint32_t samples;
+	uint32_t reserved;
+};
+
+// Index entry of one block
+struct ec_record_index_t {
+	int64_t first_ns;
+	int64_t last_ns;
+	uint64_t first_cycle;
+	uint64_t samples;
+};
+
+// Last bytes of a file whose recorder was stopped
+struct ec_record_footer_t {
+	uint64_t index_offset;
+	uint64_t block_count;
+	uint32_t magic;
+	uint32_t reserved;
+};
+
+struct ec_record_reader_t;
+
+ec_record_reader_t *ec_record_open(const char *path);
+void ec_record_close(ec_record_reader_t **);
+
+int ec_record_column_count(const ec_record_reader_t *);
+const ec_record_column_t *ec_record_column(const ec_record_reader_t *, int column);
+int ec_record_find(const ec_record_reader_t *, const char *name);
+
+// Copies the values of a column for the samples with from_ns <= time
+// < to_ns, at most max of them. Returns the number of samples or -1.
+int64_t ec_record_slice(const ec_record_reader_t *, int column, int64_t from_ns, int64_t to_ns, void *data,
+	int64_t max);
+
+#endif
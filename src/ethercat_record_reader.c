@@ -0,0 +1,302 @@
+#include "ethercat_record.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+struct ec_record_reader_t
+{
+	int fd;
+	ec_record_file_t file;
+	ec_record_column_t *columns;
+
+	ec_record_index_t *index;
+	uint64_t block_count;
+};
+
+
+static int read_all(int fd, void *data, size_t length, uint64_t offset)
+{
+	uint8_t *ptr = (uint8_t *) data;
+
+	while(length > 0) {
+		ssize_t nbytes = pread(fd, ptr, length, offset);
+
+		if(nbytes == -1 && errno == EINTR)
+			continue;
+
+		if(nbytes <= 0) {
+			if(nbytes == -1)
+				perror("pread()");
+			else
+				fprintf(stderr, "Recording is truncated.\n");
+			return -1;
+		}
+
+		ptr += nbytes;
+		offset += nbytes;
+		length -= nbytes;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Loads the index from the footer, or rebuilds it from the block
+ * headers if the recorder was not stopped.
+ */
+static int read_index(ec_record_reader_t *reader, uint64_t size)
+{
+	ec_record_footer_t footer;
+	memset(&footer, 0, sizeof(footer));
+
+	if(size >= reader->file.data_offset + sizeof(footer) &&
+	   read_all(reader->fd, &footer, sizeof(footer), size - sizeof(footer)) == -1)
+		return -1;
+
+	bool stopped = footer.magic == EC_RECORD_MAGIC &&
+		footer.index_offset == reader->file.data_offset + footer.block_count * reader->file.block_size &&
+		footer.index_offset + footer.block_count * sizeof(ec_record_index_t) <= size;
+
+	if(stopped)
+		reader->block_count = footer.block_count;
+	else if(size > reader->file.data_offset)
+		reader->block_count = (size - reader->file.data_offset) / reader->file.block_size;
+	else
+		reader->block_count = 0;
+
+	reader->index = (ec_record_index_t *) calloc(reader->block_count + 1, sizeof(ec_record_index_t));
+
+	if(reader->index == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	if(stopped)
+		return read_all(reader->fd, reader->index, reader->block_count * sizeof(ec_record_index_t),
+			footer.index_offset);
+
+	for(uint64_t i = 0; i < reader->block_count; i++) {
+		ec_record_block_t block;
+
+		if(read_all(reader->fd, &block, sizeof(block), reader->file.data_offset + i * reader->file.block_size) == -1)
+			return -1;
+
+		// A block the writer had not finished
+		if(block.samples == 0 || block.samples > reader->file.block_samples) {
+			reader->block_count = i;
+			break;
+		}
+
+		reader->index[i].first_ns = block.first_ns;
+		reader->index[i].last_ns = block.last_ns;
+		reader->index[i].first_cycle = block.first_cycle;
+		reader->index[i].samples = block.samples;
+	}
+
+	return 0;
+}
+
+
+static bool check_file(const ec_record_file_t *file)
+{
+	if(file->magic != EC_RECORD_MAGIC) {
+		fprintf(stderr, "Not a recording.\n");
+		return false;
+	}
+
+	if(file->version != EC_RECORD_VERSION) {
+		fprintf(stderr, "Recording has version %u, expected %u.\n", file->version, EC_RECORD_VERSION);
+		return false;
+	}
+
+	if(file->column_count < EC_RECORD_BUILTIN || file->block_samples == 0 || file->block_size == 0 ||
+	   file->data_offset < sizeof(ec_record_file_t) + (uint64_t) file->column_count * sizeof(ec_record_column_t)) {
+		fprintf(stderr, "Recording has an invalid header.\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+ec_record_reader_t *ec_record_open(const char *path)
+{
+	ec_record_reader_t *reader = (ec_record_reader_t *) calloc(1, sizeof(ec_record_reader_t));
+
+	if(reader == NULL) {
+		perror("calloc()");
+		return NULL;
+	}
+
+	reader->fd = open(path, O_RDONLY);
+
+	if(reader->fd == -1) {
+		perror("open()");
+		free(reader);
+		return NULL;
+	}
+
+	struct stat info;
+
+	if(fstat(reader->fd, &info) == -1) {
+		perror("fstat()");
+		ec_record_close(&reader);
+		return NULL;
+	}
+
+	if(read_all(reader->fd, &reader->file, sizeof(ec_record_file_t), 0) == -1 || !check_file(&reader->file)) {
+		ec_record_close(&reader);
+		return NULL;
+	}
+
+	reader->columns = (ec_record_column_t *) calloc(reader->file.column_count, sizeof(ec_record_column_t));
+
+	if(reader->columns == NULL) {
+		perror("calloc()");
+		ec_record_close(&reader);
+		return NULL;
+	}
+
+	if(read_all(reader->fd, reader->columns, reader->file.column_count * sizeof(ec_record_column_t),
+		sizeof(ec_record_file_t)) == -1 || read_index(reader, info.st_size) == -1) {
+		ec_record_close(&reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+
+void ec_record_close(ec_record_reader_t **readerv)
+{
+	ec_record_reader_t *reader = *readerv;
+
+	if(reader) {
+		close(reader->fd);
+		free(reader->columns);
+		free(reader->index);
+		free(reader);
+	}
+	*readerv = NULL;
+}
+
+
+int ec_record_column_count(const ec_record_reader_t *reader)
+{
+	return reader->file.column_count;
+}
+
+
+const ec_record_column_t *ec_record_column(const ec_record_reader_t *reader, int column)
+{
+	if(column < 0 || (uint32_t) column >= reader->file.column_count)
+		return NULL;
+
+	return &reader->columns[column];
+}
+
+
+int ec_record_find(const ec_record_reader_t *reader, const char *name)
+{
+	for(uint32_t i = 0; i < reader->file.column_count; i++) {
+		if(strncmp(reader->columns[i].name, name, EC_RECORD_NAME_LENGTH) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+
+// First sample of a block with a time of at least time_ns
+static uint32_t find_sample(const int64_t *times, uint32_t samples, int64_t time_ns)
+{
+	uint32_t low = 0;
+	uint32_t high = samples;
+
+	while(low < high) {
+		uint32_t middle = (low + high) / 2;
+
+		if(times[middle] < time_ns)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+
+/**
+ * Finds the first block that ends at or after from_ns in the index,
+ * then only reads the time column and the requested column of the
+ * blocks that overlap the range.
+ */
+int64_t ec_record_slice(const ec_record_reader_t *reader, int column, int64_t from_ns, int64_t to_ns, void *data,
+	int64_t max)
+{
+	const ec_record_column_t *info = ec_record_column(reader, column);
+
+	if(info == NULL) {
+		fprintf(stderr, "Invalid column (%d).\n", column);
+		return -1;
+	}
+
+	uint64_t low = 0;
+	uint64_t high = reader->block_count;
+
+	while(low < high) {
+		uint64_t middle = (low + high) / 2;
+
+		if(reader->index[middle].last_ns < from_ns)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	int64_t *times = (int64_t *) malloc(reader->file.block_samples * sizeof(int64_t));
+
+	if(times == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+
+	const ec_record_column_t *time_column = &reader->columns[EC_RECORD_TIME];
+	uint8_t *ptr = (uint8_t *) data;
+	int64_t count = 0;
+
+	for(uint64_t b = low; b < reader->block_count && count < max && reader->index[b].first_ns < to_ns; b++) {
+		uint64_t block = reader->file.data_offset + b * reader->file.block_size;
+		uint32_t samples = reader->index[b].samples;
+
+		if(read_all(reader->fd, times, samples * sizeof(int64_t), block + time_column->offset) == -1) {
+			free(times);
+			return -1;
+		}
+
+		uint32_t first = find_sample(times, samples, from_ns);
+		uint32_t last = find_sample(times, samples, to_ns);
+
+		if(last - first > max - count)
+			last = first + (max - count);
+
+		if(last > first && read_all(reader->fd, ptr, (uint64_t) (last - first) * info->size,
+			block + info->offset + (uint64_t) first * info->size) == -1) {
+			free(times);
+			return -1;
+		}
+
+		ptr += (uint64_t) (last - first) * info->size;
+		count += last - first;
+	}
+
+	free(times);
+	return count;
+}
@@ -0,0 +1,148 @@
+#ifndef __ETHERCAT_REGISTERS_H__
+#define __ETHERCAT_REGISTERS_H__
+
+#include "ethercat.h"
+#include <stdint.h>
+
+/**
+ * ESC registers with their offset and type fixed at compile time.
+ * Requests made through ec_read/ec_write copy straight between the
+ * frame and the application's variable, no callback is involved.
+ *
+ *   uint16_t status, wkc;
+ *   ec_read<ec_reg_al_status>(ethercat, 0x1001, &status, &wkc, EC_CALL_PERIODIC);
+ */
+
+// Registers are little endian and copied as they are
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "ESC registers require a little endian host");
+
+
+template<uint16_t Offset, typename T>
+struct ec_register_t
+{
+	typedef T type;
+
+	static constexpr uint16_t offset = Offset;
+	static constexpr uint16_t size = sizeof(T);
+};
+
+
+// Consecutive blocks, such as several sync managers read at once
+template<typename T, int Count>
+struct ec_array_t
+{
+	T item[Count];
+};
+
+
+// Sync manager channel, 0x0800 + 8 * n
+struct ec_sm_t
+{
+	uint16_t start;
+	uint16_t length;
+	uint8_t control;
+	uint8_t status;
+	uint8_t activate;
+	uint8_t pdi_control;
+} __attribute__ ((packed));
+
+// FMMU, 0x0600 + 16 * n
+struct ec_fmmu_t
+{
+	uint32_t logical_start;
+	uint16_t length;
+	uint8_t logical_start_bit;
+	uint8_t logical_stop_bit;
+	uint16_t physical_start;
+	uint8_t physical_start_bit;
+	uint8_t type;
+	uint8_t activate;
+	uint8_t reserved[3];
+} __attribute__ ((packed));
+
+static_assert(sizeof(ec_sm_t) == 8, "Sync manager channels are 8 bytes");
+static_assert(sizeof(ec_fmmu_t) == 16, "FMMUs are 16 bytes");
+
+
+// Identification
+typedef ec_register_t<0x0000, uint8_t> ec_reg_type;
+typedef ec_register_t<0x0001, uint8_t> ec_reg_revision;
+typedef ec_register_t<0x0002, uint16_t> ec_reg_build;
+typedef ec_register_t<0x0004, uint8_t> ec_reg_fmmu_count;
+typedef ec_register_t<0x0005, uint8_t> ec_reg_sm_count;
+typedef ec_register_t<0x0006, uint8_t> ec_reg_ram_size;
+typedef ec_register_t<0x0007, uint8_t> ec_reg_port_descriptor;
+typedef ec_register_t<0x0008, uint16_t> ec_reg_features;
+
+// Addressing and data link
+typedef ec_register_t<0x0010, uint16_t> ec_reg_station_address;
+typedef ec_register_t<0x0012, uint16_t> ec_reg_station_alias;
+typedef ec_register_t<0x0100, uint32_t> ec_reg_dl_control;
+typedef ec_register_t<0x0110, uint16_t> ec_reg_dl_status;
+
+// Application layer
+typedef ec_register_t<0x0120, uint16_t> ec_reg_al_control;
+typedef ec_register_t<0x0130, uint16_t> ec_reg_al_status;
+typedef ec_register_t<0x0134, uint16_t> ec_reg_al_status_code;
+
+// Distributed clocks
+typedef ec_register_t<0x0900, ec_array_t<uint32_t, 4> > ec_reg_dc_receive_time;
+typedef ec_register_t<0x0910, uint64_t> ec_reg_dc_system_time;
+typedef ec_register_t<0x0918, uint64_t> ec_reg_dc_receive_time_unit;
+typedef ec_register_t<0x0920, uint64_t> ec_reg_dc_system_offset;
+typedef ec_register_t<0x0928, uint32_t> ec_reg_dc_system_delay;
+typedef ec_register_t<0x092C, uint32_t> ec_reg_dc_system_difference;
+
+// FMMU n, or count FMMUs from n on
+template<int N, int Count = 1>
+struct ec_reg_fmmu : ec_register_t<0x0600 + 16 * N, ec_array_t<ec_fmmu_t, Count> >
+{
+	static_assert(N >= 0 && Count > 0 && N + Count <= 16, "There are 16 FMMUs");
+};
+
+// Sync manager n, or count sync managers from n on
+template<int N, int Count = 1>
+struct ec_reg_sm : ec_register_t<0x0800 + 8 * N, ec_array_t<ec_sm_t, Count> >
+{
+	static_assert(N >= 0 && Count > 0 && N + Count <= 32, "There are 32 sync managers");
+};
+
+// Status byte of sync manager n, bit 3 is set while a mailbox is full
+template<int N>
+struct ec_reg_sm_status : ec_register_t<0x0800 + 8 * N + 5, uint8_t>
+{
+	static_assert(N >= 0 && N < 32, "There are 32 sync managers");
+};
+
+
+/**
+ * Reads a register of the slave at station (or the position with
+ * EC_ADDR_AI) into value, and its working counter into wkc unless NULL.
+ */
+template<typename Reg>
+inline ec_handle_t ec_read(ethercat_t *ethercat, uint16_t station, typename Reg::type *value, uint16_t *wkc,
+	int flags)
+{
+	address_t address;
+	address.physical.ado = station;
+	address.physical.adp = Reg::offset;
+
+	return ec_request_read_to(ethercat, address, Reg::size, value, wkc, flags);
+}
+
+
+/**
+ * Writes value to a register, value is read when the frame is built
+ * and must stay valid as long as the request runs.
+ */
+template<typename Reg>
+inline ec_handle_t ec_write(ethercat_t *ethercat, uint16_t station, const typename Reg::type *value, int flags)
+{
+	address_t address;
+	address.physical.ado = station;
+	address.physical.adp = Reg::offset;
+
+	return ec_request_write_from(ethercat, address, Reg::size, value, flags);
+}
+
+#endif
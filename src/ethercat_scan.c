@@ -0,0 +1,172 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// State of one slave during the scan
+struct scan_setup_t
+{
+	uint16_t station;
+	uint8_t info[10];	// Registers 0x0000 to 0x0009
+	uint8_t dl_status[2];
+	uint16_t wkc;
+	uint16_t dl_wkc;
+};
+
+
+static void write_station(const address_t address, void *payload, uint16_t length, void *data)
+{
+	uint16_t station = ((scan_setup_t *) payload)->station;
+	uint8_t *tmp = (uint8_t *) data;
+
+	tmp[0] = station & 0xFF;
+	tmp[1] = station >> 8;
+}
+
+
+/**
+ * Finds the slave each slave is attached to from the number of ports
+ * with communication, slaves are numbered in the order frames pass
+ * them. A slave hangs off the nearest previous slave that still has
+ * a free port once the branches in between are closed.
+ */
+static void build_topology(ec_slave_info_t *slaves, int count)
+{
+	for(int i = 0; i < count; i++) {
+		slaves[i].ports = 0;
+		for(int port = 0; port < 4; port++) {
+			if(slaves[i].dl_status & (DL_STATUS_COMMUNICATION << (2 * port)))
+				slaves[i].ports++;
+		}
+
+		slaves[i].parent = -1;
+		int open = 0;
+
+		for(int j = i - 1; j >= 0; j--) {
+			int ports = slaves[j].ports;
+
+			if(ports == 1)
+				open--;
+			else if(ports == 3)
+				open++;
+			else if(ports == 4)
+				open += 2;
+
+			if((open >= 0 && ports > 1) || j == 0) {
+				slaves[i].parent = j;
+				break;
+			}
+		}
+	}
+}
+
+
+static int scan(ethercat_t *ethercat, ethercat_batch_t *batch, uint16_t first_station, ec_slave_info_t *slaves,
+	int count, scan_setup_t *setup)
+{
+	// Station addresses for all slaves in one frame
+	for(int i = 0; i < count; i++) {
+		setup[i].station = first_station + i;
+
+		address_t address;
+		address.physical.ado = (uint16_t) -i;
+		address.physical.adp = reg_station_address;
+		ec_batch_add(ethercat, batch, ec_request_write(ethercat, address, 2, write_station, &setup[i],
+			EC_CALL_ONESHOT | EC_ADDR_AI), NULL, 0);
+	}
+
+	if(ec_batch_run(ethercat, batch, "setting station addresses") == -1)
+		return -1;
+
+	// Identification and link state, answers also confirm the addresses
+	for(int i = 0; i < count; i++) {
+		address_t address;
+		address.physical.ado = setup[i].station;
+		address.physical.adp = reg_type;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, sizeof(setup[i].info), setup[i].info,
+			&setup[i].wkc, EC_CALL_ONESHOT), &setup[i].wkc, 1);
+
+		address.physical.adp = reg_dl_status;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, address, 2, setup[i].dl_status, &setup[i].dl_wkc,
+			EC_CALL_ONESHOT), &setup[i].dl_wkc, 1);
+	}
+
+	if(ec_batch_run(ethercat, batch, "identifying slaves") == -1)
+		return -1;
+
+	for(int i = 0; i < count; i++) {
+		const uint8_t *info = setup[i].info;
+
+		slaves[i].position = i;
+		slaves[i].station = setup[i].station;
+		slaves[i].type = info[reg_type];
+		slaves[i].revision = info[reg_revision];
+		slaves[i].build = ec_get16(info + reg_build);
+		slaves[i].fmmu_count = info[reg_fmmu_count];
+		slaves[i].sm_count = info[reg_sm_count];
+		slaves[i].port_descriptor = info[reg_port_descriptor];
+		slaves[i].features = ec_get16(info + reg_features);
+		slaves[i].dl_status = ec_get16(setup[i].dl_status);
+	}
+
+	build_topology(slaves, count);
+	return count;
+}
+
+
+/**
+ * Counts the slaves with a broadcast read, gives slave n the station
+ * address first_station + n and reads its identification and port
+ * state. Takes three cycles regardless of the number of slaves, more
+ * when frames are lost.
+ *
+ * Returns the number of slaves found or -1. At most max slaves are
+ * addressed, more are an error.
+ */
+int ec_scan(ethercat_t *ethercat, uint16_t first_station, ec_slave_info_t *slaves, int max)
+{
+	ethercat_batch_t batch;
+	ec_batch_init(&batch);
+
+	// Every slave increments the working counter of the broadcast
+	uint8_t type;
+	uint16_t count = 0;
+
+	address_t address;
+	address.physical.ado = 0x0000;
+	address.physical.adp = reg_type;
+	ec_batch_add(ethercat, &batch, ec_request_read_to(ethercat, address, 1, &type, &count,
+		EC_CALL_ONESHOT | EC_ADDR_BR), NULL, 0);
+
+	int result = ec_batch_run(ethercat, &batch, "counting slaves");
+	ec_batch_free(ethercat, &batch);
+
+	if(result == -1)
+		return -1;
+
+	if(count == 0) {
+		fprintf(stderr, "No slaves found.\n");
+		return -1;
+	}
+
+	if(count > max || (int) first_station + count > 0x10000) {
+		fprintf(stderr, "Found %d slaves, only %d can be addressed.\n", count, max);
+		return -1;
+	}
+
+	scan_setup_t *setup = (scan_setup_t *) calloc(count, sizeof(scan_setup_t));
+
+	if(setup == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	result = scan(ethercat, &batch, first_station, slaves, count, setup);
+	ec_batch_free(ethercat, &batch);
+	free(setup);
+
+	return result;
+}
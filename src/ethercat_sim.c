@@ -0,0 +1,1011 @@
+#include "ethercat_internal.h"
+#include "ethercat_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int SIM_MEMORY_SIZE = 0x10000;
+static const int SIM_FMMU_COUNT = 8;
+static const int SIM_SM_COUNT = 8;
+static const int SIM_MAX_OBJECTS = 32;
+static const int SIM_OBJECT_SIZE = 512;
+static const int SIM_MAILBOX_SIZE = 1024;
+
+// Time a frame needs from one slave to the next, and the largest
+// correction of a local clock per drift compensation write
+static const int64_t SIM_HOP_NS = 400;
+static const int64_t SIM_DC_SLEW_NS = 1000;
+
+// CoE services and SDO abort codes
+static const uint8_t COE_SDO_REQUEST = 0x02;
+static const uint8_t COE_SDO_RESPONSE = 0x03;
+
+static const uint32_t SDO_ABORT_TOGGLE = 0x05030000;
+static const uint32_t SDO_ABORT_COMMAND = 0x05040001;
+static const uint32_t SDO_ABORT_READ_ONLY = 0x06010002;
+static const uint32_t SDO_ABORT_NO_OBJECT = 0x06020000;
+static const uint32_t SDO_ABORT_LENGTH = 0x06070010;
+static const uint32_t SDO_ABORT_TOO_LONG = 0x06070012;
+
+
+struct sim_sm_t
+{
+	uint16_t start;
+	uint16_t length;
+	uint8_t control;
+	uint8_t status;
+	uint8_t activate;
+	uint8_t pdi_control;
+} __attribute__ ((packed));
+
+struct sim_fmmu_t
+{
+	uint32_t logical_start;
+	uint16_t length;
+	uint8_t logical_start_bit;
+	uint8_t logical_end_bit;
+	uint16_t physical_start;
+	uint8_t physical_start_bit;
+	uint8_t type;
+	uint8_t activate;
+	uint8_t reserved[3];
+} __attribute__ ((packed));
+
+struct sim_object_t
+{
+	uint16_t index;
+	uint8_t subindex;
+	bool writable;
+	bool variable;	// Length follows the last download
+
+	uint16_t length;
+	uint8_t data[SIM_OBJECT_SIZE];
+};
+
+// Segmented SDO transfer in progress
+struct sim_transfer_t
+{
+	bool active;
+	uint8_t toggle;
+	int offset;
+	sim_object_t *object;
+};
+
+struct sim_slave_t
+{
+	uint8_t *memory;
+
+	int object_count;
+	sim_object_t objects[SIM_MAX_OBJECTS];
+
+	sim_transfer_t download;
+	sim_transfer_t upload;
+
+	// Response waiting for the mailbox to be emptied
+	int pending_length;
+	uint8_t pending[SIM_MAILBOX_SIZE];
+
+	// Local clock drifting against the host, and the local time the
+	// current frame passes port 0 and returns through port 1
+	bool last;
+	int64_t clock_base;
+	int64_t drift_ppb;
+	int64_t slew_ns;
+	int64_t arrival;
+	int64_t departure;
+};
+
+struct ethercat_sim_t
+{
+	int slave_count;
+	sim_slave_t *slaves;
+	int64_t start_ns;
+};
+
+
+/*********************
+ * Memory helpers
+ */
+
+static sim_sm_t *sim_sm(sim_slave_t *slave, int n)
+{
+	return (sim_sm_t *) (slave->memory + reg_sm + 8 * n);
+}
+
+
+static sim_fmmu_t *sim_fmmu(sim_slave_t *slave, int n)
+{
+	return (sim_fmmu_t *) (slave->memory + reg_fmmu + 16 * n);
+}
+
+
+static bool sm_overlaps(const sim_sm_t *sm, uint32_t address, uint32_t length)
+{
+	return (sm->activate & 0x01) && sm->length > 0 &&
+		address < (uint32_t) sm->start + sm->length && address + length > sm->start;
+}
+
+
+static bool sm_covers_end(const sim_sm_t *sm, uint32_t address, uint32_t length)
+{
+	uint32_t last = (uint32_t) sm->start + sm->length - 1;
+	return (sm->activate & 0x01) && sm->length > 0 && address <= last && address + length > last;
+}
+
+
+static bool is_read_only(uint32_t address)
+{
+	if(address < 0x0010)
+		return true;
+	if(address >= reg_dl_status && address < reg_dl_status + 2)
+		return true;
+	if(address >= reg_al_status && address < reg_al_status + 6)
+		return true;
+	if(address >= reg_sm && address < reg_sm + 8 * SIM_SM_COUNT && (address & 0x07) == 5)
+		return true;
+	if(address >= reg_dc_receive_time && address < reg_dc_system_offset)
+		return true;
+	return false;
+}
+
+
+/*********************
+ * Object dictionary
+ */
+
+static sim_object_t *sim_add_object(sim_slave_t *slave, uint16_t index, uint8_t subindex,
+	uint16_t length, uint32_t value, bool writable)
+{
+	sim_object_t *object = &slave->objects[slave->object_count++];
+
+	object->index = index;
+	object->subindex = subindex;
+	object->writable = writable;
+	object->variable = false;
+	object->length = length;
+	memset(object->data, 0, SIM_OBJECT_SIZE);
+	ec_put32(object->data, value);
+
+	return object;
+}
+
+
+static void sim_init_objects(sim_slave_t *slave, int position)
+{
+	const char name[] = "Simulated EtherCAT slave";
+
+	slave->object_count = 0;
+
+	sim_add_object(slave, 0x1000, 0x00, 4, 0x00020192, false);
+
+	sim_object_t *object = sim_add_object(slave, 0x1008, 0x00, sizeof(name) - 1, 0, false);
+	memcpy(object->data, name, sizeof(name) - 1);
+	object->variable = true;
+
+	sim_add_object(slave, 0x1018, 0x01, 4, 0x00000539, false);
+	sim_add_object(slave, 0x1018, 0x02, 4, 0x00000001, false);
+	sim_add_object(slave, 0x1018, 0x04, 4, position, false);
+
+	sim_add_object(slave, 0x1C12, 0x00, 1, 1, true);
+	sim_add_object(slave, 0x1C12, 0x01, 2, 0x1600, true);
+	sim_add_object(slave, 0x1C13, 0x00, 1, 1, true);
+	sim_add_object(slave, 0x1C13, 0x01, 2, 0x1A00, true);
+
+	// Large object for segmented transfers
+	object = sim_add_object(slave, 0x2000, 0x00, 0, 0, true);
+	object->variable = true;
+
+	sim_add_object(slave, 0x6041, 0x00, 2, 0x0250, false);
+	sim_add_object(slave, 0x6064, 0x00, 4, 0, false);
+	sim_add_object(slave, 0x60C2, 0x01, 1, 1, true);
+	sim_add_object(slave, 0x60C2, 0x02, 1, 0xFD, true);
+}
+
+
+static sim_object_t *sim_find_object(sim_slave_t *slave, uint16_t index, uint8_t subindex)
+{
+	for(int i = 0; i < slave->object_count; i++) {
+		sim_object_t *object = &slave->objects[i];
+		if(object->index == index && object->subindex == subindex)
+			return object;
+	}
+
+	return NULL;
+}
+
+
+/*********************
+ * Mailbox
+ */
+
+static void sim_post_mailbox(sim_slave_t *slave, const uint8_t *response, int length)
+{
+	sim_sm_t *in = sim_sm(slave, 1);
+
+	if(length > in->length || length > SIM_MAILBOX_SIZE)
+		return;
+
+	// Wait for master to read previous response
+	if(in->status & SM_STATUS_FULL) {
+		memcpy(slave->pending, response, length);
+		slave->pending_length = length;
+		return;
+	}
+
+	memset(slave->memory + in->start, 0, in->length);
+	memcpy(slave->memory + in->start, response, length);
+	in->status |= SM_STATUS_FULL;
+}
+
+
+static int sim_mailbox_header(uint8_t *response, uint16_t length, uint8_t service)
+{
+	ec_put16(response + 0, length);
+	ec_put16(response + 2, 0x0000);
+	response[4] = 0x00;
+	response[5] = 0x03;	// CoE
+	ec_put16(response + 6, service << 12);
+	return 6 + length;
+}
+
+
+static int sim_sdo_abort(uint8_t *response, uint16_t index, uint8_t subindex, uint32_t code)
+{
+	response[8] = 0x80;
+	ec_put16(response + 9, index);
+	response[11] = subindex;
+	ec_put32(response + 12, code);
+	return sim_mailbox_header(response, 10, COE_SDO_REQUEST);
+}
+
+
+static int sim_sdo_response(uint8_t *response, uint8_t command, uint16_t index, uint8_t subindex)
+{
+	response[8] = command;
+	ec_put16(response + 9, index);
+	response[11] = subindex;
+	ec_put32(response + 12, 0);
+	return sim_mailbox_header(response, 10, COE_SDO_RESPONSE);
+}
+
+
+/**
+ * Serves SDO download and upload requests (expedited, normal and
+ * segmented). Returns length of the response or 0 if there is none.
+ */
+static int sim_coe(sim_slave_t *slave, const uint8_t *request, uint8_t *response)
+{
+	uint16_t mbx_length = ec_get16(request);
+	uint8_t service = request[7] >> 4;
+
+	if(service != COE_SDO_REQUEST || mbx_length < 3)
+		return 0;
+
+	uint8_t command = request[8];
+	uint16_t index = ec_get16(request + 9);
+	uint8_t subindex = request[11];
+	int capacity = sim_sm(slave, 1)->length;
+
+	switch(command >> 5) {
+		case 0x01: {	// Initiate download
+			sim_object_t *object = sim_find_object(slave, index, subindex);
+
+			if(object == NULL)
+				return sim_sdo_abort(response, index, subindex, SDO_ABORT_NO_OBJECT);
+			if(!object->writable)
+				return sim_sdo_abort(response, index, subindex, SDO_ABORT_READ_ONLY);
+
+			if(command & 0x02) {
+				int size = (command & 0x01)?(4 - ((command >> 2) & 0x03)):4;
+
+				if(!object->variable && size != object->length)
+					return sim_sdo_abort(response, index, subindex, SDO_ABORT_LENGTH);
+
+				memcpy(object->data, request + 12, size);
+				object->length = size;
+			} else {
+				uint32_t size = ec_get32(request + 12);
+
+				if(size > (uint32_t) SIM_OBJECT_SIZE)
+					return sim_sdo_abort(response, index, subindex, SDO_ABORT_TOO_LONG);
+				if(!object->variable && size != object->length)
+					return sim_sdo_abort(response, index, subindex, SDO_ABORT_LENGTH);
+
+				int bytes = (mbx_length > 10)?(mbx_length - 10):0;
+				if(bytes > (int) size)
+					bytes = size;
+
+				memcpy(object->data, request + 16, bytes);
+				object->length = size;
+
+				slave->download.active = bytes < (int) size;
+				slave->download.toggle = 0x00;
+				slave->download.offset = bytes;
+				slave->download.object = object;
+			}
+
+			return sim_sdo_response(response, 0x60, index, subindex);
+		}
+
+		case 0x00: {	// Download segment
+			sim_transfer_t *transfer = &slave->download;
+
+			if(!transfer->active)
+				return sim_sdo_abort(response, 0, 0, SDO_ABORT_COMMAND);
+
+			sim_object_t *object = transfer->object;
+			uint8_t toggle = command & 0x10;
+
+			if(toggle != transfer->toggle) {
+				transfer->active = false;
+				return sim_sdo_abort(response, object->index, object->subindex, SDO_ABORT_TOGGLE);
+			}
+
+			int bytes = mbx_length - 3;
+			if(bytes == 7)
+				bytes -= (command >> 1) & 0x07;
+			if(bytes > object->length - transfer->offset)
+				bytes = object->length - transfer->offset;
+
+			memcpy(object->data + transfer->offset, request + 9, bytes);
+			transfer->offset += bytes;
+			transfer->toggle ^= 0x10;
+
+			if(command & 0x01)
+				transfer->active = false;
+
+			response[8] = 0x20 | toggle;
+			memset(response + 9, 0, 7);
+			return sim_mailbox_header(response, 10, COE_SDO_RESPONSE);
+		}
+
+		case 0x02: {	// Initiate upload
+			sim_object_t *object = sim_find_object(slave, index, subindex);
+
+			if(object == NULL)
+				return sim_sdo_abort(response, index, subindex, SDO_ABORT_NO_OBJECT);
+
+			if(object->length <= 4) {
+				int length = sim_sdo_response(response, 0x43 | ((4 - object->length) << 2), index, subindex);
+				memcpy(response + 12, object->data, object->length);
+				return length;
+			}
+
+			int bytes = object->length;
+			if(bytes > capacity - 16)
+				bytes = capacity - 16;
+
+			response[8] = 0x41;
+			ec_put16(response + 9, index);
+			response[11] = subindex;
+			ec_put32(response + 12, object->length);
+			memcpy(response + 16, object->data, bytes);
+
+			slave->upload.active = bytes < object->length;
+			slave->upload.toggle = 0x00;
+			slave->upload.offset = bytes;
+			slave->upload.object = object;
+
+			return sim_mailbox_header(response, 10 + bytes, COE_SDO_RESPONSE);
+		}
+
+		case 0x03: {	// Upload segment
+			sim_transfer_t *transfer = &slave->upload;
+
+			if(!transfer->active)
+				return sim_sdo_abort(response, 0, 0, SDO_ABORT_COMMAND);
+
+			sim_object_t *object = transfer->object;
+			uint8_t toggle = command & 0x10;
+
+			if(toggle != transfer->toggle) {
+				transfer->active = false;
+				return sim_sdo_abort(response, object->index, object->subindex, SDO_ABORT_TOGGLE);
+			}
+
+			int bytes = object->length - transfer->offset;
+			if(bytes > capacity - 9)
+				bytes = capacity - 9;
+
+			bool last = (transfer->offset + bytes == object->length);
+			int unused = (bytes < 7)?(7 - bytes):0;
+
+			response[8] = toggle | (unused << 1) | (last?0x01:0x00);
+			memset(response + 9, 0, 7);
+			memcpy(response + 9, object->data + transfer->offset, bytes);
+
+			transfer->offset += bytes;
+			transfer->toggle ^= 0x10;
+			transfer->active = !last;
+
+			return sim_mailbox_header(response, 3 + bytes + unused, COE_SDO_RESPONSE);
+		}
+
+		case 0x04:	// Abort from master
+			slave->download.active = false;
+			slave->upload.active = false;
+			return 0;
+
+		default:
+			return sim_sdo_abort(response, index, subindex, SDO_ABORT_COMMAND);
+	}
+}
+
+
+/**
+ * Handles a request that has been written to mailbox out.
+ */
+static void sim_mailbox(sim_slave_t *slave)
+{
+	sim_sm_t *out = sim_sm(slave, 0);
+	const uint8_t *request = slave->memory + out->start;
+
+	uint8_t response[SIM_MAILBOX_SIZE];
+	memset(response, 0, sizeof(response));
+
+	int length = 0;
+
+	// An empty mailbox is used to clear it
+	if(ec_get16(request) > 0) {
+		if((request[5] & 0x0F) == 0x03) {
+			length = sim_coe(slave, request, response);
+		} else {
+			// Mailbox error, unsupported protocol
+			ec_put16(response + 0, 4);
+			response[5] = 0x00;
+			ec_put16(response + 6, 0x0001);
+			ec_put16(response + 8, 0x0002);
+			length = 10;
+		}
+	}
+
+	if(length > 0)
+		sim_post_mailbox(slave, response, length);
+
+	// Request has been consumed
+	out->status &= ~SM_STATUS_FULL;
+}
+
+
+/*********************
+ * Application layer
+ */
+
+static void sim_al_control(sim_slave_t *slave)
+{
+	uint8_t *memory = slave->memory;
+
+	uint16_t control = ec_get16(memory + reg_al_control);
+	uint16_t status = ec_get16(memory + reg_al_status);
+
+	uint8_t current = status & 0x0F;
+	uint8_t requested = control & 0x0F;
+	bool acknowledge = control & 0x10;
+
+	// Error indication stays until acknowledged
+	if((status & 0x10) && !acknowledge)
+		return;
+
+	bool valid;
+	switch(requested) {
+		case 0x01: valid = true; break;
+		case 0x02: valid = (current != 0x03); break;
+		case 0x03: valid = (current == 0x01 || current == 0x03); break;
+		case 0x04: valid = (current == 0x02 || current == 0x04 || current == 0x08); break;
+		case 0x08: valid = (current == 0x04 || current == 0x08); break;
+		default: valid = false; break;
+	}
+
+	if(valid) {
+		ec_put16(memory + reg_al_status, requested);
+		ec_put16(memory + reg_al_status_code, 0x0000);
+	} else {
+		ec_put16(memory + reg_al_status, current | 0x10);
+		ec_put16(memory + reg_al_status_code, 0x0011);
+	}
+}
+
+
+/**
+ * Applications in SafeOp or Op echo their outputs (SM2) to their inputs (SM3).
+ */
+static void sim_application(sim_slave_t *slave)
+{
+	uint8_t state = slave->memory[reg_al_status] & 0x0F;
+
+	if(state != 0x04 && state != 0x08)
+		return;
+
+	sim_sm_t *outputs = sim_sm(slave, 2);
+	sim_sm_t *inputs = sim_sm(slave, 3);
+
+	if(!(outputs->activate & 0x01) || !(inputs->activate & 0x01))
+		return;
+
+	uint16_t length = (outputs->length < inputs->length)?outputs->length:inputs->length;
+	memmove(slave->memory + inputs->start, slave->memory + outputs->start, length);
+}
+
+
+/*********************
+ * Distributed clocks
+ */
+
+static int64_t sim_local_time(const ethercat_sim_t *sim, const sim_slave_t *slave, int64_t now)
+{
+	int64_t elapsed = now - sim->start_ns;
+	return slave->clock_base + elapsed + elapsed * slave->drift_ppb / 1000000000 + slave->slew_ns;
+}
+
+
+static int64_t sim_system_time(const sim_slave_t *slave)
+{
+	return slave->arrival + (int64_t) ec_get64(slave->memory + reg_dc_system_offset);
+}
+
+
+/**
+ * Takes the local times of the frame passing the slave, as the ESC
+ * does when a frame starts. Slave n sees it n hops after the first
+ * slave and, unless last, again on its way back.
+ */
+static void sim_dc_frame(ethercat_sim_t *sim, sim_slave_t *slave, int position, int64_t now)
+{
+	int64_t back = 2 * (sim->slave_count - 1) - position;
+
+	slave->arrival = sim_local_time(sim, slave, now + position * SIM_HOP_NS);
+	slave->departure = sim_local_time(sim, slave, now + back * SIM_HOP_NS);
+
+	ec_put64(slave->memory + reg_dc_system_time, sim_system_time(slave));
+}
+
+
+/**
+ * Write to the receive time register latches the port receive times.
+ */
+static void sim_dc_latch(sim_slave_t *slave)
+{
+	uint8_t *memory = slave->memory;
+
+	ec_put32(memory + reg_dc_receive_time, slave->arrival);
+	ec_put32(memory + reg_dc_receive_time + 4, slave->last?0:slave->departure);
+	ec_put64(memory + reg_dc_receive_time_unit, slave->arrival);
+}
+
+
+/**
+ * Write of the reference time to the system time register. The local
+ * clock is slewed towards it by at most SIM_DC_SLEW_NS.
+ */
+static void sim_dc_compensate(sim_slave_t *slave, uint64_t received)
+{
+	int64_t delay = ec_get32(slave->memory + reg_dc_system_delay);
+	int64_t difference = sim_system_time(slave) - delay - (int64_t) received;
+
+	int64_t slew = -difference;
+	if(slew > SIM_DC_SLEW_NS)
+		slew = SIM_DC_SLEW_NS;
+	else if(slew < -SIM_DC_SLEW_NS)
+		slew = -SIM_DC_SLEW_NS;
+	slave->slew_ns += slew;
+
+	// Bit 31 set when the local copy is behind
+	uint32_t magnitude = (difference < 0)?-difference:difference;
+	if(magnitude > 0x7FFFFFFF)
+		magnitude = 0x7FFFFFFF;
+	ec_put32(slave->memory + reg_dc_system_difference, magnitude | ((difference < 0)?0x80000000:0));
+}
+
+
+/*********************
+ * Datagrams
+ */
+
+static bool sim_read(sim_slave_t *slave, uint32_t address, uint16_t length, uint8_t *data, bool merge)
+{
+	sim_sm_t *in = sim_sm(slave, 1);
+
+	if(address + length > (uint32_t) SIM_MEMORY_SIZE)
+		return false;
+
+	// Mailbox can only be read when full
+	if(sm_overlaps(in, address, length) && !(in->status & SM_STATUS_FULL))
+		return false;
+
+	const uint8_t *memory = slave->memory + address;
+
+	if(merge) {
+		for(int i = 0; i < length; i++)
+			data[i] |= memory[i];
+	} else {
+		memcpy(data, memory, length);
+	}
+
+	// Reading the last byte empties the mailbox
+	if(sm_covers_end(in, address, length)) {
+		in->status &= ~SM_STATUS_FULL;
+
+		if(slave->pending_length) {
+			int pending = slave->pending_length;
+			slave->pending_length = 0;
+			sim_post_mailbox(slave, slave->pending, pending);
+		}
+	}
+
+	return true;
+}
+
+
+static bool sim_write(sim_slave_t *slave, uint32_t address, uint16_t length, const uint8_t *data)
+{
+	sim_sm_t *out = sim_sm(slave, 0);
+
+	if(address + length > (uint32_t) SIM_MEMORY_SIZE)
+		return false;
+
+	// Mailbox can only be written when empty
+	if(sm_overlaps(out, address, length) && (out->status & SM_STATUS_FULL))
+		return false;
+
+	for(int i = 0; i < length; i++) {
+		if(!is_read_only(address + i))
+			slave->memory[address + i] = data[i];
+	}
+
+	if(address <= reg_al_control && address + length > reg_al_control)
+		sim_al_control(slave);
+
+	if(address <= reg_dc_receive_time && address + length > reg_dc_receive_time)
+		sim_dc_latch(slave);
+
+	if(address <= reg_dc_system_time && address + length >= reg_dc_system_time + 8)
+		sim_dc_compensate(slave, ec_get64(data + reg_dc_system_time - address));
+
+	// Writing the last byte hands the mailbox to the slave
+	if(sm_covers_end(out, address, length)) {
+		out->status |= SM_STATUS_FULL;
+		sim_mailbox(slave);
+	}
+
+	return true;
+}
+
+
+static bool get_bit(const uint8_t *data, uint32_t bit)
+{
+	return (data[bit >> 3] >> (bit & 0x07)) & 0x01;
+}
+
+
+static void set_bit(uint8_t *data, uint32_t bit, bool value)
+{
+	if(value)
+		data[bit >> 3] |= (1 << (bit & 0x07));
+	else
+		data[bit >> 3] &= ~(1 << (bit & 0x07));
+}
+
+
+/**
+ * Executes a logical datagram through the FMMUs of a slave. Write
+ * mappings take their data from the frame as it arrived, so a read
+ * mapping of the same logical bits in an LRW sees the old data.
+ */
+static int sim_logical(sim_slave_t *slave, uint8_t command, uint32_t address, uint16_t length, uint8_t *payload)
+{
+	bool read = (command == cmd_lgcl_r || command == cmd_lgcl_rw);
+	bool write = (command == cmd_lgcl_w || command == cmd_lgcl_rw);
+
+	bool did_read = false;
+	bool did_write = false;
+
+	uint8_t original[ETHERCAT_MAX_FRAME];
+	if(write)
+		memcpy(original, payload, length);
+
+	uint64_t frame_first = (uint64_t) address * 8;
+	uint64_t frame_last = frame_first + (uint64_t) length * 8;	// Exclusive
+
+	for(int n = 0; n < SIM_FMMU_COUNT; n++) {
+		sim_fmmu_t *fmmu = sim_fmmu(slave, n);
+
+		if(!(fmmu->activate & 0x01) || fmmu->length == 0)
+			continue;
+
+		bool map_read = read && (fmmu->type & 0x01);
+		bool map_write = write && (fmmu->type & 0x02);
+
+		if(!map_read && !map_write)
+			continue;
+
+		uint64_t first = (uint64_t) fmmu->logical_start * 8 + fmmu->logical_start_bit;
+		uint64_t last = ((uint64_t) fmmu->logical_start + fmmu->length - 1) * 8 + fmmu->logical_end_bit + 1;
+		uint64_t physical = (uint64_t) fmmu->physical_start * 8 + fmmu->physical_start_bit;
+
+		uint64_t from = (first > frame_first)?first:frame_first;
+		uint64_t to = (last < frame_last)?last:frame_last;
+
+		if(from >= to)
+			continue;
+
+		uint32_t count = to - from;
+		uint32_t frame_bit = from - frame_first;
+		uint32_t memory_bit = physical + (from - first);
+
+		if(memory_bit + count > (uint32_t) SIM_MEMORY_SIZE * 8)
+			continue;
+
+		// Whole bytes are copied directly
+		if(((frame_bit | memory_bit | count) & 0x07) == 0) {
+			if(map_write)
+				memcpy(slave->memory + memory_bit / 8, original + frame_bit / 8, count / 8);
+			if(map_read)
+				memcpy(payload + frame_bit / 8, slave->memory + memory_bit / 8, count / 8);
+		} else {
+			for(uint32_t i = 0; i < count; i++) {
+				if(map_write)
+					set_bit(slave->memory, memory_bit + i, get_bit(original, frame_bit + i));
+				if(map_read)
+					set_bit(payload, frame_bit + i, get_bit(slave->memory, memory_bit + i));
+			}
+		}
+
+		did_read |= map_read;
+		did_write |= map_write;
+	}
+
+	return (did_read?1:0) + (did_write?((command == cmd_lgcl_rw)?2:1):0);
+}
+
+
+static void sim_datagram(sim_slave_t *slave, datagram_header_t *header, uint8_t *payload, uint8_t *wkc)
+{
+	uint8_t command = header->command;
+	uint16_t position = header->address.physical.ado;
+	uint16_t offset = header->address.physical.adp;
+	uint16_t length = header->length;
+
+	bool addressed = false;
+	bool merge = false;
+	int increment = 0;
+
+	switch(command) {
+		case cmd_ainc_r:
+		case cmd_ainc_w:
+		case cmd_ainc_rw:
+			addressed = (position == 0);
+			header->address.physical.ado++;
+			break;
+
+		case cmd_cadr_r:
+		case cmd_cadr_w:
+		case cmd_cadr_rw:
+			addressed = (position == ec_get16(slave->memory + reg_station_address));
+			break;
+
+		case cmd_bcst_r:
+		case cmd_bcst_w:
+		case cmd_bcst_rw:
+			addressed = true;
+			merge = true;
+			header->address.physical.ado++;
+			break;
+
+		case cmd_lgcl_r:
+		case cmd_lgcl_w:
+		case cmd_lgcl_rw:
+			increment = sim_logical(slave, command, header->address.logical, length, payload);
+			break;
+
+		// Addressed slave reads, all others write what it read
+		case cmd_ainc_rmw:
+		case cmd_cadr_rmw: {
+			bool reader = (command == cmd_ainc_rmw)?(position == 0):
+				(position == ec_get16(slave->memory + reg_station_address));
+
+			if(command == cmd_ainc_rmw)
+				header->address.physical.ado++;
+
+			if(reader)
+				increment = sim_read(slave, offset, length, payload, false)?1:0;
+			else
+				increment = sim_write(slave, offset, length, payload)?1:0;
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	if(addressed) {
+		switch(command) {
+			case cmd_ainc_r:
+			case cmd_cadr_r:
+			case cmd_bcst_r:
+				increment = sim_read(slave, offset, length, payload, merge)?1:0;
+				break;
+
+			case cmd_ainc_w:
+			case cmd_cadr_w:
+			case cmd_bcst_w:
+				increment = sim_write(slave, offset, length, payload)?1:0;
+				break;
+
+			default: {
+				uint8_t data[ETHERCAT_MAX_FRAME];
+				memcpy(data, payload, length);
+				increment = sim_read(slave, offset, length, payload, merge)?1:0;
+				increment += sim_write(slave, offset, length, data)?2:0;
+				break;
+			}
+		}
+	}
+
+	ec_put16(wkc, ec_get16(wkc) + increment);
+}
+
+
+void ec_sim_process(ethercat_sim_t *sim, uint8_t *frame, int length)
+{
+	if(length < 14 + 2 || frame[12] != (ETHERCAT_TYPE >> 8) || frame[13] != (ETHERCAT_TYPE & 0xFF))
+		return;
+
+	uint8_t *end = frame + length;
+	int64_t now = ec_monotonic_ns();
+
+	for(int s = 0; s < sim->slave_count; s++) {
+		sim_slave_t *slave = &sim->slaves[s];
+		uint8_t *ptr = frame + 14 + 2;
+
+		sim_dc_frame(sim, slave, s, now);
+
+		while(ptr + sizeof(datagram_header_t) + 2 <= end) {
+			datagram_header_t *header = (datagram_header_t *) ptr;
+			uint16_t datagram_length = header->length;
+			uint8_t *payload = ptr + sizeof(datagram_header_t);
+
+			if(payload + datagram_length + 2 > end)
+				break;
+
+			sim_datagram(slave, header, payload, payload + datagram_length);
+
+			ptr = payload + datagram_length + 2;
+			if(!(header->flags & 0x10))
+				break;
+		}
+
+		sim_application(slave);
+	}
+}
+
+
+/*****************************
+ * Constructor and destructor
+ */
+
+static void sim_init_slave(sim_slave_t *slave, int position, bool last)
+{
+	uint8_t *memory = slave->memory;
+
+	memory[reg_type] = 0x11;
+	memory[reg_revision] = 0x00;
+	ec_put16(memory + reg_build, 0x0001);
+	memory[reg_fmmu_count] = SIM_FMMU_COUNT;
+	memory[reg_sm_count] = SIM_SM_COUNT;
+	memory[reg_ram_size] = 8;
+	memory[reg_port_descriptor] = 0x0F;
+	ec_put16(memory + reg_features, 0x0004);
+
+	// PDI operational, link and communication on port 0, port 1 open unless last
+	uint16_t dl_status = 0x0001 | 0x0010 | 0x0200;
+	dl_status |= last?0x0400:(0x0020 | 0x0800);
+	ec_put16(memory + reg_dl_status, dl_status);
+
+	ec_put16(memory + reg_al_status, 0x0001);
+
+	// Default mailbox configuration, as an EEPROM would provide
+	const uint8_t mailbox[] = {
+		0x00, 0x18,  0x00, 0x02,  0x26,  0x00,  0x01, 0x00,
+		0x00, 0x1C,  0x00, 0x02,  0x22,  0x00,  0x01, 0x00
+	};
+	memcpy(memory + reg_sm, mailbox, sizeof(mailbox));
+
+	sim_init_objects(slave, position);
+
+	slave->download.active = false;
+	slave->upload.active = false;
+	slave->pending_length = 0;
+
+	// Clocks started at different times, running up to 50 ppm off
+	slave->last = last;
+	slave->clock_base = (int64_t) (position + 1) * 123456789;
+	slave->drift_ppb = ((position * 7) % 11 - 5) * 10000;
+	slave->slew_ns = 0;
+}
+
+
+ethercat_sim_t *ec_sim_create(int slaves)
+{
+	if(slaves <= 0) {
+		fprintf(stderr, "Invalid number of slaves (%d).\n", slaves);
+		return NULL;
+	}
+
+	ethercat_sim_t *sim = (ethercat_sim_t *) malloc(sizeof(ethercat_sim_t));
+
+	if(sim == NULL) {
+		perror("malloc()");
+		return NULL;
+	}
+
+	sim->slave_count = slaves;
+	sim->start_ns = ec_monotonic_ns();
+	sim->slaves = (sim_slave_t *) calloc(slaves, sizeof(sim_slave_t));
+
+	if(sim->slaves == NULL) {
+		perror("calloc()");
+		free(sim);
+		return NULL;
+	}
+
+	for(int s = 0; s < slaves; s++) {
+		sim->slaves[s].memory = (uint8_t *) calloc(SIM_MEMORY_SIZE, 1);
+
+		if(sim->slaves[s].memory == NULL) {
+			perror("calloc()");
+			ec_sim_destroy(&sim);
+			return NULL;
+		}
+
+		sim_init_slave(&sim->slaves[s], s, s == slaves - 1);
+	}
+
+	return sim;
+}
+
+
+void ec_sim_destroy(ethercat_sim_t **simv)
+{
+	ethercat_sim_t *sim = *simv;
+
+	if(sim) {
+		for(int s = 0; s < sim->slave_count; s++)
+			free(sim->slaves[s].memory);
+		free(sim->slaves);
+		free(sim);
+	}
+	*simv = NULL;
+}
+
+
+int ec_sim_slave_count(const ethercat_sim_t *sim)
+{
+	return sim->slave_count;
+}
+
+
+uint8_t *ec_sim_memory(ethercat_sim_t *sim, int slave)
+{
+	if(slave < 0 || slave >= sim->slave_count)
+		return NULL;
+
+	return sim->slaves[slave].memory;
+}
+
+
+uint8_t *ec_sim_object(ethercat_sim_t *sim, int slave, uint16_t index, uint8_t subindex, uint16_t *length)
+{
+	if(slave < 0 || slave >= sim->slave_count)
+		return NULL;
+
+	sim_object_t *object = sim_find_object(&sim->slaves[slave], index, subindex);
+
+	if(object == NULL)
+		return NULL;
+
+	if(length)
+		*length = object->length;
+
+	return object->data;
+}
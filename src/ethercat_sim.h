@@ -0,0 +1,31 @@
+#ifndef __ETHERCAT_SIM_H__
+#define __ETHERCAT_SIM_H__
+
+#include "ethercat.h"
+
+#include <stdint.h>
+
+/**
+ * Simulated EtherCAT bus. Every slave has a 64 KiB ESC address space
+ * (registers followed by process memory) and executes datagrams the
+ * way an ESC would, including working counters, FMMUs, the AL state
+ * machine and a CoE SDO server behind the mailbox sync managers.
+ * Distributed clocks drift against the host and each other, latch
+ * receive times and compensate drift from ARMW/FRMW writes.
+ *
+ * Used with EC_TRANSPORT_SIM to run the master without hardware.
+ */
+
+ethercat_sim_t *ec_sim_create(int slaves);
+void ec_sim_destroy(ethercat_sim_t **);
+
+int ec_sim_slave_count(const ethercat_sim_t *);
+uint8_t *ec_sim_memory(ethercat_sim_t *, int slave);
+
+// Object dictionary entry of a slave, NULL if it does not exist
+uint8_t *ec_sim_object(ethercat_sim_t *, int slave, uint16_t index, uint8_t subindex, uint16_t *length);
+
+// Passes a frame through all slaves, modifying it in place
+void ec_sim_process(ethercat_sim_t *, uint8_t *frame, int length);
+
+#endif
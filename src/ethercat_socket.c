@@ -6,10 +6,47 @@
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
-#include <netpacket/packet.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/**
+ * Puts an interface in promiscuous mode, responses are addressed to
+ * whatever destination the master used. Returns the interface index.
+ */
+int open_interface(int sock, const char *interface)
+{
+	struct ifreq ifr;
+
+	// Get interface index
+	strncpy(ifr.ifr_name, interface, IFNAMSIZ);
+	if(ioctl(sock, SIOCGIFINDEX, &ifr) == -1) {
+		perror("Could not get interface index.");
+		return -1;
+	}
+	int ifindex = ifr.ifr_ifindex;
+
+	// Get flags
+	ifr.ifr_flags = 0;
+	if(ioctl(sock, SIOCGIFFLAGS, &ifr) == -1) {
+		perror("Could not get socket flags.");
+		return -1;
+	}
+
+	// Update flags
+	ifr.ifr_flags = ifr.ifr_flags | IFF_PROMISC | IFF_BROADCAST;
+	if(ioctl(sock, SIOCSIFFLAGS, &ifr) == -1) {
+		perror("Could not set socket flags.");
+		return -1;
+	}
+
+	return ifindex;
+}
+
 
 int open_socket(const char *interface)
 {
@@ -17,8 +54,6 @@ int open_socket(const char *interface)
 
 	int ifindex;
 
-	struct timeval timeout;
-	struct ifreq ifr;
 	struct sockaddr_ll sll;
 
 	int flag_dont_route = 1;
@@ -31,21 +66,21 @@ int open_socket(const char *interface)
 		return -1;
 	}
 
-	// Set timeout to 1 microsecond
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 1;
-
-	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
-		perror("Could not set receive timeout.");
+	// Never block, receive deadlines are handled by the caller
+	int fl = fcntl(sock, F_GETFL);
+	if(fl == -1 || fcntl(sock, F_SETFL, fl | O_NONBLOCK) == -1) {
+		perror("Could not make socket non-blocking.");
 		close(sock);
 		return -1;
 	}
 
-	if(setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
-		perror("Could not set transmit timeout.");
-		close(sock);
-		return -1;
+	// Do not loop our own frames back to the receive queue
+#ifdef PACKET_IGNORE_OUTGOING
+	int flag_ignore_outgoing = 1;
+	if(setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &flag_ignore_outgoing, sizeof(flag_ignore_outgoing)) == -1) {
+		perror("Could not ignore outgoing frames.");
 	}
+#endif
 
 	// Disable routing
 	if(setsockopt(sock, SOL_SOCKET, SO_DONTROUTE, &flag_dont_route, sizeof(flag_dont_route)) == -1) {
@@ -54,42 +89,196 @@ int open_socket(const char *interface)
 		return -1;
 	}
 
-	// Get interface index
-	strncpy(ifr.ifr_name, interface, IFNAMSIZ);
-	if(ioctl(sock, SIOCGIFINDEX, &ifr) == -1) {
-		perror("Could not get interface index.");
+	ifindex = open_interface(sock, interface);
+	if(ifindex == -1) {
 		close(sock);
 		return -1;
 	}
-	ifindex = ifr.ifr_ifindex;
 
-	// Get flags
-	ifr.ifr_flags = 0;
-	if(ioctl(sock, SIOCGIFFLAGS, &ifr) == -1) {
-		perror("Could not get socket flags.");
+	// Bind socket
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = ifindex;
+	sll.sll_protocol = htons(ETHERCAT_TYPE);
+
+	if(bind(sock, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+		perror("Could not bind socket");
 		close(sock);
 		return -1;
 	}
 
-	// Update flags
-	ifr.ifr_flags = ifr.ifr_flags | IFF_PROMISC | IFF_BROADCAST;
-	if(ioctl(sock, SIOCSIFFLAGS, &ifr) == -1) {
-		perror("Could not set socket flags.");
+	return sock;
+}
+
+
+
+/********************
+ * Memory mapped ring
+ */
+
+static const unsigned int RING_FRAME_SIZE = 2048;
+static const unsigned int RING_BLOCK_SIZE = 4096;
+static const unsigned int RING_FRAME_NR = 128;
+
+
+static tpacket2_hdr *ring_frame(uint8_t *ring_base, const ethercat_ring_t *ring, unsigned int index)
+{
+	return (tpacket2_hdr *) (ring_base + (index % ring->frame_nr) * ring->frame_size);
+}
+
+
+int open_ring(const char *interface, ethercat_ring_t *ring)
+{
+	int sock = open_socket(interface);
+
+	if(sock == -1)
+		return -1;
+
+	// Version 2 hands over every frame individually, version 3 only
+	// returns blocks once full or after a timeout of at least 1 ms.
+	int version = TPACKET_V2;
+	if(setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+		perror("Could not set packet version.");
 		close(sock);
 		return -1;
 	}
 
-	// Bind socket
-	sll.sll_family = AF_PACKET;
-	sll.sll_ifindex = ifindex;
-	sll.sll_protocol = htons(ETHERCAT_TYPE);
+	struct tpacket_req req;
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = RING_FRAME_NR;
+	req.tp_block_nr = (RING_FRAME_NR * RING_FRAME_SIZE) / RING_BLOCK_SIZE;
 
-	if(bind(sock, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
-		perror("Could not bind socket");
+	if(setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+		perror("Could not create receive ring.");
 		close(sock);
 		return -1;
 	}
 
-	return sock;
+	if(setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1) {
+		perror("Could not create transmit ring.");
+		close(sock);
+		return -1;
+	}
+
+	// Transmit straight to the driver, there is no other traffic to queue with
+	int flag_bypass = 1;
+	if(setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &flag_bypass, sizeof(flag_bypass)) == -1) {
+		perror("Could not bypass queueing discipline.");
+	}
+
+	size_t ring_length = req.tp_block_size * req.tp_block_nr;
+
+	// Receive ring is mapped first, followed by the transmit ring
+	void *map = mmap(NULL, 2 * ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sock, 0);
+
+	if(map == MAP_FAILED) {
+		perror("Could not map packet rings.");
+		close(sock);
+		return -1;
+	}
+
+	ring->socket = sock;
+	ring->map = (uint8_t *) map;
+	ring->map_length = 2 * ring_length;
+	ring->frame_size = req.tp_frame_size;
+	ring->frame_nr = req.tp_frame_nr;
+	ring->rx_ring = ring->map;
+	ring->rx_head = 0;
+	ring->rx_held = 0;
+	ring->tx_ring = ring->map + ring_length;
+	ring->tx_head = 0;
+
+	return 0;
+}
+
+
+void close_ring(ethercat_ring_t *ring)
+{
+	munmap(ring->map, ring->map_length);
+	close(ring->socket);
+}
+
+
+/**
+ * Returns the data area of the next free transmit slot,
+ * or NULL if the kernel has not yet sent the whole ring.
+ */
+uint8_t *ring_acquire(ethercat_ring_t *ring)
+{
+	tpacket2_hdr *hdr = ring_frame(ring->tx_ring, ring, ring->tx_head);
+
+	if(hdr->tp_status != TP_STATUS_AVAILABLE)
+		return NULL;
+
+	return ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+}
+
+
+/**
+ * Hands the slot returned by ring_acquire to the kernel.
+ */
+void ring_commit(ethercat_ring_t *ring, uint8_t *buffer, int length)
+{
+	tpacket2_hdr *hdr = ring_frame(ring->tx_ring, ring, ring->tx_head);
+
+	hdr->tp_len = length;
+	hdr->tp_snaplen = length;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+	ring->tx_head++;
 }
 
+
+/**
+ * Transmits all committed slots.
+ */
+int ring_flush(ethercat_ring_t *ring)
+{
+	if(send(ring->socket, NULL, 0, MSG_DONTWAIT) == -1) {
+		perror("send()");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Returns the length of the next received frame and points buffer
+ * at it, or returns -1 if no frame is ready (errno EAGAIN) or all
+ * slots are held (errno ENOBUFS). Frames remain valid until
+ * ring_release is called.
+ */
+int ring_receive(ethercat_ring_t *ring, uint8_t **buffer)
+{
+	// Never let held frames be overtaken by the kernel
+	if(ring->rx_head - ring->rx_held >= ring->frame_nr) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	tpacket2_hdr *hdr = ring_frame(ring->rx_ring, ring, ring->rx_head);
+
+	if((__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ring->rx_head++;
+
+	*buffer = ((uint8_t *) hdr) + hdr->tp_mac;
+	return hdr->tp_snaplen;
+}
+
+
+/**
+ * Returns all received frames to the kernel.
+ */
+void ring_release(ethercat_ring_t *ring)
+{
+	while(ring->rx_held != ring->rx_head) {
+		tpacket2_hdr *hdr = ring_frame(ring->rx_ring, ring, ring->rx_held);
+		__atomic_store_n(&hdr->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		ring->rx_held++;
+	}
+}
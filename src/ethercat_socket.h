@@ -1,6 +1,44 @@
 #ifndef __ETHERCAT_SOCKET_H__
+#define __ETHERCAT_SOCKET_H__
 
+#include <stdint.h>
+#include <stddef.h>
+
+int open_interface(int sock, const char *interface);
 int open_socket(const char *interface);
 
-#endif
 
+/**
+ * Memory mapped packet socket with a receive and transmit ring,
+ * frames are built and decoded in the ring without system calls
+ * except for the one that kicks off transmission.
+ */
+struct ethercat_ring_t
+{
+	int socket;
+
+	uint8_t *map;
+	size_t map_length;
+
+	unsigned int frame_size;
+	unsigned int frame_nr;
+
+	uint8_t *rx_ring;
+	unsigned int rx_head;
+	unsigned int rx_held;
+
+	uint8_t *tx_ring;
+	unsigned int tx_head;
+};
+
+int open_ring(const char *interface, ethercat_ring_t *ring);
+void close_ring(ethercat_ring_t *ring);
+
+uint8_t *ring_acquire(ethercat_ring_t *ring);
+void ring_commit(ethercat_ring_t *ring, uint8_t *buffer, int length);
+int ring_flush(ethercat_ring_t *ring);
+
+int ring_receive(ethercat_ring_t *ring, uint8_t **buffer);
+void ring_release(ethercat_ring_t *ring);
+
+#endif
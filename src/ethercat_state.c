@@ -0,0 +1,183 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// AL status bits
+static const uint16_t AL_STATE_MASK = 0x000F;
+static const uint16_t AL_ERROR = 0x0010;
+
+
+// AL status and status code of one slave
+struct state_slave_t
+{
+	uint8_t status[6];	// Registers 0x0130 to 0x0135
+	uint16_t wkc;
+};
+
+
+static void sleep_us(int us)
+{
+	struct timespec delay;
+	delay.tv_sec = us / 1000000;
+	delay.tv_nsec = (us % 1000000) * 1000;
+
+	while(nanosleep(&delay, &delay) == -1 && errno == EINTR) { }
+}
+
+
+static address_t slave_address(const uint16_t *stations, int i, uint16_t reg)
+{
+	address_t address;
+	address.physical.ado = stations?stations[i]:(uint16_t) -i;
+	address.physical.adp = reg;
+	return address;
+}
+
+
+/**
+ * Reads AL status and status code of every slave in one frame and
+ * reports the ones with the error flag set.
+ */
+static void report_errors(ethercat_t *ethercat, ethercat_batch_t *batch, const uint16_t *stations, int count,
+	state_slave_t *slaves)
+{
+	for(int i = 0; i < count; i++) {
+		slaves[i].wkc = 0;
+		ec_batch_add(ethercat, batch, ec_request_read_to(ethercat, slave_address(stations, i, reg_al_status), 6,
+			slaves[i].status, &slaves[i].wkc, EC_CALL_ONESHOT | (stations?0:EC_ADDR_AI)), NULL, 0);
+	}
+
+	if(ec_batch_run(ethercat, batch, "reading AL status codes") == -1)
+		return;
+
+	for(int i = 0; i < count; i++) {
+		const uint8_t *status = slaves[i].status;
+
+		if(slaves[i].wkc != 1) {
+			fprintf(stderr, "Slave %d did not answer.\n", i);
+		} else if(status[0] & AL_ERROR) {
+			fprintf(stderr, "Slave %d is in state %02x with AL status code %04x.\n",
+				i, status[0] & AL_STATE_MASK, ec_get16(status + 4));
+		}
+	}
+}
+
+
+/**
+ * Requests an AL state (0x0120) and waits until the slaves have reached
+ * it. With stations set to NULL all count slaves are addressed with
+ * BWR/BRD and checked through the working counter and the OR'ed state,
+ * otherwise the given stations are written and read with FPWR/FPRD,
+ * all in one frame. The OR'ed state only tells a single state bit apart
+ * from a mix of states, for Boot the slaves are read one by one with
+ * APRD instead.
+ *
+ * Polls every interval_us and gives up after timeout_ms. A slave with
+ * the error flag set fails the transition, unless state includes the
+ * error acknowledge bit. Errors and their AL status codes are printed.
+ * Lost frames are sent again, when the bus stays silent for a few
+ * cycles the transition fails.
+ *
+ * Blocks, must not be called while the cyclic executor is running.
+ */
+int ec_set_state(ethercat_t *ethercat, const uint16_t *stations, int count, uint16_t state,
+	int interval_us, int timeout_ms)
+{
+	if(count <= 0) {
+		fprintf(stderr, "Invalid number of slaves (%d).\n", count);
+		return -1;
+	}
+
+	// Init, PreOp, SafeOp and Op are single bits, Boot is 0x03
+	uint16_t target = state & AL_STATE_MASK;
+	bool combined = !stations && target && !(target & (target - 1));
+	int poll_count = combined?1:count;
+	int poll_flags = stations?0:(combined?EC_ADDR_BR:EC_ADDR_AI);
+	state_slave_t *slaves = (state_slave_t *) calloc(count, sizeof(state_slave_t));
+
+	if(slaves == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	ethercat_batch_t batch;
+	ec_batch_init(&batch);
+
+	uint8_t control[2];
+	ec_put16(control, state);
+
+	if(stations) {
+		for(int i = 0; i < count; i++)
+			ec_batch_add(ethercat, &batch, ec_request_write_from(ethercat, slave_address(stations, i, reg_al_control),
+				2, control, EC_CALL_ONESHOT), NULL, 0);
+	} else {
+		ec_batch_add(ethercat, &batch, ec_request_write_from(ethercat, slave_address(NULL, 0, reg_al_control), 2,
+			control, EC_CALL_ONESHOT | EC_ADDR_BR), NULL, 0);
+	}
+
+	if(ec_batch_run(ethercat, &batch, "requesting the state") == -1) {
+		ec_batch_free(ethercat, &batch);
+		free(slaves);
+		return -1;
+	}
+
+	int64_t deadline = ec_monotonic_ns() + (int64_t) timeout_ms * 1000000;
+	uint16_t expected = combined?count:1;
+	bool acknowledge = (state & AL_ERROR);
+	int result = -1;
+
+	while(true) {
+		// Broadcast reads take 2 bytes, the OR'ed status code is meaningless
+		for(int i = 0; i < poll_count; i++) {
+			slaves[i].wkc = 0;
+			ec_batch_add(ethercat, &batch, ec_request_read_to(ethercat, slave_address(stations, i, reg_al_status),
+				combined?2:6, slaves[i].status, &slaves[i].wkc, EC_CALL_ONESHOT | poll_flags), NULL, 0);
+		}
+
+		if(ec_batch_run(ethercat, &batch, "polling the state") == -1)
+			break;
+
+		int pending = -1;
+		bool error = false;
+
+		for(int i = 0; i < poll_count; i++) {
+			uint8_t status = slaves[i].status[0];
+
+			if(slaves[i].wkc != expected || (status & (AL_STATE_MASK | AL_ERROR)) != target) {
+				if(pending == -1)
+					pending = i;
+			}
+			if(slaves[i].wkc && (status & AL_ERROR) && !acknowledge)
+				error = true;
+		}
+
+		if(pending == -1) {
+			result = 0;
+			break;
+		}
+
+		if(error) {
+			fprintf(stderr, "State %02x was refused.\n", state);
+			report_errors(ethercat, &batch, stations, count, slaves);
+			break;
+		}
+
+		if(ec_monotonic_ns() > deadline) {
+			fprintf(stderr, "Timeout waiting for state %02x (state %02x, wkc %d of %d).\n",
+				state, slaves[pending].status[0], slaves[pending].wkc, expected);
+			break;
+		}
+
+		if(interval_us > 0)
+			sleep_us(interval_us);
+	}
+
+	ec_batch_free(ethercat, &batch);
+	free(slaves);
+	return result;
+}
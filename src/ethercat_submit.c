@@ -0,0 +1,242 @@
+#include "ethercat.h"
+#include "ethercat_internal.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+// Submission states, the futex word
+static const uint32_t SUBMIT_PENDING = 0;
+static const uint32_t SUBMIT_DONE = 1;
+static const uint32_t SUBMIT_WAITING = 2;	// Pending with a thread asleep on it
+
+// Flags a submission may carry, it is always a one-shot
+static const int SUBMIT_FLAGS = EC_ADDR_AI | EC_ADDR_CA | EC_ADDR_BR | EC_ADDR_LG | EC_CALL_LOW_PRIORITY;
+
+
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+
+/**
+ * Publishes the result, only enters the kernel if a thread waits and
+ * then wakes all of them, several threads may wait on one submission.
+ */
+static void complete(ec_submission_t *submission, int result)
+{
+	submission->result = result;
+
+	if(__atomic_exchange_n(&submission->state, SUBMIT_DONE, __ATOMIC_RELEASE) == SUBMIT_WAITING)
+		futex(&submission->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+
+static void write_submission(const address_t address, void *payload, uint16_t length, void *data)
+{
+	memcpy(data, ((ec_submission_t *) payload)->data, length);
+}
+
+
+static void read_submission(const address_t address, void *payload, uint16_t length, const void *data)
+{
+	ec_submission_t *submission = (ec_submission_t *) payload;
+	const uint8_t *tmp = (const uint8_t *) data;
+
+	if(!submission->write)
+		memcpy(submission->data, data, length);
+
+	submission->wkc = tmp[length] | (tmp[length + 1] << 8);
+	complete(submission, 0);
+}
+
+
+/**
+ * Pushes onto the shared list with a compare-and-swap, any number of
+ * threads may submit while the cycling thread takes the list.
+ */
+static int submit(ethercat_t *ethercat, ec_submission_t *submission)
+{
+	if(submission->length > ETHERCAT_MAX_PAYLOAD) {
+		fprintf(stderr, "Request of %d bytes does not fit in a frame.\n", submission->length);
+		return -1;
+	}
+
+	submission->wkc = 0;
+	submission->result = -1;
+	__atomic_store_n(&submission->state, SUBMIT_PENDING, __ATOMIC_RELAXED);
+
+	ec_submission_t *head = __atomic_load_n(&ethercat->submissions, __ATOMIC_RELAXED);
+
+	do {
+		submission->next = head;
+	} while(!__atomic_compare_exchange_n(&ethercat->submissions, &head, submission, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+
+int ec_submit_read(ethercat_t *ethercat, ec_submission_t *submission, const address_t address,
+	uint16_t length, void *data, int flags)
+{
+	submission->address = address;
+	submission->length = length;
+	submission->flags = flags & SUBMIT_FLAGS;
+	submission->write = false;
+	submission->data = data;
+
+	return submit(ethercat, submission);
+}
+
+
+int ec_submit_write(ethercat_t *ethercat, ec_submission_t *submission, const address_t address,
+	uint16_t length, const void *data, int flags)
+{
+	submission->address = address;
+	submission->length = length;
+	submission->flags = flags & SUBMIT_FLAGS;
+	submission->write = true;
+	submission->data = (void *) data;
+
+	return submit(ethercat, submission);
+}
+
+
+/**
+ * Waits until the submission is done, sleeping on the futex after a
+ * first check. Returns -1 on timeout, the submission stays queued.
+ */
+int ec_wait(ec_submission_t *submission, int timeout_us)
+{
+	int64_t deadline = ec_monotonic_ns() + (int64_t) timeout_us * 1000;
+
+	while(true) {
+		uint32_t state = __atomic_load_n(&submission->state, __ATOMIC_ACQUIRE);
+
+		if(state == SUBMIT_DONE)
+			return 0;
+
+		if(timeout_us == 0)
+			return -1;
+
+		if(state == SUBMIT_PENDING &&
+		   !__atomic_compare_exchange_n(&submission->state, &state, SUBMIT_WAITING, false,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			continue;
+
+		struct timespec timeout;
+		struct timespec *wait = NULL;
+
+		if(timeout_us > 0) {
+			int64_t remaining = deadline - ec_monotonic_ns();
+			if(remaining <= 0)
+				return -1;
+
+			timeout.tv_sec = remaining / 1000000000;
+			timeout.tv_nsec = remaining % 1000000000;
+			wait = &timeout;
+		}
+
+		if(futex(&submission->state, FUTEX_WAIT_PRIVATE, SUBMIT_WAITING, wait) == -1 &&
+		   errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			perror("futex()");
+			return -1;
+		}
+	}
+}
+
+
+/**
+ * Takes over everything submitted since the last cycle and turns as many
+ * submissions into one-shot operations as the table has room for, in
+ * the order they were submitted. Never blocks.
+ */
+void ec_submit_cycle(ethercat_t *ethercat)
+{
+	ec_submission_t *list = __atomic_exchange_n(&ethercat->submissions, NULL, __ATOMIC_ACQUIRE);
+
+	// The list is newest first
+	ec_submission_t *ordered = NULL;
+	ec_submission_t *last = list;
+
+	while(list) {
+		ec_submission_t *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	if(ordered) {
+		if(ethercat->backlog_tail)
+			ethercat->backlog_tail->next = ordered;
+		else
+			ethercat->backlog = ordered;
+		ethercat->backlog_tail = last;
+	}
+
+	while(ethercat->backlog && ethercat->operations.free != -1) {
+		ec_submission_t *submission = ethercat->backlog;
+
+		ethercat->backlog = submission->next;
+		if(ethercat->backlog == NULL)
+			ethercat->backlog_tail = NULL;
+
+		int flags = submission->flags | EC_CALL_ONESHOT;
+		ec_handle_t handle;
+
+		if(submission->write)
+			handle = ec_request_write(ethercat, submission->address, submission->length, write_submission,
+				submission, flags);
+		else
+			handle = ec_request_read(ethercat, submission->address, submission->length, read_submission,
+				submission, flags);
+
+		if(handle == -1) {
+			complete(submission, -1);
+			continue;
+		}
+
+		// Writes learn their working counter through a read callback,
+		// in place from the first cycle the write is sent in
+		if(submission->write)
+			ethercat->operations.info[ec_find_operation(ethercat, handle)].read_callback = read_submission;
+	}
+}
+
+
+/**
+ * Fails all submissions that have not completed, queued or in the table.
+ */
+void ec_free_submissions(ethercat_t *ethercat)
+{
+	ec_submission_t *lists[2] = { __atomic_exchange_n(&ethercat->submissions, NULL, __ATOMIC_ACQUIRE),
+		ethercat->backlog };
+
+	for(int l = 0; l < 2; l++) {
+		while(lists[l]) {
+			ec_submission_t *submission = lists[l];
+			lists[l] = submission->next;
+			complete(submission, -1);
+		}
+	}
+
+	ethercat->backlog = NULL;
+	ethercat->backlog_tail = NULL;
+
+	ethercat_operations_t *operations = &ethercat->operations;
+
+	for(int i = 0; i < operations->limit; i++) {
+		const ethercat_operation_t *info = &operations->info[i];
+
+		if(operations->command[i] != cmd_noop &&
+		   (info->read_callback == read_submission || info->write_callback == write_submission))
+			complete((ec_submission_t *) info->payload, -1);
+	}
+}
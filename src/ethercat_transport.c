@@ -0,0 +1,474 @@
+#include "ethercat_internal.h"
+#include "ethercat_transport.h"
+#include "ethercat_socket.h"
+#include "ethercat_xdp.h"
+#include "ethercat_sim.h"
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static int wait_socket(int sock, int64_t timeout_ns)
+{
+	struct pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ns / 1000000000;
+	timeout.tv_nsec = timeout_ns % 1000000000;
+
+	ppoll(&pfd, 1, &timeout, NULL);
+	return 0;
+}
+
+
+/****************
+ * Packet socket
+ */
+
+struct socket_state_t
+{
+	int socket;
+};
+
+
+static int socket_send(void *state, uint8_t *buffer, int length)
+{
+	socket_state_t *s = (socket_state_t *) state;
+
+	if(send(s->socket, buffer, length, MSG_DONTROUTE | MSG_DONTWAIT) == -1) {
+		perror("send()");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int socket_receive(void *state, uint8_t **buffer)
+{
+	socket_state_t *s = (socket_state_t *) state;
+	return recv(s->socket, *buffer, ETHERCAT_MAX_FRAME, MSG_DONTWAIT);
+}
+
+
+static int socket_wait(void *state, int64_t timeout_ns)
+{
+	return wait_socket(((socket_state_t *) state)->socket, timeout_ns);
+}
+
+
+static void socket_close(void *state)
+{
+	socket_state_t *s = (socket_state_t *) state;
+	close(s->socket);
+	free(s);
+}
+
+
+static const ethercat_transport_ops_t socket_ops = {
+	NULL, NULL, socket_send, NULL, socket_receive, socket_wait, NULL, socket_close
+};
+
+
+/****************
+ * Packet ring
+ */
+
+static uint8_t *mmap_acquire(void *state)
+{
+	return ring_acquire((ethercat_ring_t *) state);
+}
+
+
+static int mmap_send(void *state, uint8_t *buffer, int length)
+{
+	ring_commit((ethercat_ring_t *) state, buffer, length);
+	return 0;
+}
+
+
+static int mmap_flush(void *state)
+{
+	return ring_flush((ethercat_ring_t *) state);
+}
+
+
+static int mmap_receive(void *state, uint8_t **buffer)
+{
+	return ring_receive((ethercat_ring_t *) state, buffer);
+}
+
+
+static int mmap_wait(void *state, int64_t timeout_ns)
+{
+	return wait_socket(((ethercat_ring_t *) state)->socket, timeout_ns);
+}
+
+
+static void mmap_release(void *state)
+{
+	ring_release((ethercat_ring_t *) state);
+}
+
+
+static void mmap_close(void *state)
+{
+	close_ring((ethercat_ring_t *) state);
+	free(state);
+}
+
+
+static const ethercat_transport_ops_t mmap_ops = {
+	mmap_acquire, NULL, mmap_send, mmap_flush, mmap_receive, mmap_wait, mmap_release, mmap_close
+};
+
+
+/****************
+ * AF_XDP
+ */
+
+static uint8_t *xdp_ops_acquire(void *state)
+{
+	return xdp_acquire((ethercat_xdp_t *) state);
+}
+
+
+static uint8_t *xdp_ops_frame(void *state, int index)
+{
+	return xdp_template((ethercat_xdp_t *) state, index);
+}
+
+
+static int xdp_ops_send(void *state, uint8_t *buffer, int length)
+{
+	return xdp_commit((ethercat_xdp_t *) state, buffer, length);
+}
+
+
+static int xdp_ops_flush(void *state)
+{
+	return xdp_flush((ethercat_xdp_t *) state);
+}
+
+
+static int xdp_ops_receive(void *state, uint8_t **buffer)
+{
+	int nbytes = xdp_receive((ethercat_xdp_t *) state, buffer);
+	if(nbytes == -1)
+		errno = EAGAIN;
+	return nbytes;
+}
+
+
+static void xdp_ops_release(void *state)
+{
+	xdp_release((ethercat_xdp_t *) state);
+}
+
+
+static void xdp_ops_close(void *state)
+{
+	close_xdp((ethercat_xdp_t *) state);
+	free(state);
+}
+
+
+// No wait operation, the receive path busy-polls
+static const ethercat_transport_ops_t xdp_ops = {
+	xdp_ops_acquire, xdp_ops_frame, xdp_ops_send, xdp_ops_flush, xdp_ops_receive, NULL, xdp_ops_release,
+	xdp_ops_close
+};
+
+
+/*********************************
+ * In-process loopback and simulator
+ */
+
+static const unsigned int QUEUE_INITIAL_NR = 64;
+
+/**
+ * Frames are built directly in queue slots, processed by the
+ * simulated bus (if any) when sent and returned in order. The
+ * queue grows when a cycle sends more frames than it holds.
+ */
+struct queue_state_t
+{
+	ethercat_sim_t *sim;
+
+	// Slot buffers never move, the number of slots is a power of two
+	uint8_t **slots;
+	int *length;
+	unsigned int slot_nr;
+
+	unsigned int base;	// Oldest slot still handed out
+	unsigned int head;	// Next slot to receive
+	unsigned int tail;	// Next slot to send
+};
+
+
+static uint8_t *queue_slot(queue_state_t *s, unsigned int index)
+{
+	return s->slots[index % s->slot_nr];
+}
+
+
+static void free_slots(uint8_t **slots, unsigned int count)
+{
+	for(unsigned int i = 0; slots && i < count; i++)
+		free(slots[i]);
+	free(slots);
+}
+
+
+/**
+ * Doubles the number of slots of a full queue. The buffers handed out
+ * keep their place in the order, only new ones are allocated.
+ */
+static int queue_grow(queue_state_t *s)
+{
+	unsigned int slot_nr = 2 * s->slot_nr;
+	uint8_t **slots = (uint8_t **) calloc(slot_nr, sizeof(uint8_t *));
+	int *length = (int *) calloc(slot_nr, sizeof(int));
+
+	if(slots == NULL || length == NULL) {
+		perror("calloc()");
+		free(slots);
+		free(length);
+		return -1;
+	}
+
+	for(unsigned int index = s->base; index != s->tail; index++) {
+		slots[index % slot_nr] = s->slots[index % s->slot_nr];
+		length[index % slot_nr] = s->length[index % s->slot_nr];
+	}
+
+	for(unsigned int i = 0; i < slot_nr; i++) {
+		if(slots[i] == NULL && posix_memalign((void **) &slots[i], ETHERCAT_ALIGNMENT, ETHERCAT_MAX_FRAME) != 0) {
+			perror("posix_memalign()");
+
+			// Only free the new buffers
+			for(unsigned int index = s->base; index != s->tail; index++)
+				slots[index % slot_nr] = NULL;
+			free_slots(slots, slot_nr);
+			free(length);
+			return -1;
+		}
+	}
+
+	free(s->slots);
+	free(s->length);
+	s->slots = slots;
+	s->length = length;
+	s->slot_nr = slot_nr;
+
+	return 0;
+}
+
+
+static uint8_t *queue_acquire(void *state)
+{
+	queue_state_t *s = (queue_state_t *) state;
+
+	if(s->tail - s->base >= s->slot_nr && queue_grow(s) == -1)
+		return NULL;
+
+	return queue_slot(s, s->tail);
+}
+
+
+static int queue_send(void *state, uint8_t *buffer, int length)
+{
+	queue_state_t *s = (queue_state_t *) state;
+
+	if(s->sim)
+		ec_sim_process(s->sim, buffer, length);
+
+	s->length[s->tail % s->slot_nr] = length;
+	s->tail++;
+
+	return 0;
+}
+
+
+static int queue_receive(void *state, uint8_t **buffer)
+{
+	queue_state_t *s = (queue_state_t *) state;
+
+	if(s->head == s->tail) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	*buffer = queue_slot(s, s->head);
+	return s->length[s->head++ % s->slot_nr];
+}
+
+
+// Everything sent has already been returned
+static int queue_wait(void *state, int64_t timeout_ns)
+{
+	return -1;
+}
+
+
+static void queue_release(void *state)
+{
+	queue_state_t *s = (queue_state_t *) state;
+	s->base = s->head;
+}
+
+
+static void queue_close(void *state)
+{
+	queue_state_t *s = (queue_state_t *) state;
+	free_slots(s->slots, s->slot_nr);
+	free(s->length);
+	free(s);
+}
+
+
+static const ethercat_transport_ops_t queue_ops = {
+	queue_acquire, NULL, queue_send, NULL, queue_receive, queue_wait, queue_release, queue_close
+};
+
+
+static queue_state_t *open_queue(ethercat_sim_t *sim)
+{
+	queue_state_t *s = (queue_state_t *) calloc(1, sizeof(queue_state_t));
+
+	if(s == NULL) {
+		perror("calloc()");
+		return NULL;
+	}
+
+	s->sim = sim;
+	s->slot_nr = QUEUE_INITIAL_NR;
+	s->slots = (uint8_t **) calloc(s->slot_nr, sizeof(uint8_t *));
+	s->length = (int *) calloc(s->slot_nr, sizeof(int));
+
+	if(s->slots == NULL || s->length == NULL) {
+		perror("calloc()");
+		queue_close(s);
+		return NULL;
+	}
+
+	for(unsigned int i = 0; i < s->slot_nr; i++) {
+		if(posix_memalign((void **) &s->slots[i], ETHERCAT_ALIGNMENT, ETHERCAT_MAX_FRAME) != 0) {
+			perror("posix_memalign()");
+			queue_close(s);
+			return NULL;
+		}
+	}
+
+	s->base = s->head = s->tail = 0;
+	return s;
+}
+
+
+/**********
+ * Factory
+ */
+
+int open_transport(const char *device, const ec_options_t *options, ethercat_transport_t *transport)
+{
+	transport->ops = NULL;
+	transport->state = NULL;
+
+	switch(options->transport) {
+		case EC_TRANSPORT_SOCKET: {
+			socket_state_t *s = (socket_state_t *) malloc(sizeof(socket_state_t));
+			if(s == NULL) {
+				perror("malloc()");
+				return -1;
+			}
+
+			s->socket = open_socket(device);
+			if(s->socket == -1) {
+				free(s);
+				return -1;
+			}
+
+			transport->ops = &socket_ops;
+			transport->state = s;
+			return 0;
+		}
+
+		case EC_TRANSPORT_MMAP: {
+			ethercat_ring_t *ring = (ethercat_ring_t *) malloc(sizeof(ethercat_ring_t));
+			if(ring == NULL) {
+				perror("malloc()");
+				return -1;
+			}
+
+			if(open_ring(device, ring) == -1) {
+				free(ring);
+				return -1;
+			}
+
+			transport->ops = &mmap_ops;
+			transport->state = ring;
+			return 0;
+		}
+
+		case EC_TRANSPORT_XDP: {
+			ethercat_xdp_t *xdp = (ethercat_xdp_t *) malloc(sizeof(ethercat_xdp_t));
+			if(xdp == NULL) {
+				perror("malloc()");
+				return -1;
+			}
+
+			if(open_xdp(device, xdp) == -1) {
+				free(xdp);
+				return -1;
+			}
+
+			transport->ops = &xdp_ops;
+			transport->state = xdp;
+			return 0;
+		}
+
+		case EC_TRANSPORT_LOOPBACK:
+		case EC_TRANSPORT_SIM: {
+			ethercat_sim_t *sim = NULL;
+
+			if(options->transport == EC_TRANSPORT_SIM) {
+				sim = options->simulator;
+				if(sim == NULL) {
+					fprintf(stderr, "Simulated transport requires a simulator.\n");
+					return -1;
+				}
+			}
+
+			queue_state_t *s = open_queue(sim);
+			if(s == NULL)
+				return -1;
+
+			transport->ops = &queue_ops;
+			transport->state = s;
+			return 0;
+		}
+
+		default:
+			fprintf(stderr, "Unknown transport (%d).\n", options->transport);
+			return -1;
+	}
+}
+
+
+void close_transport(ethercat_transport_t *transport)
+{
+	if(transport->ops)
+		transport->ops->close(transport->state);
+
+	transport->ops = NULL;
+	transport->state = NULL;
+}
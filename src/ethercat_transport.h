@@ -0,0 +1,51 @@
+#ifndef __ETHERCAT_TRANSPORT_H__
+#define __ETHERCAT_TRANSPORT_H__
+
+#include "ethercat.h"
+
+#include <stdint.h>
+
+
+/**
+ * Operations every transport implements. Optional operations
+ * may be NULL:
+ *
+ *  acquire  Returns a buffer to build the next frame in, when NULL
+ *           frames are sent straight from the frame templates.
+ *  frame    Returns a buffer of the transport to keep frame template
+ *           number index in for good, or NULL for a heap buffer. Such
+ *           templates are passed to send without acquiring a buffer.
+ *  send     Queues (or sends) a frame of the given length.
+ *  flush    Transmits all queued frames.
+ *  receive  Returns the length of the next frame and points buffer
+ *           at it. On entry buffer points at scratch memory the
+ *           transport may receive into. Returns -1 and sets errno
+ *           to EAGAIN when nothing is available.
+ *  wait     Waits at most timeout_ns for a frame to arrive. Returns
+ *           -1 if no frame can arrive anymore. When NULL the caller
+ *           busy-polls receive.
+ *  release  Invalidates all frames returned by receive.
+ *  close    Releases all resources held by the transport.
+ */
+struct ethercat_transport_ops_t
+{
+	uint8_t *(*acquire)(void *state);
+	uint8_t *(*frame)(void *state, int index);
+	int (*send)(void *state, uint8_t *buffer, int length);
+	int (*flush)(void *state);
+	int (*receive)(void *state, uint8_t **buffer);
+	int (*wait)(void *state, int64_t timeout_ns);
+	void (*release)(void *state);
+	void (*close)(void *state);
+};
+
+struct ethercat_transport_t
+{
+	const ethercat_transport_ops_t *ops;
+	void *state;
+};
+
+int open_transport(const char *device, const ec_options_t *options, ethercat_transport_t *transport);
+void close_transport(ethercat_transport_t *transport);
+
+#endif
@@ -0,0 +1,601 @@
+#include "ethercat_internal.h"
+#include "ethercat_socket.h"
+#include "ethercat_xdp.h"
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+static const unsigned int XDP_FRAME_SIZE = 2048;
+static const unsigned int XDP_FRAME_NR = 256;
+static const unsigned int XDP_RING_SIZE = 128;
+static const int XDP_BUSY_POLL_US = 20;
+
+
+/*******************
+ * BPF program
+ */
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+static bpf_insn bpf_op(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	bpf_insn insn;
+	insn.code = code;
+	insn.dst_reg = dst;
+	insn.src_reg = src;
+	insn.off = off;
+	insn.imm = imm;
+	return insn;
+}
+
+
+/**
+ * Loads a program that redirects EtherCAT frames to the socket
+ * registered for the receive queue and passes everything else.
+ */
+static int load_program(int map_fd)
+{
+	const uint8_t R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4, R5 = 5;
+
+	bpf_insn insns[] = {
+		bpf_op(BPF_LDX | BPF_MEM | BPF_W, R2, R1, 0, 0),	// r2 = ctx->data
+		bpf_op(BPF_LDX | BPF_MEM | BPF_W, R3, R1, 4, 0),	// r3 = ctx->data_end
+		bpf_op(BPF_LDX | BPF_MEM | BPF_W, R5, R1, 16, 0),	// r5 = ctx->rx_queue_index
+		bpf_op(BPF_ALU64 | BPF_MOV | BPF_X, R4, R2, 0, 0),
+		bpf_op(BPF_ALU64 | BPF_ADD | BPF_K, R4, 0, 0, 14),
+		bpf_op(BPF_JMP | BPF_JGT | BPF_X, R4, R3, 8, 0),	// Shorter than Ethernet header
+		bpf_op(BPF_LDX | BPF_MEM | BPF_H, R4, R2, 12, 0),	// r4 = ethertype
+		bpf_op(BPF_JMP | BPF_JNE | BPF_K, R4, 0, 6, htons(ETHERCAT_TYPE)),
+		bpf_op(BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+		bpf_op(0, 0, 0, 0, 0),
+		bpf_op(BPF_ALU64 | BPF_MOV | BPF_X, R2, R5, 0, 0),
+		bpf_op(BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, XDP_PASS),
+		bpf_op(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		bpf_op(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		bpf_op(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS),
+		bpf_op(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+	};
+
+	char log[4096];
+	log[0] = '\0';
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t) (uintptr_t) insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(bpf_insn);
+	attr.license = (uint64_t) (uintptr_t) "GPL";
+	attr.log_buf = (uint64_t) (uintptr_t) log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+
+	int prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+
+	if(prog_fd == -1) {
+		perror("Could not load XDP program.");
+		fprintf(stderr, "%s\n", log);
+	}
+
+	return prog_fd;
+}
+
+
+static int create_map()
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = 64;
+
+	int map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+
+	if(map_fd == -1)
+		perror("Could not create socket map.");
+
+	return map_fd;
+}
+
+
+static int update_map(int map_fd, uint32_t queue, uint32_t socket)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uint64_t) (uintptr_t) &queue;
+	attr.value = (uint64_t) (uintptr_t) &socket;
+
+	if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+		perror("Could not register socket.");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Attaches the program to the interface, the link detaches
+ * it again when the descriptor is closed.
+ */
+static int attach_program(int prog_fd, int ifindex, uint32_t flags)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = flags;
+
+	return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+
+/*******************
+ * Rings
+ */
+
+static int map_ring(int sock, xdp_ring_t *ring, const xdp_ring_offset *offset,
+	size_t desc_size, off_t pgoff)
+{
+	ring->map_length = offset->desc + XDP_RING_SIZE * desc_size;
+	ring->map = mmap(NULL, ring->map_length, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, sock, pgoff);
+
+	if(ring->map == MAP_FAILED) {
+		perror("Could not map XDP ring.");
+		ring->map = NULL;
+		return -1;
+	}
+
+	uint8_t *base = (uint8_t *) ring->map;
+	ring->producer = (uint32_t *) (base + offset->producer);
+	ring->consumer = (uint32_t *) (base + offset->consumer);
+	ring->flags = (uint32_t *) (base + offset->flags);
+	ring->descs = base + offset->desc;
+	ring->mask = XDP_RING_SIZE - 1;
+
+	return 0;
+}
+
+
+static void unmap_ring(xdp_ring_t *ring)
+{
+	if(ring->map)
+		munmap(ring->map, ring->map_length);
+	ring->map = NULL;
+}
+
+
+static bool ring_needs_wakeup(const xdp_ring_t *ring)
+{
+	return (__atomic_load_n(ring->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) != 0;
+}
+
+
+/**
+ * Returns buffers to the kernel for receiving.
+ */
+static void fill_ring(ethercat_xdp_t *xdp, const uint64_t *addrs, unsigned int count)
+{
+	uint32_t producer = *xdp->fill.producer;
+	uint64_t *descs = (uint64_t *) xdp->fill.descs;
+
+	for(unsigned int i = 0; i < count; i++)
+		descs[(producer + i) & xdp->fill.mask] = addrs[i];
+
+	__atomic_store_n(xdp->fill.producer, producer + count, __ATOMIC_RELEASE);
+}
+
+
+// Template held by the chunk at addr, -1 for other chunks
+static int template_index(const ethercat_xdp_t *xdp, uint64_t addr)
+{
+	if(addr < xdp->templates || addr >= xdp->templates + XDP_TEMPLATE_NR * XDP_FRAME_SIZE)
+		return -1;
+
+	return (addr - xdp->templates) / XDP_FRAME_SIZE;
+}
+
+
+/**
+ * Moves buffers the kernel has finished transmitting to the free list.
+ */
+static void reap_completions(ethercat_xdp_t *xdp)
+{
+	uint32_t consumer = *xdp->completion.consumer;
+	uint32_t producer = __atomic_load_n(xdp->completion.producer, __ATOMIC_ACQUIRE);
+	uint64_t *descs = (uint64_t *) xdp->completion.descs;
+
+	if(consumer == producer)
+		return;
+
+	while(consumer != producer) {
+		uint64_t addr = descs[consumer++ & xdp->completion.mask];
+		int index = template_index(xdp, addr);
+
+		if(index != -1)
+			xdp->template_sent[index] = false;
+		else
+			xdp->tx_free[xdp->tx_free_count++] = addr;
+	}
+
+	__atomic_store_n(xdp->completion.consumer, consumer, __ATOMIC_RELEASE);
+}
+
+
+/*******************
+ * Socket
+ */
+
+static int bind_socket(int sock, int ifindex, uint16_t flags)
+{
+	struct sockaddr_xdp sxdp;
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = 0;
+	sxdp.sxdp_flags = flags | XDP_USE_NEED_WAKEUP;
+
+	return bind(sock, (struct sockaddr *) &sxdp, sizeof(sxdp));
+}
+
+
+/**
+ * Attaches the program in driver mode and binds the socket
+ * zero-copy when possible, falls back to copy mode and generic
+ * (skb) XDP for drivers without native support such as veth.
+ */
+static int attach_and_bind(ethercat_xdp_t *xdp, int ifindex)
+{
+	xdp->generic = false;
+	xdp->link_fd = attach_program(xdp->prog_fd, ifindex, XDP_FLAGS_DRV_MODE);
+
+	if(xdp->link_fd != -1) {
+		xdp->zero_copy = true;
+		if(bind_socket(xdp->socket, ifindex, XDP_ZEROCOPY) == 0)
+			return 0;
+
+		xdp->zero_copy = false;
+		if(bind_socket(xdp->socket, ifindex, XDP_COPY) == 0)
+			return 0;
+
+		close(xdp->link_fd);
+	}
+
+	xdp->generic = true;
+	xdp->zero_copy = false;
+	xdp->link_fd = attach_program(xdp->prog_fd, ifindex, XDP_FLAGS_SKB_MODE);
+
+	if(xdp->link_fd == -1) {
+		perror("Could not attach XDP program.");
+		return -1;
+	}
+
+	if(bind_socket(xdp->socket, ifindex, XDP_COPY) == -1) {
+		perror("Could not bind XDP socket.");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int open_xdp(const char *interface, ethercat_xdp_t *xdp)
+{
+	memset(xdp, 0, sizeof(ethercat_xdp_t));
+	xdp->socket = -1;
+	xdp->map_fd = -1;
+	xdp->prog_fd = -1;
+	xdp->link_fd = -1;
+
+	// Interface flags can not be changed through an XDP socket
+	int ctl = socket(AF_INET, SOCK_DGRAM, 0);
+	if(ctl == -1) {
+		perror("Could not create control socket.");
+		return -1;
+	}
+
+	int ifindex = open_interface(ctl, interface);
+	close(ctl);
+
+	if(ifindex == -1)
+		return -1;
+
+	xdp->socket = socket(AF_XDP, SOCK_RAW, 0);
+	if(xdp->socket == -1) {
+		perror("Could not create XDP socket.");
+		return -1;
+	}
+
+	// Packet buffer, first half is used for receiving, followed by
+	// the frame templates and the buffers for copies
+	xdp->umem_length = XDP_FRAME_NR * XDP_FRAME_SIZE;
+	void *umem = mmap(NULL, xdp->umem_length, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+	if(umem == MAP_FAILED) {
+		perror("Could not allocate packet buffer.");
+		close_xdp(xdp);
+		return -1;
+	}
+	xdp->umem = (uint8_t *) umem;
+
+	struct xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uint64_t) (uintptr_t) xdp->umem;
+	reg.len = xdp->umem_length;
+	reg.chunk_size = XDP_FRAME_SIZE;
+	reg.headroom = 0;
+
+	if(setsockopt(xdp->socket, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+		perror("Could not register packet buffer.");
+		close_xdp(xdp);
+		return -1;
+	}
+
+	int ring_size = XDP_RING_SIZE;
+	if(setsockopt(xdp->socket, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) == -1 ||
+	   setsockopt(xdp->socket, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) == -1 ||
+	   setsockopt(xdp->socket, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) == -1 ||
+	   setsockopt(xdp->socket, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) == -1) {
+		perror("Could not set XDP ring sizes.");
+		close_xdp(xdp);
+		return -1;
+	}
+
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	if(getsockopt(xdp->socket, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+		perror("Could not get XDP ring offsets.");
+		close_xdp(xdp);
+		return -1;
+	}
+
+	if(map_ring(xdp->socket, &xdp->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+	   map_ring(xdp->socket, &xdp->completion, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+	   map_ring(xdp->socket, &xdp->rx, &off.rx, sizeof(xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+	   map_ring(xdp->socket, &xdp->tx, &off.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING) == -1) {
+		close_xdp(xdp);
+		return -1;
+	}
+
+	xdp->tx_free = (uint64_t *) malloc(XDP_FRAME_NR * sizeof(uint64_t));
+	xdp->rx_held = (uint64_t *) malloc(XDP_FRAME_NR * sizeof(uint64_t));
+
+	if(xdp->tx_free == NULL || xdp->rx_held == NULL) {
+		perror("malloc()");
+		close_xdp(xdp);
+		return -1;
+	}
+
+	// Give the receive half to the kernel
+	unsigned int rx_frames = XDP_FRAME_NR / 2;
+	for(unsigned int i = 0; i < rx_frames; i++)
+		xdp->rx_held[i] = (uint64_t) i * XDP_FRAME_SIZE;
+	fill_ring(xdp, xdp->rx_held, rx_frames);
+
+	xdp->templates = (uint64_t) rx_frames * XDP_FRAME_SIZE;
+
+	for(unsigned int i = rx_frames + XDP_TEMPLATE_NR; i < XDP_FRAME_NR; i++)
+		xdp->tx_free[xdp->tx_free_count++] = (uint64_t) i * XDP_FRAME_SIZE;
+
+	xdp->map_fd = create_map();
+	if(xdp->map_fd == -1) {
+		close_xdp(xdp);
+		return -1;
+	}
+
+	xdp->prog_fd = load_program(xdp->map_fd);
+	if(xdp->prog_fd == -1) {
+		close_xdp(xdp);
+		return -1;
+	}
+
+	if(attach_and_bind(xdp, ifindex) == -1 || update_map(xdp->map_fd, 0, xdp->socket) == -1) {
+		close_xdp(xdp);
+		return -1;
+	}
+
+	// Let the receive path poll the device queue instead of waiting for interrupts
+	int busy_poll = XDP_BUSY_POLL_US;
+	int prefer_busy_poll = 1;
+	int busy_poll_budget = XDP_RING_SIZE;
+
+	if(setsockopt(xdp->socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer_busy_poll, sizeof(prefer_busy_poll)) == -1 ||
+	   setsockopt(xdp->socket, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1 ||
+	   setsockopt(xdp->socket, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &busy_poll_budget, sizeof(busy_poll_budget)) == -1) {
+		perror("Could not enable busy polling.");
+	}
+
+	return 0;
+}
+
+
+void close_xdp(ethercat_xdp_t *xdp)
+{
+	if(xdp->link_fd != -1) close(xdp->link_fd);
+	if(xdp->prog_fd != -1) close(xdp->prog_fd);
+	if(xdp->map_fd != -1) close(xdp->map_fd);
+
+	unmap_ring(&xdp->fill);
+	unmap_ring(&xdp->completion);
+	unmap_ring(&xdp->rx);
+	unmap_ring(&xdp->tx);
+
+	if(xdp->socket != -1) close(xdp->socket);
+	if(xdp->umem) munmap(xdp->umem, xdp->umem_length);
+
+	free(xdp->tx_free);
+	free(xdp->rx_held);
+
+	xdp->socket = -1;
+	xdp->umem = NULL;
+	xdp->tx_free = NULL;
+	xdp->rx_held = NULL;
+}
+
+
+/**
+ * Returns a packet buffer to build the next frame in,
+ * or NULL if all transmit buffers are in flight.
+ */
+uint8_t *xdp_acquire(ethercat_xdp_t *xdp)
+{
+	if(xdp->tx_free_count == 0)
+		reap_completions(xdp);
+
+	if(xdp->tx_free_count == 0)
+		return NULL;
+
+	xdp->tx_pending = xdp->tx_free[--xdp->tx_free_count];
+	return xdp->umem + xdp->tx_pending;
+}
+
+
+/**
+ * Chunk frame template number index is kept in, so it is sent without
+ * a copy. NULL once all template chunks are taken.
+ */
+uint8_t *xdp_template(ethercat_xdp_t *xdp, int index)
+{
+	if(index < 0 || index >= XDP_TEMPLATE_NR)
+		return NULL;
+
+	return xdp->umem + xdp->templates + (uint64_t) index * XDP_FRAME_SIZE;
+}
+
+
+/**
+ * Places a buffer returned by xdp_acquire or xdp_template on the
+ * transmit ring. A template whose previous send has not completed
+ * yet must not be queued twice, a copy of it is sent instead.
+ */
+int xdp_commit(ethercat_xdp_t *xdp, uint8_t *buffer, int length)
+{
+	int index = template_index(xdp, buffer - xdp->umem);
+
+	if(index != -1 && xdp->template_sent[index])
+		reap_completions(xdp);
+
+	if(index != -1 && xdp->template_sent[index]) {
+		uint8_t *copy = xdp_acquire(xdp);
+
+		if(copy == NULL) {
+			fprintf(stderr, "No transmit buffer available.\n");
+			return -1;
+		}
+
+		memcpy(copy, buffer, length);
+		buffer = copy;
+	} else if(index != -1) {
+		xdp->template_sent[index] = true;
+	}
+
+	uint32_t producer = *xdp->tx.producer;
+	xdp_desc *desc = &((xdp_desc *) xdp->tx.descs)[producer & xdp->tx.mask];
+
+	desc->addr = buffer - xdp->umem;
+	desc->len = length;
+	desc->options = 0;
+
+	__atomic_store_n(xdp->tx.producer, producer + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/**
+ * Kicks the kernel, copy mode only transmits from within a system call
+ * and sends a limited batch per call.
+ */
+int xdp_flush(ethercat_xdp_t *xdp)
+{
+	if(xdp->zero_copy && !ring_needs_wakeup(&xdp->tx))
+		return 0;
+
+	for(unsigned int i = 0; i < XDP_RING_SIZE; i++) {
+		if(sendto(xdp->socket, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1) {
+			if(errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+				perror("sendto()");
+				return -1;
+			}
+		}
+
+		if(xdp->zero_copy ||
+		   __atomic_load_n(xdp->tx.consumer, __ATOMIC_ACQUIRE) == *xdp->tx.producer)
+			break;
+	}
+
+	reap_completions(xdp);
+	return 0;
+}
+
+
+/**
+ * Returns the length of the next received frame and points buffer
+ * at it, or returns -1 if no frame is ready. Frames remain valid
+ * until xdp_release is called.
+ */
+int xdp_receive(ethercat_xdp_t *xdp, uint8_t **buffer)
+{
+	uint32_t consumer = *xdp->rx.consumer;
+	uint32_t producer = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+
+	if(consumer == producer) {
+		// Drive the device queue from this thread
+		if(ring_needs_wakeup(&xdp->fill) || xdp->generic)
+			recvfrom(xdp->socket, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		return -1;
+	}
+
+	const xdp_desc *desc = &((const xdp_desc *) xdp->rx.descs)[consumer & xdp->rx.mask];
+
+	xdp->rx_held[xdp->rx_held_count++] = desc->addr;
+	*buffer = xdp->umem + desc->addr;
+	int length = desc->len;
+
+	__atomic_store_n(xdp->rx.consumer, consumer + 1, __ATOMIC_RELEASE);
+
+	return length;
+}
+
+
+/**
+ * Returns all received buffers to the kernel.
+ */
+void xdp_release(ethercat_xdp_t *xdp)
+{
+	if(xdp->rx_held_count == 0)
+		return;
+
+	fill_ring(xdp, xdp->rx_held, xdp->rx_held_count);
+	xdp->rx_held_count = 0;
+}
@@ -0,0 +1,75 @@
+#ifndef __ETHERCAT_XDP_H__
+#define __ETHERCAT_XDP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Producer/consumer ring shared with the kernel.
+ */
+struct xdp_ring_t
+{
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *descs;
+
+	uint32_t mask;
+
+	void *map;
+	size_t map_length;
+};
+
+
+// Chunks of the UMEM that hold frame templates
+#define XDP_TEMPLATE_NR 64
+
+/**
+ * AF_XDP socket with its packet buffer (UMEM). EtherCAT frames are
+ * redirected to the socket by a small XDP program on the interface,
+ * frames are built and decoded in place in the UMEM.
+ */
+struct ethercat_xdp_t
+{
+	int socket;
+	int map_fd;
+	int prog_fd;
+	int link_fd;
+
+	bool zero_copy;
+	bool generic;
+
+	uint8_t *umem;
+	size_t umem_length;
+
+	xdp_ring_t fill;
+	xdp_ring_t completion;
+	xdp_ring_t rx;
+	xdp_ring_t tx;
+
+	// Transmit buffers not in use by the kernel
+	uint64_t *tx_free;
+	unsigned int tx_free_count;
+	uint64_t tx_pending;
+
+	// Templates sent from their own chunk and not yet completed
+	uint64_t templates;
+	bool template_sent[XDP_TEMPLATE_NR];
+
+	// Receive buffers handed out, returned to the fill ring on release
+	uint64_t *rx_held;
+	unsigned int rx_held_count;
+};
+
+int open_xdp(const char *interface, ethercat_xdp_t *xdp);
+void close_xdp(ethercat_xdp_t *xdp);
+
+uint8_t *xdp_acquire(ethercat_xdp_t *xdp);
+uint8_t *xdp_template(ethercat_xdp_t *xdp, int index);
+int xdp_commit(ethercat_xdp_t *xdp, uint8_t *buffer, int length);
+int xdp_flush(ethercat_xdp_t *xdp);
+
+int xdp_receive(ethercat_xdp_t *xdp, uint8_t **buffer);
+void xdp_release(ethercat_xdp_t *xdp);
+
+#endif
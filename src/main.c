@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 #include "ethercat.h"
+#include "ethercat_registers.h"
 
 
 void read_callback(const address_t address, void *payload, uint16_t length, const void *data)
@@ -43,23 +44,6 @@ void read_mboxin(const address_t address, void *payload, uint16_t length, const
 
 
 
-void read_uint16(const address_t address, void *payload, uint16_t length, const void *data)
-{
-	const uint16_t *tmp = (const uint16_t *) data;
-	uint16_t *out = (uint16_t *) payload;
-	*out = *tmp;
-}
-
-
-void read_uint8(const address_t address, void *payload, uint16_t length, const void *data)
-{
-	const uint8_t *tmp = (const uint8_t *) data;
-	uint8_t *out = (uint8_t *) payload;
-	*out = *tmp;
-}
-
-
-
 void read_status(const address_t address, void *payload, uint16_t length, const void *data)
 {
 	const uint8_t *tmp = (const uint8_t *) data;
@@ -112,52 +96,29 @@ void read_interrupt_enable(const address_t address, void *payload, uint16_t leng
 }
 
 
-void write_payload(const address_t address, void *payload, uint16_t length, void *data)
+/**
+ * Runs one cycle for a one-shot that points at a local variable. If
+ * its frame was lost the one-shot would stay queued, so it is cancelled.
+ */
+void run_oneshot(ethercat_t *ethercat, ec_handle_t handle)
 {
-	memcpy(data, payload, length);
+	if(ec_do_cycle(ethercat) == -1)
+		ec_cancel(ethercat, handle);
 }
 
 
-void write_uint16(const address_t address, void *payload, uint16_t length, void *data)
-{
-	uint8_t *tmp = (uint8_t *) data;
-	uint16_t *ptr = (uint16_t *) payload;
-
-	tmp[0] = (*ptr) & 0xFF;
-	tmp[1] = (*ptr) >> 8;
-}
-
 /**
  * Sets address of first device on bus.
  */
-void configure_address(ethercat_t *ethercat, uint16_t address)
-{
-	address_t addr;
-	addr.physical.ado = 0x0000;
-	addr.physical.adp = 0x0010;
-
-	ec_request_write(ethercat, addr, 2, write_uint16, (void *) &address, EC_CALL_ONESHOT | EC_ADDR_AI);
-	ec_do_cycle(ethercat);
-}
-
-
 void set_state(ethercat_t *ethercat, uint16_t state)
 {
-	address_t addr;
-	addr.physical.ado = 0x0001;
-	addr.physical.adp = 0x120;
-	ec_request_write(ethercat, addr, 2, write_uint16, &state, EC_CALL_ONESHOT);
-	ec_do_cycle(ethercat);
+	run_oneshot(ethercat, ec_write<ec_reg_al_control>(ethercat, 0x0001, &state, EC_CALL_ONESHOT));
 }
 
 uint16_t get_state(ethercat_t *ethercat)
 {
-	uint16_t status;
-	address_t addr;
-	addr.physical.ado = 0x0001;
-	addr.physical.adp = 0x130;
-	ec_request_read(ethercat, addr, 2, read_uint16, &status, EC_CALL_ONESHOT);
-	ec_do_cycle(ethercat);
+	uint16_t status = 0x0000;
+	run_oneshot(ethercat, ec_read<ec_reg_al_status>(ethercat, 0x0001, &status, NULL, EC_CALL_ONESHOT));
 	return status;
 }
 //S3152016AD5429001000
@@ -202,7 +163,14 @@ void sync_read_callback(const address_t address, void *payload, uint16_t length,
 int main()
 {
 	struct ethercat_t *ethercat = ec_create("eth2");
-	configure_address(ethercat, 1);
+
+	ec_slave_info_t slaves[16];
+	int count = ec_scan(ethercat, 1, slaves, 16);
+
+	for(int i = 0; i < count; i++) {
+		printf("Slave %d: station %04x, type %02x rev %02x, %d ports, parent %d\n", i, slaves[i].station,
+			slaves[i].type, slaves[i].revision, slaves[i].ports, slaves[i].parent);
+	}
 
 	address_t address;
 	address.physical.ado = 0x0001;
@@ -218,10 +186,8 @@ int main()
 	}
 
 	// Move to INIT
-	set_state(ethercat, 0x01);
-	while(get_state(ethercat) != 0x01) { }
-	set_state(ethercat, 0x02);
-	while(get_state(ethercat) != 0x02) { }
+	ec_set_state(ethercat, NULL, count, 0x01, 1000, 5000);
+	ec_set_state(ethercat, NULL, count, 0x02, 1000, 5000);
 	printf("State is PreOperational\n\n");
 
 	// Write sync manager config
@@ -272,33 +238,32 @@ int main()
 	memset(mboxout, 0, 512);
 	memcpy(mboxout, mboxmsg1, 16);
 	address.physical.adp = 0x1800;
-	ec_request_write(ethercat, address, 512, write_payload, mboxout, EC_CALL_ONESHOT);
+	ec_request_write_from(ethercat, address, 512, mboxout, EC_CALL_ONESHOT);
 	ec_do_cycle(ethercat);
 
-	address.physical.adp = 0x080D;
 	status = 0x00;
 
 	while(!(status & 0x08)) {
-		ec_request_read(ethercat, address, 1, read_uint8, &status, EC_CALL_ONESHOT);
+		ec_read<ec_reg_sm_status<1> >(ethercat, address.physical.ado, &status, NULL, EC_CALL_ONESHOT);
 		ec_do_cycle(ethercat);
 	}
 
 	// Read mailbox
 	address.physical.adp = 0x1C00;
-	ec_request_read(ethercat, address, 512, read_mboxin, NULL, EC_CALL_PERIODIC);
+	ec_handle_t mailbox_read = ec_request_read(ethercat, address, 512, read_mboxin, NULL, EC_CALL_PERIODIC);
 	ec_do_cycle(ethercat);
+	ec_cancel(ethercat, mailbox_read);
 
 	// Clear mailbox
 	memset(mboxout, 0, 512);
 	address.physical.adp = 0x1800;
-	ec_request_write(ethercat, address, 512, write_payload, mboxout, EC_CALL_ONESHOT);
+	ec_request_write_from(ethercat, address, 512, mboxout, EC_CALL_ONESHOT);
 	ec_do_cycle(ethercat);
 
-	address.physical.adp = 0x080D;
 	status = 0x08;
 
 	while((status & 0x08)) {
-		ec_request_read(ethercat, address, 1, read_uint8, &status, EC_CALL_ONESHOT);
+		ec_read<ec_reg_sm_status<1> >(ethercat, address.physical.ado, &status, NULL, EC_CALL_ONESHOT);
 		ec_do_cycle(ethercat);
 	}
 
@@ -308,21 +273,21 @@ int main()
 	// SEND SECOND MESSAGE
 	memcpy(mboxout, mboxmsg2, 16);
 	address.physical.adp = 0x1800;
-	ec_request_write(ethercat, address, 512, write_payload, mboxout, EC_CALL_ONESHOT);
+	ec_request_write_from(ethercat, address, 512, mboxout, EC_CALL_ONESHOT);
 	ec_do_cycle(ethercat);
 
-	address.physical.adp = 0x080D;
 	status = 0x00;
 
 	while(!(status & 0x08)) {
-		ec_request_read(ethercat, address, 1, read_uint8, &status, EC_CALL_ONESHOT);
+		ec_read<ec_reg_sm_status<1> >(ethercat, address.physical.ado, &status, NULL, EC_CALL_ONESHOT);
 		ec_do_cycle(ethercat);
 	}
 
 	// Read mailbox
 	address.physical.adp = 0x1C00;
-	ec_request_read(ethercat, address, 16, read_mboxin, NULL, EC_CALL_PERIODIC);
+	mailbox_read = ec_request_read(ethercat, address, 16, read_mboxin, NULL, EC_CALL_PERIODIC);
 	ec_do_cycle(ethercat);
+	ec_cancel(ethercat, mailbox_read);
 
 
 
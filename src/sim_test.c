@@ -0,0 +1,238 @@
+/**
+ * Tests of the blocking setup steps against the simulated bus, with
+ * frames dropped on the way to the slaves at every position: a single
+ * one, which the step has to recover from, and all frames from there
+ * on until the step gave up, as with a cable pulled. A broadcast change
+ * to Boot also has to see slaves in Init and PreOp, whose states OR to
+ * Boot.
+ *
+ *   g++ -x c++ -O1 -g -fsanitize=address -o ec_sim_test src/sim_test.c src/ethercat*.c -lpthread
+ *
+ *   ec_sim_test [slaves]
+ *
+ * Prints one line per failure and exits with 1 if any test failed.
+ * Built with -fsanitize=address it also catches one-shots that are
+ * still queued when the memory they point at has been freed.
+ */
+
+#include "ethercat.h"
+#include "ethercat_internal.h"
+#include "ethercat_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static const uint16_t FIRST_STATION = 0x1001;
+static const int MAX_SLAVES = 64;
+
+// A state change takes two frames on the simulator, more when one is
+// lost, each of the first frames is dropped in turn
+static const int DROP_POSITIONS = 4;
+
+static const uint16_t STATE_INIT = 0x01;
+static const uint16_t STATE_PREOP = 0x02;
+static const uint16_t STATE_BOOT = 0x03;
+
+// Simulator transport losing the sent frames drop_from to drop_to,
+// counted from 1, drop_to of -1 loses all from drop_from on
+static const ethercat_transport_ops_t *sim_ops;
+static ethercat_transport_ops_t lossy_ops;
+static int sent;
+static int drop_from;
+static int drop_to;
+
+// Puts the first slaves back into Init and PreOp after the first frame,
+// together they read as Boot to a BRD
+static ethercat_sim_t *mix_sim;
+
+
+static void drop_frames(int from, int to)
+{
+	sent = 0;
+	drop_from = from;
+	drop_to = to;
+}
+
+
+static int lossy_send(void *state, uint8_t *buffer, int length)
+{
+	sent++;
+	if(drop_from && sent >= drop_from && (drop_to == -1 || sent <= drop_to))
+		return 0;
+
+	int result = sim_ops->send(state, buffer, length);
+
+	if(mix_sim && sent == 1) {
+		ec_sim_memory(mix_sim, 0)[reg_al_status] = STATE_INIT;
+		ec_sim_memory(mix_sim, 1)[reg_al_status] = STATE_PREOP;
+	}
+
+	return result;
+}
+
+
+static ethercat_t *create_bus(ethercat_sim_t *sim, int count, uint16_t *stations)
+{
+	ec_options_t options;
+	ec_default_options(&options);
+	options.transport = EC_TRANSPORT_SIM;
+	options.simulator = sim;
+
+	ethercat_t *ethercat = ec_create_ex("sim", &options);
+	if(ethercat == NULL)
+		return NULL;
+
+	sim_ops = ethercat->transport.ops;
+	lossy_ops = *sim_ops;
+	lossy_ops.send = lossy_send;
+	ethercat->transport.ops = &lossy_ops;
+
+	drop_frames(0, 0);
+
+	ec_slave_info_t slaves[MAX_SLAVES];
+
+	if(ec_scan(ethercat, FIRST_STATION, slaves, MAX_SLAVES) != count) {
+		ec_destroy(&ethercat);
+		return NULL;
+	}
+
+	for(int i = 0; i < count; i++)
+		stations[i] = slaves[i].station;
+
+	return ethercat;
+}
+
+
+static bool check_state(ethercat_sim_t *sim, int count, uint16_t state)
+{
+	for(int i = 0; i < count; i++) {
+		if((ec_sim_memory(sim, i)[reg_al_status] & 0x1F) != state)
+			return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Changes to PreOp with FPWR/FPRD and back to Init with BWR/BRD while
+ * frame drop is lost. With the link lost from there on the change may
+ * fail, a one-shot it left queued would then write into its freed
+ * state once the cycles after it get through again.
+ */
+static int test_state(int count, int drop, bool link_lost)
+{
+	ethercat_sim_t *sim = ec_sim_create(count);
+	uint16_t stations[MAX_SLAVES];
+	ethercat_t *ethercat = sim?create_bus(sim, count, stations):NULL;
+
+	if(ethercat == NULL) {
+		printf("state, drop %d: setting up the bus failed\n", drop);
+		ec_sim_destroy(&sim);
+		return -1;
+	}
+
+	int failures = 0;
+
+	for(int n = 0; n < 2; n++) {
+		uint16_t state = n?STATE_INIT:STATE_PREOP;
+		const uint16_t *addressed = n?NULL:stations;
+
+		drop_frames(drop, link_lost?-1:drop);
+		int result = ec_set_state(ethercat, addressed, count, state, 0, 100);
+
+		drop_frames(0, 0);
+		for(int i = 0; i < 3; i++)
+			ec_do_cycle(ethercat);
+
+		// Whatever the lost change did, the next one has to work
+		if(link_lost)
+			result = ec_set_state(ethercat, addressed, count, state, 0, 100);
+
+		if(result == -1 || !check_state(sim, count, state)) {
+			printf("state %02x (%s), %s at frame %d: failed\n", state, addressed?"stations":"broadcast",
+				link_lost?"link lost":"drop", drop);
+			failures++;
+		}
+	}
+
+	ec_destroy(&ethercat);
+	ec_sim_destroy(&sim);
+	return failures?-1:0;
+}
+
+
+/**
+ * Changes all slaves to Boot by broadcast, with mixed set the first two
+ * slaves are left in Init and PreOp, which has to fail the change.
+ */
+static int test_boot(int count, bool mixed)
+{
+	ethercat_sim_t *sim = ec_sim_create(count);
+	uint16_t stations[MAX_SLAVES];
+	ethercat_t *ethercat = sim?create_bus(sim, count, stations):NULL;
+
+	if(ethercat == NULL) {
+		printf("boot: setting up the bus failed\n");
+		ec_sim_destroy(&sim);
+		return -1;
+	}
+
+	drop_frames(0, 0);
+	mix_sim = mixed?sim:NULL;
+	int result = ec_set_state(ethercat, NULL, count, STATE_BOOT, 0, 20);
+	mix_sim = NULL;
+
+	int failures = 0;
+
+	if(mixed && result != -1) {
+		printf("state %02x (broadcast), slaves in Init and PreOp: accepted\n", STATE_BOOT);
+		failures++;
+	} else if(!mixed && (result == -1 || !check_state(sim, count, STATE_BOOT))) {
+		printf("state %02x (broadcast): failed\n", STATE_BOOT);
+		failures++;
+	}
+
+	ec_destroy(&ethercat);
+	ec_sim_destroy(&sim);
+	return failures?-1:0;
+}
+
+
+int main(int argc, char **argv)
+{
+	int count = (argc >= 2)?atoi(argv[1]):4;
+
+	if(count <= 0 || count > MAX_SLAVES) {
+		fprintf(stderr, "usage: %s [slaves]\n", argv[0]);
+		return 1;
+	}
+
+	int failures = 0;
+	int tests = 0;
+
+	for(int drop = 0; drop <= DROP_POSITIONS; drop++) {
+		for(int link_lost = 0; link_lost < 2; link_lost++) {
+			// Nothing is lost at frame 0
+			if(drop == 0 && link_lost)
+				continue;
+
+			if(test_state(count, drop, link_lost) == -1)
+				failures++;
+			tests++;
+		}
+	}
+
+	for(int mixed = 0; mixed < 2; mixed++) {
+		// Two slaves are needed to mix their states
+		if(mixed && count < 2)
+			continue;
+
+		if(test_boot(count, mixed) == -1)
+			failures++;
+		tests++;
+	}
+
+	printf("%d of %d tests failed\n", failures, tests);
+	return failures?1:0;
+}